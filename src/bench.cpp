@@ -0,0 +1,648 @@
+/** @file bench.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ *
+ *  Benchmarks the request handlers in-process. The handlers are called
+ *  straight through FuseRamFs::FuseOps, as the session loop would call
+ *  them, but their replies are caught below instead of being sent to the
+ *  kernel, so the numbers show the cost of the filesystem code alone.
+ *  tests/bench.py runs similar workloads against a mounted filesystem.
+ *
+ *  The results are printed as JSON, one object per workload, e.g.
+ *    {"name": "create_flat", "threads": 1, "ops": 50000, "seconds": 0.042,
+ *     "ops_per_second": 1190476, "bytes_per_second": 0,
+ *     "latency_us": {"p50": 0.7, "p90": 0.9, "p99": 2.1, "max": 35.0}}
+ */
+
+#include "common.h"
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "fuse_cpp_ramfs.hpp"
+#include "inode_table.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+/**
+ What a handler replied. Only the parts the workloads look at are kept;
+ read replies are only counted, not copied.
+ */
+struct fuse_req {
+    int error;
+    struct fuse_entry_param entry;
+    struct fuse_file_info fi;
+    size_t size;
+    /* Set to keep the data of buffer replies, as readdir needs */
+    bool keepData;
+    std::string data;
+
+    void Reset() {
+        error = 0;
+        entry.ino = 0;
+        size = 0;
+        data.clear();
+    }
+};
+
+/* The replies below take the place of those in libfuse */
+
+int fuse_reply_err(fuse_req_t req, int err) {
+    req->error = err;
+    return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) {
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+    req->entry = *e;
+    return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi) {
+    req->entry = *e;
+    req->fi = *fi;
+    return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout) {
+    req->entry.attr = *attr;
+    return 0;
+}
+
+int fuse_reply_readlink(fuse_req_t req, const char *link) {
+    req->size = strlen(link);
+    return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+    req->fi = *fi;
+    return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+    req->size = count;
+    return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) {
+    req->size = size;
+    if (req->keepData && size > 0) {
+        req->data.assign(buf, size);
+    }
+    return 0;
+}
+
+int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count) {
+    for (int i = 0; i < count; ++i) {
+        req->size += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags) {
+    req->size = fuse_buf_size(bufv);
+    return 0;
+}
+
+int fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf) {
+    return 0;
+}
+
+int fuse_reply_xattr(fuse_req_t req, size_t count) {
+    req->size = count;
+    return 0;
+}
+
+int fuse_reply_lock(fuse_req_t req, const struct flock *lock) {
+    return 0;
+}
+
+int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size) {
+    req->error = result < 0 ? -result : 0;
+    return 0;
+}
+
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req) {
+    static struct fuse_ctx ctx = [] {
+        struct fuse_ctx c = {};
+        c.uid = getuid();
+        c.gid = getgid();
+        c.pid = getpid();
+        return c;
+    }();
+    return &ctx;
+}
+
+namespace {
+
+/* Calls a handler the way the session loop does */
+template <typename Handler, typename... Args>
+void Call(fuse_req &req, Handler handler, Args... args) {
+    InodeTable::Guard guard;
+    req.Reset();
+    handler(&req, args...);
+}
+
+void Check(bool ok, const char *what, const fuse_req &req) {
+    if (!ok) {
+        fprintf(stderr, "fuse-cpp-ramfs-bench: %s failed: %s\n", what, strerror(req.error));
+        exit(1);
+    }
+}
+
+fuse_ino_t Mkdir(fuse_req &req, fuse_ino_t parent, const char *name) {
+    Call(req, FuseRamFs::FuseOps.mkdir, parent, name, (mode_t) 0755);
+    Check(req.error == 0, "mkdir", req);
+    return req.entry.ino;
+}
+
+fuse_ino_t Create(fuse_req &req, fuse_ino_t parent, const char *name) {
+    struct fuse_file_info fi = {};
+    fi.flags = O_RDWR | O_CREAT;
+    Call(req, FuseRamFs::FuseOps.create, parent, name, (mode_t) (S_IFREG | 0644), &fi);
+    Check(req.error == 0, "create", req);
+    fuse_ino_t ino = req.entry.ino;
+    fi = req.fi;
+    Call(req, FuseRamFs::FuseOps.release, ino, &fi);
+    return ino;
+}
+
+fuse_ino_t Lookup(fuse_req &req, fuse_ino_t parent, const char *name) {
+    Call(req, FuseRamFs::FuseOps.lookup, parent, name);
+    Check(req.error == 0, "lookup", req);
+    return req.entry.ino;
+}
+
+void Stat(fuse_req &req, fuse_ino_t ino) {
+    Call(req, FuseRamFs::FuseOps.getattr, ino, (struct fuse_file_info *) nullptr);
+    Check(req.error == 0, "getattr", req);
+}
+
+void Unlink(fuse_req &req, fuse_ino_t parent, const char *name) {
+    Call(req, FuseRamFs::FuseOps.unlink, parent, name);
+    Check(req.error == 0, "unlink", req);
+}
+
+void Rmdir(fuse_req &req, fuse_ino_t parent, const char *name) {
+    Call(req, FuseRamFs::FuseOps.rmdir, parent, name);
+    Check(req.error == 0, "rmdir", req);
+}
+
+/* Drops the lookups the kernel would be holding, so inodes get reclaimed */
+void Forget(fuse_req &req, fuse_ino_t ino, unsigned long nlookup) {
+    Call(req, FuseRamFs::FuseOps.forget, ino, nlookup);
+}
+
+void Rename(fuse_req &req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    Call(req, FuseRamFs::FuseOps.rename, parent, name, newparent, newname);
+    Check(req.error == 0, "rename", req);
+}
+
+void Truncate(fuse_req &req, fuse_ino_t ino, off_t size) {
+    struct stat attr = {};
+    attr.st_size = size;
+    Call(req, FuseRamFs::FuseOps.setattr, ino, &attr, FUSE_SET_ATTR_SIZE, (struct fuse_file_info *) nullptr);
+    Check(req.error == 0, "truncate", req);
+}
+
+void Write(fuse_req &req, fuse_ino_t ino, const char *buf, size_t size, off_t off) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void *) buf;
+    struct fuse_file_info fi = {};
+    Call(req, FuseRamFs::FuseOps.write_buf, ino, &bufv, off, &fi);
+    Check(req.error == 0 && req.size == size, "write", req);
+}
+
+void Read(fuse_req &req, fuse_ino_t ino, size_t size, off_t off) {
+    struct fuse_file_info fi = {};
+    Call(req, FuseRamFs::FuseOps.read, ino, size, off, &fi);
+    Check(req.error == 0, "read", req);
+}
+
+/**
+ Reads a whole directory through one open handle.
+
+ @return The number of entries.
+ */
+size_t ReadDir(fuse_req &req, fuse_ino_t ino, size_t bufSize) {
+    struct fuse_file_info fi = {};
+    Call(req, FuseRamFs::FuseOps.opendir, ino, &fi);
+    Check(req.error == 0, "opendir", req);
+    fi = req.fi;
+
+    size_t entries = 0;
+    off_t off = 0;
+    req.keepData = true;
+    for (;;) {
+        Call(req, FuseRamFs::FuseOps.readdir, ino, bufSize, off, &fi);
+        Check(req.error == 0, "readdir", req);
+        if (req.data.empty()) {
+            break;
+        }
+        /* Walk the struct fuse_dirent records to find where to go on */
+        for (size_t pos = 0; pos + 24 <= req.data.size(); ) {
+            uint64_t next;
+            uint32_t namelen;
+            memcpy(&next, req.data.data() + pos + 8, sizeof(next));
+            memcpy(&namelen, req.data.data() + pos + 16, sizeof(namelen));
+            off = next;
+            ++entries;
+            pos += (24 + namelen + 7) & ~(size_t) 7;
+        }
+    }
+    req.keepData = false;
+    Call(req, FuseRamFs::FuseOps.releasedir, ino, &fi);
+    return entries;
+}
+
+std::vector<std::string> Names(const char *prefix, size_t count) {
+    std::vector<std::string> names(count);
+    for (size_t i = 0; i < count; ++i) {
+        names[i] = prefix + std::to_string(i);
+    }
+    return names;
+}
+
+/* A fresh, empty filesystem for the duration of a workload group */
+class Mount {
+public:
+    Mount() {
+        struct fuse_conn_info conn = {};
+        FuseRamFs::FuseOps.init(nullptr, &conn);
+    }
+    ~Mount() {
+        FuseRamFs::FuseOps.destroy(nullptr);
+    }
+};
+
+struct Options {
+    unsigned threads;
+    double scale;
+};
+
+Options g_options = {0, 1.0};
+
+size_t Scaled(size_t n) {
+    return std::max<size_t>(1, (size_t) (n * g_options.scale));
+}
+
+bool g_firstResult = true;
+
+/**
+ Runs a workload on several threads at once and prints its results.
+
+ @param name The name of the workload.
+ @param threads How many threads run it.
+ @param ops How many operations each thread does.
+ @param bytesPerOp The data each operation moves, for the throughput.
+ @param op Does operation i of a thread.
+ */
+void Measure(const char *name, unsigned threads, size_t ops, size_t bytesPerOp,
+             const std::function<void(fuse_req &req, unsigned thread, size_t i)> &op) {
+    std::vector<std::vector<uint32_t>> latencies(threads);
+    std::vector<uint64_t> starts(threads), ends(threads);
+    std::atomic<unsigned> ready(0);
+    auto body = [&](unsigned t) {
+        fuse_req req = {};
+        std::vector<uint32_t> &lat = latencies[t];
+        lat.resize(ops);
+        /* Start together, so the threads really contend */
+        ready.fetch_add(1);
+        while (ready.load() < threads) {
+            std::this_thread::yield();
+        }
+        starts[t] = Metrics::Now();
+        uint64_t last = starts[t];
+        for (size_t i = 0; i < ops; ++i) {
+            op(req, t, i);
+            uint64_t now = Metrics::Now();
+            lat[i] = (uint32_t) std::min<uint64_t>(now - last, UINT32_MAX);
+            last = now;
+        }
+        ends[t] = last;
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.emplace_back(body, t);
+    }
+    body(0);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    std::vector<uint32_t> all;
+    all.reserve(threads * ops);
+    for (const std::vector<uint32_t> &lat : latencies) {
+        all.insert(all.end(), lat.begin(), lat.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0.0 : all[std::min(all.size() - 1, (size_t) (p * all.size()))] / 1e3;
+    };
+    double seconds = (*std::max_element(ends.begin(), ends.end()) -
+                      *std::min_element(starts.begin(), starts.end())) / 1e9;
+    double total = (double) threads * ops;
+
+    printf("%s  {\"name\": \"%s\", \"threads\": %u, \"ops\": %.0f, \"seconds\": %.6f, "
+           "\"ops_per_second\": %.0f, \"bytes_per_second\": %.0f, "
+           "\"latency_us\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}",
+           g_firstResult ? "" : ",\n", name, threads, total, seconds,
+           total / seconds, total * bytesPerOp / seconds,
+           percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.0));
+    fflush(stdout);
+    g_firstResult = false;
+}
+
+/* Creates, stats, renames and removes many files in one directory */
+void FlatTree() {
+    Mount mount;
+    fuse_req req = {};
+    const size_t n = Scaled(50000);
+    fuse_ino_t dir = Mkdir(req, FUSE_ROOT_ID, "flat");
+    fuse_ino_t other = Mkdir(req, FUSE_ROOT_ID, "other");
+    std::vector<std::string> names = Names("file", n);
+    std::vector<std::string> renamed = Names("renamed", n);
+    std::vector<fuse_ino_t> inos(n);
+
+    Measure("create_flat", 1, n, 0, [&](fuse_req &req, unsigned, size_t i) {
+        inos[i] = Create(req, dir, names[i].c_str());
+    });
+    Measure("stat_flat", 1, n, 0, [&](fuse_req &req, unsigned, size_t i) {
+        Stat(req, Lookup(req, dir, names[i].c_str()));
+        Forget(req, inos[i], 1);
+    });
+    Measure("readdir_flat", 1, 10, 0, [&](fuse_req &req, unsigned, size_t) {
+        ReadDir(req, dir, 64 * 1024);
+    });
+    Measure("rename_flat", 1, n, 0, [&](fuse_req &req, unsigned, size_t i) {
+        Rename(req, dir, names[i].c_str(), dir, renamed[i].c_str());
+    });
+    Measure("rename_across", 1, n, 0, [&](fuse_req &req, unsigned, size_t i) {
+        Rename(req, dir, renamed[i].c_str(), other, names[i].c_str());
+    });
+    Measure("unlink_flat", 1, n, 0, [&](fuse_req &req, unsigned, size_t i) {
+        Unlink(req, other, names[i].c_str());
+        Forget(req, inos[i], 1);
+    });
+}
+
+/* The same in a tree of directories, looking files up by their path */
+void DeepTree() {
+    Mount mount;
+    fuse_req req = {};
+    const size_t depth = 6, fanout = 4, filesPerDir = Scaled(4);
+    std::vector<std::string> dirNames = Names("dir", fanout), fileNames = Names("file", filesPerDir);
+
+    /* Directory j of a level is child j % fanout of directory j / fanout
+     * of the level above */
+    std::vector<std::pair<size_t, size_t>> order;
+    size_t width = 1;
+    for (size_t level = 0; level < depth; ++level) {
+        width *= fanout;
+        for (size_t j = 0; j < width; ++j) {
+            order.push_back({level, j});
+        }
+    }
+    const size_t leaves = width;
+    std::vector<std::vector<fuse_ino_t>> dirs(depth);
+    for (size_t level = 0; level < depth; ++level) {
+        dirs[level].resize(order.back().second + 1);
+    }
+
+    Measure("mkdir_deep", 1, order.size(), 0, [&](fuse_req &req, unsigned, size_t i) {
+        size_t level = order[i].first, j = order[i].second;
+        fuse_ino_t parent = level == 0 ? FUSE_ROOT_ID : dirs[level - 1][j / fanout];
+        dirs[level][j] = Mkdir(req, parent, dirNames[j % fanout].c_str());
+    });
+    Measure("create_deep", 1, leaves * filesPerDir, 0, [&](fuse_req &req, unsigned, size_t i) {
+        Create(req, dirs[depth - 1][i / filesPerDir], fileNames[i % filesPerDir].c_str());
+    });
+    /* Each op walks the whole path, as a cold dentry cache makes the
+     * kernel do */
+    Measure("stat_deep", 1, leaves * filesPerDir, 0, [&](fuse_req &req, unsigned, size_t i) {
+        size_t leaf = i / filesPerDir;
+        fuse_ino_t dir = FUSE_ROOT_ID;
+        for (size_t level = 0, below = leaves / fanout; level < depth; ++level, below /= fanout) {
+            dir = Lookup(req, dir, dirNames[(leaf / below) % fanout].c_str());
+        }
+        fuse_ino_t ino = Lookup(req, dir, fileNames[i % filesPerDir].c_str());
+        Stat(req, ino);
+        Forget(req, ino, 1);
+    });
+    Measure("unlink_deep", 1, leaves * filesPerDir, 0, [&](fuse_req &req, unsigned, size_t i) {
+        fuse_ino_t dir = dirs[depth - 1][i / filesPerDir];
+        const char *name = fileNames[i % filesPerDir].c_str();
+        fuse_ino_t ino = Lookup(req, dir, name);
+        Unlink(req, dir, name);
+        Forget(req, ino, 2);
+    });
+    Measure("rmdir_deep", 1, order.size(), 0, [&](fuse_req &req, unsigned, size_t i) {
+        /* Deepest first */
+        size_t level = order[order.size() - 1 - i].first, j = order[order.size() - 1 - i].second;
+        fuse_ino_t parent = level == 0 ? FUSE_ROOT_ID : dirs[level - 1][j / fanout];
+        Rmdir(req, parent, dirNames[j % fanout].c_str());
+    });
+}
+
+/* Reads a directory far larger than a readdir buffer */
+void HugeDirectory() {
+    Mount mount;
+    fuse_req req = {};
+    const size_t n = Scaled(200000);
+    fuse_ino_t dir = Mkdir(req, FUSE_ROOT_ID, "huge");
+    std::vector<std::string> names = Names("a-rather-long-file-name-", n);
+    for (size_t i = 0; i < n; ++i) {
+        Create(req, dir, names[i].c_str());
+    }
+    Measure("readdir_huge", 1, 5, 0, [&](fuse_req &req, unsigned, size_t) {
+        ReadDir(req, dir, 128 * 1024);
+    });
+}
+
+/* Large sequential and small random reads and writes of one file */
+void FileIo() {
+    Mount mount;
+    fuse_req req = {};
+    const size_t chunk = 128 * 1024, block = 4096;
+    const size_t size = Scaled(256) * 1024 * 1024;
+    std::vector<char> buf(chunk, 'x');
+    fuse_ino_t ino = Create(req, FUSE_ROOT_ID, "data");
+
+    Measure("write_seq", 1, size / chunk, chunk, [&](fuse_req &req, unsigned, size_t i) {
+        Write(req, ino, buf.data(), chunk, i * chunk);
+    });
+    Measure("read_seq", 1, size / chunk, chunk, [&](fuse_req &req, unsigned, size_t i) {
+        Read(req, ino, chunk, i * chunk);
+    });
+    std::mt19937_64 rng(1);
+    std::vector<off_t> offsets(Scaled(100000));
+    for (off_t &off : offsets) {
+        off = (rng() % (size / block)) * block;
+    }
+    Measure("write_random_4k", 1, offsets.size(), block, [&](fuse_req &req, unsigned, size_t i) {
+        Write(req, ino, buf.data(), block, offsets[i]);
+    });
+    Measure("read_random_4k", 1, offsets.size(), block, [&](fuse_req &req, unsigned, size_t i) {
+        Read(req, ino, block, offsets[i]);
+    });
+}
+
+/* Several threads at once on shared and on separate parts of the tree */
+void Contention() {
+    const unsigned threads = g_options.threads;
+    const size_t n = Scaled(20000);
+    std::vector<std::string> names = Names("file", n);
+
+    {
+        Mount mount;
+        fuse_req req = {};
+        fuse_ino_t shared = Mkdir(req, FUSE_ROOT_ID, "shared");
+        std::vector<fuse_ino_t> own(threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            own[t] = Mkdir(req, FUSE_ROOT_ID, ("own" + std::to_string(t)).c_str());
+        }
+        std::vector<std::vector<std::string>> threadNames(threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            threadNames[t] = Names(("t" + std::to_string(t) + "-").c_str(), n);
+        }
+
+        /* Each op is a file's whole life: create, stat, unlink */
+        auto life = [&](fuse_req &req, fuse_ino_t dir, const char *name) {
+            fuse_ino_t ino = Create(req, dir, name);
+            Stat(req, Lookup(req, dir, name));
+            Unlink(req, dir, name);
+            Forget(req, ino, 2);
+        };
+        Measure("create_stat_unlink_shared_dir", threads, n, 0, [&](fuse_req &req, unsigned t, size_t i) {
+            life(req, shared, threadNames[t][i].c_str());
+        });
+        Measure("create_stat_unlink_own_dir", threads, n, 0, [&](fuse_req &req, unsigned t, size_t i) {
+            life(req, own[t], names[i].c_str());
+        });
+
+        /* Renames back and forth between two names per thread */
+        std::vector<std::string> other = Names("other", threads), first = Names("first", threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            Create(req, shared, first[t].c_str());
+        }
+        Measure("rename_shared_dir", threads, n, 0, [&](fuse_req &req, unsigned t, size_t i) {
+            const char *from = (i % 2 == 0 ? first : other)[t].c_str();
+            const char *to = (i % 2 == 0 ? other : first)[t].c_str();
+            Rename(req, shared, from, shared, to);
+        });
+        std::vector<std::string> moving = Names("moving", threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            Create(req, shared, moving[t].c_str());
+        }
+        Measure("rename_across_dirs", threads, n, 0, [&](fuse_req &req, unsigned t, size_t i) {
+            fuse_ino_t from = i % 2 == 0 ? shared : own[t];
+            fuse_ino_t to = i % 2 == 0 ? own[t] : shared;
+            Rename(req, from, moving[t].c_str(), to, moving[t].c_str());
+        });
+    }
+
+    {
+        Mount mount;
+        fuse_req req = {};
+        const size_t block = 4096, size = Scaled(64) * 1024 * 1024;
+        std::vector<char> buf(128 * 1024, 'y');
+        fuse_ino_t ino = Create(req, FUSE_ROOT_ID, "data");
+        for (size_t off = 0; off < size; off += buf.size()) {
+            Write(req, ino, buf.data(), buf.size(), off);
+        }
+        std::vector<std::mt19937_64> rngs;
+        for (unsigned t = 0; t < threads; ++t) {
+            rngs.emplace_back(t + 1);
+        }
+        Measure("read_random_4k_one_file", threads, Scaled(100000), block, [&](fuse_req &req, unsigned t, size_t) {
+            Read(req, ino, block, (rngs[t]() % (size / block)) * block);
+        });
+        Measure("write_random_4k_one_file", threads, Scaled(100000), block, [&](fuse_req &req, unsigned t, size_t) {
+            Write(req, ino, buf.data(), block, (rngs[t]() % (size / block)) * block);
+        });
+
+        /* A chunked download: the file is sized first, then every thread
+         * fills a part of its own */
+        fuse_ino_t chunked = Create(req, FUSE_ROOT_ID, "chunked");
+        Truncate(req, chunked, size);
+        const size_t part = size / threads / buf.size() * buf.size();
+        Measure("write_parts_one_file", threads, part / buf.size(), buf.size(), [&](fuse_req &req, unsigned t, size_t i) {
+            Write(req, chunked, buf.data(), buf.size(), t * part + i * buf.size());
+        });
+    }
+}
+
+/* The groups of workloads. Workloads in a group build on each other,
+ * so only the whole group can be picked. */
+const struct {
+    const char *name;
+    void (*run)();
+} Groups[] = {
+    {"flat", FlatTree},
+    {"deep", DeepTree},
+    {"readdir", HugeDirectory},
+    {"io", FileIo},
+    {"contention", Contention},
+};
+
+void Usage(const char *argv0) {
+    fprintf(stderr,
+            "USAGE: %s [-t THREADS] [-s SCALE] [GROUP...]\n"
+            "  -t THREADS  Threads for the contention workloads (default: CPUs, at most 8)\n"
+            "  -s SCALE    Multiplies the size of every workload (default: 1)\n"
+            "  GROUP       Run only these groups of workloads:\n"
+            "              flat, deep, readdir, io, contention (default: all)\n",
+            argv0);
+    exit(1);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    g_options.threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    int c;
+    while ((c = getopt(argc, argv, "t:s:h")) != -1) {
+        switch (c) {
+        case 't':
+            g_options.threads = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            g_options.scale = atof(optarg);
+            if (g_options.scale <= 0) {
+                Usage(argv[0]);
+            }
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+    std::vector<void (*)()> runs;
+    for (int i = optind; i < argc; ++i) {
+        auto group = std::find_if(std::begin(Groups), std::end(Groups),
+                                  [&](const auto &g) { return strcmp(g.name, argv[i]) == 0; });
+        if (group == std::end(Groups)) {
+            Usage(argv[0]);
+        }
+        runs.push_back(group->run);
+    }
+    if (runs.empty()) {
+        for (const auto &group : Groups) {
+            runs.push_back(group.run);
+        }
+    }
+
+    /* Room for the largest workload, the 256 MiB file of FileIo() */
+    FuseRamFs fs(std::max<fsblkcnt_t>(8388608, Scaled(256) * 2 * 1024 * 1024 / Inode::BufBlockSize),
+                 std::max<fsfilcnt_t>(1048576, 2 * Scaled(200000)));
+
+    printf("{\"threads\": %u, \"scale\": %g, \"results\": [\n", g_options.threads, g_options.scale);
+    for (void (*run)() : runs) {
+        run();
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include <stdexcept>
 #include <atomic>
 #include <unordered_map>
+#include <string_view>
 
 #include <cstdio>
 #include <cstdlib>
@@ -0,0 +1,141 @@
+/** @file compressor.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "compressor.hpp"
+#include "inode.hpp"
+#include "file.hpp"
+#include "inode_table.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+unsigned Compressor::ColdSeconds = 0;
+
+std::mutex Compressor::m_mutex;
+std::condition_variable Compressor::m_cv;
+std::thread Compressor::m_thread;
+bool Compressor::m_running = false;
+std::atomic<bool> Compressor::m_stopping(false);
+
+bool Compressor::Available() {
+#ifdef HAVE_LZ4
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ Compresses a page, if that saves enough to be worth decompressing it
+ again.
+
+ @param page The page.
+ @return The compressed page, to be released with Free(), or nullptr.
+ */
+char *Compressor::Compress(const char *page) {
+#ifdef HAVE_LZ4
+    /* LZ4 gives up on anything which doesn't fit */
+    char out[File::BlocksPerPage * 3 / 4 * Inode::BufBlockSize];
+    int size = LZ4_compress_default(page, out + sizeof(uint32_t), File::PageSize,
+                                    sizeof(out) - sizeof(uint32_t));
+    if (size <= 0) {
+        return nullptr;
+    }
+    uint32_t size32 = size;
+    memcpy(out, &size32, sizeof(size32));
+    char *blob = (char *) malloc(sizeof(uint32_t) + size);
+    if (blob == nullptr) {
+        return nullptr;
+    }
+    memcpy(blob, out, sizeof(uint32_t) + size);
+    return (char *) ((uintptr_t) blob | 1);
+#else
+    return nullptr;
+#endif
+}
+
+/**
+ Decompresses a page made by Compress().
+
+ @param page The compressed page.
+ @param out Where to put the PageSize bytes of the page.
+ @return false if the compressed data is damaged.
+ */
+bool Compressor::Decompress(const char *page, char *out) {
+#ifdef HAVE_LZ4
+    uint32_t size;
+    const char *data = Blob(page, &size);
+    Metrics::Count(Metrics::PagesDecompressed, 1);
+    return LZ4_decompress_safe(data, out, size, File::PageSize) == (int) File::PageSize;
+#else
+    return false;
+#endif
+}
+
+/* The blocks a compressed page is charged for */
+size_t Compressor::Blocks(const char *page) {
+    uint32_t size;
+    Blob(page, &size);
+    return get_nblocks(sizeof(uint32_t) + size, Inode::BufBlockSize);
+}
+
+/* The compressor thread: every half of ColdSeconds, offers every file to
+ * be compressed. */
+void Compressor::Run() {
+    const auto interval = std::chrono::seconds(std::max(1u, ColdSeconds / 2));
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (!m_stopping) {
+        m_cv.wait_for(lk, interval, [] { return m_stopping.load(); });
+        uint32_t now = Now();
+        if (m_stopping || now < ColdSeconds) {
+            continue;
+        }
+        lk.unlock();
+        for (fuse_ino_t ino = FUSE_ROOT_ID; ino < InodeTable::Limit() && !m_stopping; ++ino) {
+            /* Keeps the file from being deleted while it is compressed */
+            InodeTable::Guard guard;
+            File *file = inode_cast<File>(InodeTable::Get(ino));
+            if (file != nullptr) {
+                file->CompressCold(now - ColdSeconds);
+            }
+        }
+        lk.lock();
+    }
+}
+
+/**
+ Starts compressing cold files on a thread of its own, unless ColdSeconds
+ is 0.
+ */
+void Compressor::Start() {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (m_running || ColdSeconds == 0 || !Available()) {
+        return;
+    }
+    m_stopping = false;
+    m_thread = std::thread(Run);
+    m_running = true;
+}
+
+void Compressor::Stop() {
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (!m_running) {
+            return;
+        }
+        m_stopping = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_running = false;
+}
@@ -0,0 +1,78 @@
+/** @file compressor.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef compressor_hpp
+#define compressor_hpp
+
+#include "common.h"
+
+#include <condition_variable>
+#include <thread>
+
+/**
+ Compresses the pages of files nobody has read or written for a while,
+ so that cold data takes less of the filesystem's capacity.
+
+ A thread walks the inode table every so often and has each file which
+ went cold since it last looked compress its pages with LZ4. A page is
+ only kept compressed if that saves at least a quarter of it; pages
+ shared with other files or mapped from a snapshot image are left as
+ they are.
+
+ A compressed page replaces the pool page in the file's page table. Its
+ pointer has the lowest bit set, which a page-aligned pool page never
+ has, and leads to a malloc'd blob: the compressed size, then the data.
+ A file is charged only for the blocks of the blob. Reads decompress
+ into a scratch buffer and leave the page compressed; a write first
+ turns it back into a pool page.
+
+ Without LZ4 at build time, Available() is false and nothing is ever
+ compressed.
+ */
+class Compressor {
+public:
+    /* Seconds a file must go untouched before it is compressed; 0 for never */
+    static unsigned ColdSeconds;
+
+private:
+    static std::mutex m_mutex;
+    static std::condition_variable m_cv;
+    static std::thread m_thread;
+    /* Guarded by m_mutex */
+    static bool m_running;
+    /* Also checked between files, without the mutex */
+    static std::atomic<bool> m_stopping;
+
+    static void Run();
+    static const char *Blob(const char *page, uint32_t *size) {
+        const char *blob = (const char *) ((uintptr_t) page & ~(uintptr_t) 1);
+        memcpy(size, blob, sizeof(*size));
+        return blob + sizeof(*size);
+    }
+
+public:
+    static bool Available();
+
+    static bool IsCompressed(const char *page) { return ((uintptr_t) page & 1) != 0; }
+    static char *Compress(const char *page);
+    static bool Decompress(const char *page, char *out);
+    static size_t Blocks(const char *page);
+    static void Free(char *page) { free((void *) ((uintptr_t) page & ~(uintptr_t) 1)); }
+
+    /* A coarse clock for telling how long files went untouched */
+    static uint32_t Now() {
+        struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return (uint32_t) ts.tv_sec;
+    }
+
+    static void Start();
+    static void Stop();
+};
+
+#endif /* compressor_hpp */
@@ -0,0 +1,215 @@
+/** @file control.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "slab.hpp"
+#include "metrics.hpp"
+#include "fuse_cpp_ramfs.hpp"
+#include "quota.hpp"
+#include "control.hpp"
+
+using namespace std;
+
+int ControlSocket::m_fd = -1;
+std::string ControlSocket::m_path;
+std::thread ControlSocket::m_thread;
+std::atomic<bool> ControlSocket::m_stopping(false);
+
+/**
+ Starts answering commands on a Unix socket. A stale socket left at the
+ path by an earlier run is replaced; any other file is not.
+
+ @param path Where to create the socket.
+ @return true on success.
+ */
+bool ControlSocket::Start(const char *path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strnlen(path, sizeof(addr.sun_path)) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "fuse-cpp-ramfs: control socket path is too long: %s\n", path);
+        return false;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    /* Not SOCK_CLOEXEC, which only some systems have */
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_fd < 0 ||
+        fcntl(m_fd, F_SETFD, FD_CLOEXEC) != 0 ||
+        bind(m_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        chmod(path, 0600) != 0 ||
+        listen(m_fd, 8) != 0) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot create control socket %s: %s\n", path, strerror(errno));
+        if (m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        return false;
+    }
+
+    m_path = path;
+    m_stopping = false;
+    m_thread = std::thread(Serve);
+    return true;
+}
+
+void ControlSocket::Stop() {
+    if (m_fd < 0) {
+        return;
+    }
+    m_stopping = true;
+    /* Wakes up the accept() in Serve() */
+    shutdown(m_fd, SHUT_RDWR);
+    m_thread.join();
+    close(m_fd);
+    m_fd = -1;
+    unlink(m_path.c_str());
+}
+
+/* Takes a number off the end of a quota command */
+static bool PopNumber(std::string &args, uint64_t *value) {
+    size_t space = args.rfind(' ');
+    if (space == std::string::npos || space + 1 == args.size()) {
+        return false;
+    }
+    const char *start = args.c_str() + space + 1;
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(start, &end, 10);
+    if (*end != '\0' || errno != 0 || *start == '-') {
+        return false;
+    }
+    *value = n;
+    args.resize(space);
+    return true;
+}
+
+/**
+ Answers a quota command: with a path, the usage and limits of the quota
+ on it; with a path, bytes and inodes as well, sets its limits.
+
+ @param args What follows "quota ".
+ @return The answer.
+ */
+std::string ControlSocket::RunQuota(const std::string &args) {
+    std::string path = args;
+    uint64_t bytes, inodes;
+    bool set = PopNumber(path, &inodes) && PopNumber(path, &bytes);
+    if (!set) {
+        path = args;
+    }
+
+    int res = 0;
+    if (set) {
+        res = FuseRamFs::SetQuota(path, bytes, inodes);
+    }
+    std::string out;
+    if (!set || res == 0) {
+        res = FuseRamFs::DescribeQuota(path, out);
+    }
+    if (res < 0) {
+        return "quota " + path + ": " + strerror(-res) + "\n";
+    }
+    return out;
+}
+
+/**
+ Answers one command.
+
+ @param command The command, without the line break.
+ @return The answer.
+ */
+std::string ControlSocket::Run(const std::string &command) {
+    if (command == "slabs") {
+        return Slab::Report();
+    } else if (command == "metrics") {
+        return Metrics::Report();
+    } else if (command.compare(0, 5, "drop ") == 0) {
+        std::string path = command.substr(5);
+        ssize_t res = FuseRamFs::DropTree(path);
+        if (res < 0) {
+            return "drop " + path + ": " + strerror(-res) + "\n";
+        }
+        return "dropped " + std::to_string(res) + " names\n";
+    } else if (command == "quotas") {
+        return Quota::Report();
+    } else if (command.compare(0, 6, "quota ") == 0) {
+        return RunQuota(command.substr(6));
+    } else if (command == "help") {
+        return "slabs      Usage of the inode slabs\n"
+               "metrics    Request counts, latencies and lock waits, for Prometheus\n"
+               "drop PATH  Remove PATH and everything below it at once\n"
+               "quota PATH [BYTES INODES]\n"
+               "           Show, or limit, what the directory PATH may hold; 0 is no limit\n"
+               "quotas     Usage and limits of every quota\n"
+               "help       This list\n";
+    }
+    return "unknown command: " + command + "\n";
+}
+
+void ControlSocket::Serve() {
+    while (!m_stopping) {
+        int client = accept(m_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+
+        /* A client which never finishes its line can't hold us up */
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string line;
+        char buf[256];
+        ssize_t n = 0;
+        while ((line.empty() || line.back() != '\n') && line.size() < 4096 &&
+               (n = recv(client, buf, sizeof(buf), 0)) > 0) {
+            line.append(buf, n);
+        }
+        size_t start = 0;
+        std::string answer;
+        /* A line cut off by the timeout or the size limit could make drop
+         * take a shorter path than meant, so then nothing is run. Only a
+         * client which closed its end may leave out the last line break. */
+        if (n != 0 && (line.empty() || line.back() != '\n')) {
+            answer = "command not finished within 1 s or 4096 bytes; nothing run\n";
+            start = line.size();
+        }
+        for (size_t end; (end = line.find('\n', start)) != std::string::npos; start = end + 1) {
+            std::string command = line.substr(start, end - start);
+            if (!command.empty() && command.back() == '\r') {
+                command.pop_back();
+            }
+            if (!command.empty()) {
+                answer += Run(command);
+            }
+        }
+        /* Take a last command without a line break too, once the client
+         * has closed its end */
+        if (start < line.size()) {
+            answer += Run(line.substr(start));
+        }
+
+        for (size_t sent = 0; sent < answer.size(); ) {
+            n = send(client, answer.data() + sent, answer.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        close(client);
+    }
+}
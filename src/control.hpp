@@ -0,0 +1,49 @@
+/** @file control.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef control_hpp
+#define control_hpp
+
+#include "common.h"
+
+#include <thread>
+
+/**
+ A Unix socket the running filesystem answers queries on.
+
+ A client connects, sends one command per line and reads the answer
+ until the connection is closed, e.g. `echo slabs | nc -U PATH`. A
+ last line without its break is run only if the client closes its end
+ after it; one still unfinished after a second or 4096 bytes is refused.
+ Commands:
+   - slabs      Usage of the inode slabs
+   - metrics    Request counts, latencies and lock waits in the Prometheus
+                text format, e.g. for a textfile collector
+   - drop PATH  Removes PATH, relative to the mount point, and the whole
+                tree below it in one operation, like a much faster rm -rf
+   - quota PATH [BYTES INODES]
+                Shows the usage and limits of the quota on the directory
+                PATH or, given limits, sets them, attaching a quota to
+                the directory if it has none; it must be empty then. The
+                bytes are of st_blocks; 0 is no limit
+   - quotas     Usage and limits of every quota
+   - help       The list of commands
+ */
+class ControlSocket {
+private:
+    static int m_fd;
+    static std::string m_path;
+    static std::thread m_thread;
+    static std::atomic<bool> m_stopping;
+
+    static void Serve();
+    static std::string Run(const std::string &command);
+    static std::string RunQuota(const std::string &args);
+
+public:
+    static bool Start(const char *path);
+    static void Stop();
+};
+
+#endif /* control_hpp */
@@ -0,0 +1,327 @@
+/** @file data_pool.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+#include <sys/syscall.h>
+
+#include "data_pool.hpp"
+#include "dedup.hpp"
+
+using namespace std;
+
+char *DataPool::m_base = nullptr;
+size_t DataPool::m_npages = 0;
+size_t DataPool::m_length = 0;
+int DataPool::m_fd = -1;
+bool DataPool::m_spliceable = false;
+std::atomic<uint64_t> DataPool::m_next(0);
+std::atomic<uint64_t> DataPool::m_freeHead(0);
+std::atomic<uint32_t> *DataPool::m_refs = nullptr;
+std::atomic<int64_t> DataPool::m_merged(0);
+enum HugePageModes DataPool::HugePages = HUGEPAGE_MODE_NONE;
+enum NumaModes DataPool::Numa = NUMA_MODE_DEFAULT;
+
+/**
+ Maps the pool, from a memfd if possible.
+
+ @param length The length of the mapping.
+ @param hugetlb Whether to use reserved huge pages.
+ @return The mapping, or MAP_FAILED.
+ */
+void *DataPool::Map(size_t length, bool hugetlb) {
+#ifdef MFD_CLOEXEC
+    unsigned int flags = MFD_CLOEXEC;
+#ifdef MFD_HUGETLB
+    if (hugetlb) {
+        flags |= MFD_HUGETLB;
+    }
+#endif
+    m_fd = memfd_create("fuse-cpp-ramfs", flags);
+    if (m_fd >= 0 && ftruncate(m_fd, length) != 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+#endif
+
+    void *base;
+    if (m_fd >= 0) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    } else {
+        /* No memfd: pages can still be used, only not spliced */
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_HUGETLB
+        if (hugetlb) {
+            flags |= MAP_HUGETLB;
+        }
+#endif
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    }
+    if (base == MAP_FAILED && m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    return base;
+}
+
+/* Applies the NUMA placement chosen with numa= to the whole pool */
+void DataPool::SetNumaPolicy() {
+    if (Numa == NUMA_MODE_DEFAULT) {
+        return;
+    }
+#if defined(__linux__) && defined(SYS_mbind)
+    /* From <numaif.h>, which needs libnuma */
+    const int mpolInterleave = 3, mpolLocal = 4;
+    std::vector<unsigned long> nodes;
+    unsigned long maxnode = 0;
+    if (Numa == NUMA_MODE_INTERLEAVE) {
+        /* Nodes are listed as ranges, e.g. "0-1,3" */
+        FILE *online = fopen("/sys/devices/system/node/online", "r");
+        unsigned long first, last;
+        while (online != NULL && fscanf(online, "%lu", &first) == 1) {
+            last = first;
+            int c = fgetc(online);
+            if (c == '-' && fscanf(online, "%lu", &last) == 1) {
+                c = fgetc(online);
+            }
+            for (unsigned long n = first; n <= last && n < 4096; ++n) {
+                size_t word = n / (8 * sizeof(unsigned long));
+                if (word >= nodes.size()) {
+                    nodes.resize(word + 1, 0);
+                }
+                nodes[word] |= 1UL << (n % (8 * sizeof(unsigned long)));
+                maxnode = std::max(maxnode, n + 2);
+            }
+            if (c != ',') {
+                break;
+            }
+        }
+        if (online != NULL) {
+            fclose(online);
+        }
+        if (nodes.empty()) {
+            fprintf(stderr, "fuse-cpp-ramfs: cannot find the NUMA nodes, not interleaving\n");
+            return;
+        }
+    }
+    int mode = (Numa == NUMA_MODE_INTERLEAVE) ? mpolInterleave : mpolLocal;
+    if (syscall(SYS_mbind, m_base, m_length, mode, nodes.empty() ? NULL : nodes.data(), maxnode, 0) != 0) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot set the NUMA policy: %s\n", strerror(errno));
+    }
+#else
+    fprintf(stderr, "fuse-cpp-ramfs: NUMA placement is not supported here\n");
+#endif
+}
+
+/**
+ Reserves the address space for the pool. Memory is only committed as
+ pages are first written, so reserving the whole capacity is cheap.
+
+ @param capacity The largest number of bytes that will be allocated.
+ @return true on success.
+ */
+bool DataPool::Init(size_t capacity) {
+    m_npages = get_nblocks(capacity, PageSize);
+    /* Page indices are kept in 32 bits on the free list */
+    if (m_npages == 0 || m_npages > UINT32_MAX) {
+        fprintf(stderr, "fuse-cpp-ramfs: unsupported capacity %zu bytes\n", capacity);
+        return false;
+    }
+    m_length = m_npages * PageSize;
+
+    void *base = MAP_FAILED;
+    m_spliceable = true;
+    if (HugePages == HUGEPAGE_MODE_HUGETLB) {
+        size_t length = round_up(m_length, HugePageSize);
+        base = Map(length, true);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "fuse-cpp-ramfs: cannot reserve %zu bytes of huge pages, "
+                    "using normal pages\n", length);
+        } else {
+            m_length = length;
+            m_spliceable = false;
+        }
+    }
+    if (base == MAP_FAILED) {
+        base = Map(m_length, false);
+    }
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot map %zu bytes: %s\n", m_length, strerror(errno));
+        return false;
+    }
+    m_base = (char *) base;
+
+    /* Counts are committed as pages are first used, like the pool */
+    void *refs = mmap(NULL, m_npages * sizeof(*m_refs), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (refs == MAP_FAILED) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot map page counts: %s\n", strerror(errno));
+        Destroy();
+        return false;
+    }
+    m_refs = (std::atomic<uint32_t> *) refs;
+
+#ifdef MADV_HUGEPAGE
+    /* For a memfd this also needs shmem_enabled=advise in sysfs */
+    if (HugePages == HUGEPAGE_MODE_THP && madvise(m_base, m_length, MADV_HUGEPAGE) != 0) {
+        fprintf(stderr, "fuse-cpp-ramfs: transparent huge pages unavailable: %s\n", strerror(errno));
+    }
+#endif
+    SetNumaPolicy();
+
+    m_next = 0;
+    m_freeHead = 0;
+    return true;
+}
+
+void DataPool::Destroy() {
+    Dedup::Clear();
+    m_merged = 0;
+    if (m_refs != nullptr) {
+        munmap(m_refs, m_npages * sizeof(*m_refs));
+        m_refs = nullptr;
+    }
+    if (m_base != nullptr) {
+        munmap(m_base, m_length);
+        m_base = nullptr;
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+/**
+ Takes back every page at once, once no file holds any, and gives their
+ memory back to the system. Much cheaper than freeing the pages one by
+ one, which writes to each of them.
+ */
+void DataPool::Reset() {
+    Dedup::Clear();
+    m_merged = 0;
+    size_t used = m_next.load();
+    if (m_base == nullptr || used == 0) {
+        return;
+    }
+    /* hugetlbfs only takes whole huge pages */
+    size_t length = std::min(round_up(used * PageSize, HugePageSize), m_length);
+    /* Pages which were never handed out must read back as zeros */
+    bool zeroed = false;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (m_fd >= 0) {
+        zeroed = fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, length) == 0;
+    }
+#endif
+    if (!zeroed && m_fd < 0) {
+        zeroed = madvise(m_base, length, MADV_DONTNEED) == 0;
+    }
+    if (!zeroed) {
+        memset(m_base, 0, used * PageSize);
+    }
+    madvise(m_refs, used * sizeof(*m_refs), MADV_DONTNEED);
+    m_next = 0;
+    m_freeHead = 0;
+}
+
+/**
+ Hands out a zero-filled page.
+
+ @return The page, or nullptr if the pool is exhausted.
+ */
+char *DataPool::AllocPage() {
+    /* Prefer recycled pages, so that memory which is already committed
+     * is reused before the pool grows */
+    uint64_t head = m_freeHead.load(std::memory_order_acquire);
+    while ((uint32_t) head != 0) {
+        uint32_t idx = (uint32_t) head - 1;
+        uint64_t next = ((head >> 32) + 1) << 32 | Link(idx)->load(std::memory_order_relaxed);
+        if (m_freeHead.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+            char *page = m_base + idx * PageSize;
+            memset(page, 0, PageSize);
+            m_refs[idx].store(1, std::memory_order_relaxed);
+            return page;
+        }
+    }
+
+    /* Untouched pages are still zero */
+    uint64_t idx = m_next.load(std::memory_order_relaxed);
+    do {
+        if (idx >= m_npages) {
+            return nullptr;
+        }
+    } while (!m_next.compare_exchange_weak(idx, idx + 1, std::memory_order_relaxed));
+    m_refs[idx].store(1, std::memory_order_relaxed);
+    return m_base + idx * PageSize;
+}
+
+/**
+ Drops an owner of a page, and recycles the page if it was the last.
+
+ @param page The page. Those outside the pool are left alone.
+ @return true if the page is in the dedup index and others still own it.
+ */
+bool DataPool::FreePage(char *page) {
+    /* Pages outside the pool belong to someone else */
+    if (page == nullptr || !Contains(page)) {
+        return false;
+    }
+    uint32_t idx = (uint32_t) Index(page);
+    /* Other owners keep it; the last one to let go has seen all writes */
+    uint32_t refs = m_refs[idx].fetch_sub(1, std::memory_order_acq_rel);
+    if (refs == 1) {
+        Recycle(idx);
+    } else if (refs == (Indexed | 1)) {
+        Dedup::Forget(page);
+    } else if ((refs & Indexed) != 0) {
+        m_merged.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+/* Pushes a page nobody owns onto the free list */
+void DataPool::Recycle(uint32_t idx) {
+    uint64_t head = m_freeHead.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        Link(idx)->store((uint32_t) head, std::memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (idx + 1);
+    } while (!m_freeHead.compare_exchange_weak(head, next, std::memory_order_release,
+                                               std::memory_order_relaxed));
+}
+
+/* Marks a page with a single owner as indexed; false if others own it */
+bool DataPool::SetIndexed(char *page) {
+    uint32_t refs = 1;
+    return Contains(page) &&
+        m_refs[Index(page)].compare_exchange_strong(refs, Indexed | 1, std::memory_order_acq_rel);
+}
+
+/* Takes a page out of the index again, if only the caller owns it */
+bool DataPool::ClearIndexed(char *page) {
+    uint32_t refs = Indexed | 1;
+    return m_refs[Index(page)].compare_exchange_strong(refs, 1, std::memory_order_acq_rel);
+}
+
+/* Adds an owner to an indexed page, unless its last owner is gone */
+bool DataPool::ShareIndexed(char *page) {
+    std::atomic<uint32_t> &ref = m_refs[Index(page)];
+    uint32_t refs = ref.load(std::memory_order_relaxed);
+    do {
+        if (refs == Indexed) {
+            return false;
+        }
+    } while (!ref.compare_exchange_weak(refs, refs + 1, std::memory_order_acq_rel));
+    m_merged.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/* Recycles an indexed page whose last owner is gone, once it has left the
+ * index */
+void DataPool::RecycleIndexed(char *page) {
+    uint32_t idx = (uint32_t) Index(page);
+    m_refs[idx].store(0, std::memory_order_relaxed);
+    Recycle(idx);
+}
@@ -0,0 +1,111 @@
+/** @file data_pool.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef data_pool_hpp
+#define data_pool_hpp
+
+#include "common.h"
+
+/**
+ The memory all file pages are carved from.
+
+ The pool is a single mapping of a memfd, so every page is also reachable
+ through a file descriptor at a known offset. That lets reads hand pages
+ to the kernel with splice() instead of copying them.
+
+ Pages are reference counted so that files can share them; a shared page
+ is never written, its owners copy it first. Files may also point at
+ pages outside the pool, such as those of a restored snapshot; these
+ count as shared forever.
+
+ The mapping may be backed by huge pages, transparent or hugetlbfs, and
+ given a NUMA policy, to cut TLB misses and remote memory accesses on
+ large reads.
+
+ With deduplication on, pages may also be entered in the Dedup index.
+ The top bit of their count marks them, so they count as shared even
+ with one owner; the index itself doesn't own them. The last owner to
+ let go of one has Dedup drop it from the index before it is recycled.
+ */
+class DataPool {
+public:
+    static const size_t PageSize = 4096;
+    /* hugetlb mappings are rounded up to this */
+    static const size_t HugePageSize = 2 * 1024 * 1024;
+
+    /* Set these before Init() */
+    static enum HugePageModes HugePages;
+    static enum NumaModes Numa;
+
+private:
+    static char *m_base;
+    static size_t m_npages;
+    static size_t m_length;
+    static int m_fd;
+    /* hugetlbfs can't splice pages out */
+    static bool m_spliceable;
+    /* Index of the first page that was never handed out */
+    static std::atomic<uint64_t> m_next;
+    /* Free list of returned pages: (ABA tag << 32) | (page index + 1) */
+    static std::atomic<uint64_t> m_freeHead;
+    /* Owners of each page, with Indexed if it is in the dedup index; 0
+     * while it is free */
+    static std::atomic<uint32_t> *m_refs;
+    /* Owners of indexed pages beyond the first, over all pages */
+    static std::atomic<int64_t> m_merged;
+
+    static std::atomic<uint32_t> *Link(uint32_t idx) {
+        return reinterpret_cast<std::atomic<uint32_t> *>(m_base + idx * PageSize);
+    }
+
+    static size_t Index(const char *page) { return (page - m_base) / PageSize; }
+    static void *Map(size_t length, bool hugetlb);
+    static void SetNumaPolicy();
+    static void Recycle(uint32_t idx);
+
+public:
+    static const uint32_t Indexed = 1u << 31;
+
+    static bool Init(size_t capacity);
+    static void Destroy();
+    static void Reset();
+
+    static char *AllocPage();
+    static bool FreePage(char *page);
+    static bool Contains(const char *page) {
+        return page >= m_base && page < m_base + m_npages * PageSize;
+    }
+    /* Adds an owner to a page, FreePage() drops one. Returns whether the
+     * page is in the dedup index. */
+    static bool Share(char *page) {
+        if (!Contains(page)) {
+            return false;
+        }
+        if ((m_refs[Index(page)].fetch_add(1, std::memory_order_relaxed) & Indexed) == 0) {
+            return false;
+        }
+        m_merged.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    static bool IsShared(const char *page) {
+        return !Contains(page) || m_refs[Index(page)].load(std::memory_order_acquire) > 1;
+    }
+
+    /* For Dedup, which must hold the index entry's lock */
+    static bool IsIndexed(const char *page) {
+        return Contains(page) && (m_refs[Index(page)].load(std::memory_order_acquire) & Indexed) != 0;
+    }
+    static bool SetIndexed(char *page);
+    static bool ClearIndexed(char *page);
+    static bool ShareIndexed(char *page);
+    static void RecycleIndexed(char *page);
+    /* Pages deduplication saved */
+    static int64_t Merged() { return m_merged.load(std::memory_order_relaxed); }
+
+    /* The memfd backing the pool, or -1 if pages can't be spliced from it */
+    static int Fd() { return m_spliceable ? m_fd : -1; }
+    static off_t Offset(const char *page) { return page - m_base; }
+};
+
+#endif /* data_pool_hpp */
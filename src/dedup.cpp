@@ -0,0 +1,148 @@
+/** @file dedup.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define RAMFS_HAVE_CRC32C
+#endif
+
+#include "dedup.hpp"
+#include "data_pool.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+bool Dedup::Enabled = false;
+Dedup::Stripe Dedup::m_stripes[Dedup::Stripes];
+
+static const size_t PageWords = DataPool::PageSize / sizeof(uint64_t);
+static const uint64_t Golden = 0x9E3779B97F4A7C15ULL;
+
+#ifdef RAMFS_HAVE_CRC32C
+/* Four independent CRCs keep the CRC unit busy despite its latency */
+__attribute__((target("sse4.2")))
+static uint64_t HashCrc32c(const char *page) {
+    uint64_t a = 0, b = 0, c = 0, d = 0;
+    for (size_t i = 0; i < PageWords; i += 4) {
+        uint64_t w[4];
+        memcpy(w, page + i * sizeof(uint64_t), sizeof(w));
+        a = _mm_crc32_u64(a, w[0]);
+        b = _mm_crc32_u64(b, w[1]);
+        c = _mm_crc32_u64(c, w[2]);
+        d = _mm_crc32_u64(d, w[3]);
+    }
+    return (a << 32 | b) ^ ((c << 32 | d) * Golden);
+}
+#endif
+
+/* Four independent lanes, which the compiler may vectorize */
+static uint64_t HashPortable(const char *page) {
+    uint64_t h[4] = {1, 2, 3, 4};
+    for (size_t i = 0; i < PageWords; i += 4) {
+        uint64_t w[4];
+        memcpy(w, page + i * sizeof(uint64_t), sizeof(w));
+        for (size_t k = 0; k < 4; ++k) {
+            h[k] = (h[k] ^ w[k]) * Golden;
+            h[k] ^= h[k] >> 29;
+        }
+    }
+    return h[0] ^ (h[1] * Golden) ^ (h[2] << 21 | h[2] >> 43) ^ (h[3] * 0xC2B2AE3D27D4EB4FULL);
+}
+
+/* Hashes the PageSize bytes of a page */
+uint64_t Dedup::Hash(const char *page) {
+#ifdef RAMFS_HAVE_CRC32C
+    static const bool crc32c = __builtin_cpu_supports("sse4.2");
+    if (crc32c) {
+        return HashCrc32c(page);
+    }
+#endif
+    return HashPortable(page);
+}
+
+/**
+ Finds a page identical to the given one in the index. If there is one,
+ the given page is released and the caller becomes an owner of the other
+ instead; if not, the given page is entered in the index. The caller must
+ be the only owner of the page and keep others from writing it.
+
+ @param page The pool page.
+ @return The page the caller owns now: page itself, or the identical one.
+ */
+char *Dedup::Merge(char *page) {
+    uint64_t hash = Hash(page);
+    Stripe &stripe = StripeOf(hash);
+    std::unique_lock<std::mutex> lk(stripe.mutex);
+    auto it = stripe.pages.find(hash);
+    if (it != stripe.pages.end()) {
+        char *same = it->second;
+        /* Indexed pages aren't written, so they need no lock of their own.
+         * One whose last owner is going stays out of reach. */
+        if (same == page || memcmp(same, page, DataPool::PageSize) != 0 ||
+            !DataPool::ShareIndexed(same)) {
+            return page;
+        }
+        lk.unlock();
+        DataPool::FreePage(page);
+        Metrics::Count(Metrics::PagesMerged, 1);
+        return same;
+    }
+
+    if (!DataPool::SetIndexed(page)) {
+        return page;
+    }
+    try {
+        stripe.pages.emplace(hash, page);
+    } catch (std::bad_alloc &e) {
+        DataPool::ClearIndexed(page);
+    }
+    return page;
+}
+
+/**
+ Takes a page out of the index so that its only owner may write it.
+
+ @param page The indexed page.
+ @return false if others own the page too; it must be copied then.
+ */
+bool Dedup::Unindex(char *page) {
+    uint64_t hash = Hash(page);
+    Stripe &stripe = StripeOf(hash);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    if (!DataPool::ClearIndexed(page)) {
+        return false;
+    }
+    auto it = stripe.pages.find(hash);
+    if (it != stripe.pages.end() && it->second == page) {
+        stripe.pages.erase(it);
+    }
+    return true;
+}
+
+/**
+ Takes a page out of the index after its last owner let go of it, and
+ recycles it. Called by DataPool::FreePage().
+
+ @param page The indexed page.
+ */
+void Dedup::Forget(char *page) {
+    uint64_t hash = Hash(page);
+    Stripe &stripe = StripeOf(hash);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto it = stripe.pages.find(hash);
+    if (it != stripe.pages.end() && it->second == page) {
+        stripe.pages.erase(it);
+    }
+    DataPool::RecycleIndexed(page);
+}
+
+/* Empties the index, when the pool goes away */
+void Dedup::Clear() {
+    for (Stripe &stripe : m_stripes) {
+        std::lock_guard<std::mutex> lk(stripe.mutex);
+        std::unordered_map<uint64_t, char *>().swap(stripe.pages);
+    }
+}
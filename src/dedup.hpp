@@ -0,0 +1,54 @@
+/** @file dedup.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef dedup_hpp
+#define dedup_hpp
+
+#include "common.h"
+
+/**
+ Shares identical pages between files, so that many copies of the same
+ data take the space of one.
+
+ When a write fills a page, or a file is closed with a partial last
+ page, the page is hashed and looked up in an index of pages by their
+ hash. If an identical page is there, the file drops its own page and
+ becomes another owner of the indexed one; if not, the page is entered
+ so later copies find it. Pages in the index count as shared, so their
+ owners copy them before writing, like pages shared by copy_file_range.
+
+ The filesystem is charged once for an indexed page however many files
+ own it; each file is still charged in its own st_blocks.
+
+ The index is split in stripes by hash, each with its own lock. Pages
+ are hashed with CRC32C where the CPU has it and compared in full before
+ they are merged, so a collision merely misses a merge.
+ */
+class Dedup {
+public:
+    /* Set before the filesystem is mounted */
+    static bool Enabled;
+
+private:
+    static const size_t Stripes = 64;
+
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, char *> pages;
+    };
+
+    static Stripe m_stripes[Stripes];
+
+    static Stripe &StripeOf(uint64_t hash) { return m_stripes[hash >> 58]; }
+
+public:
+    static uint64_t Hash(const char *page);
+
+    static char *Merge(char *page);
+    static bool Unindex(char *page);
+    static void Forget(char *page);
+    static void Clear();
+};
+
+#endif /* dedup_hpp */
@@ -4,44 +4,161 @@
 
 #include "common.h"
 
+#include <algorithm>
+
 #include "inode.hpp"
 #include "directory.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "snapshot.hpp"
+#include "quota.hpp"
 
 using namespace std;
-std::unordered_map<off_t, Directory::ReadDirCtx *> Directory::readdirStates;
+size_t Directory::HashThreshold = Directory::DefaultHashThreshold;
+Slab Directory::m_slab("directory", sizeof(Directory));
 
 void Directory::UpdateSize(ssize_t delta) {
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
 
     /* Avoid negative result */
-    if (delta < 0 && -delta > m_fuseEntryParam.attr.st_size) {
+    Attr attr = m_attr;
+    if (delta < 0 && -delta > attr.size) {
         printf("Directory::UpdateSize(): %ld of delta causes negative size.\n", delta);
         assert(0);
     }
 
-    size_t oldBlocks = m_fuseEntryParam.attr.st_blocks;
-    size_t newSize = m_fuseEntryParam.attr.st_size + delta;
+    size_t oldBlocks = attr.blocks;
+    size_t newSize = attr.size + delta;
     size_t newBlocks = get_nblocks(newSize, Inode::BufBlockSize);
-    m_fuseEntryParam.attr.st_size = newSize;
+    attr.size = newSize;
     if (newBlocks != oldBlocks) {
-        m_fuseEntryParam.attr.st_blocks = newBlocks;
+        attr.blocks = newBlocks;
         FuseRamFs::UpdateUsedBlocks(newBlocks - oldBlocks);
     }
+    StoreAttr(attr);
 }
 
 void Directory::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid) {
     Inode::Initialize(ino, mode, nlink, gid, uid);
-    size_t base_size = sizeof(m_children);
-    UpdateSize(base_size);
+
+    /* RegisterInode() charges the filesystem for these blocks */
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    Attr attr = m_attr;
+    attr.size = sizeof(m_entries);
+    attr.blocks = get_nblocks(attr.size, Inode::BufBlockSize);
+    StoreAttr(attr);
+}
+
+/* FindEntry: Find the live entry with the given name
+ *
+ * @param[in] name:     The child name
+ * @param[in] hash:     The hash of name
+ *
+ * @return: The position of the entry in m_entries, or NoEntry.
+ */
+size_t Directory::FindEntry(std::string_view name, size_t hash) const {
+    if (m_index.empty()) {
+        for (size_t i = 0; i < m_entries.size(); ++i) {
+            const Entry &e = m_entries[i];
+            if (e.hash == hash && e.ino != INO_NOTFOUND && e.name == name) {
+                return i;
+            }
+        }
+        return NoEntry;
+    }
+
+    size_t mask = m_index.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        uint32_t slot = m_index[i];
+        if (slot == 0) {
+            return NoEntry;
+        }
+        if (slot != IndexTombstone) {
+            const Entry &e = m_entries[slot - 1];
+            if (e.hash == hash && e.name == name) {
+                return slot - 1;
+            }
+        }
+    }
+}
+
+/* RebuildIndex: Size the hash index to the live entries and refill it */
+void Directory::RebuildIndex() {
+    size_t slots = 16;
+    while (slots < m_liveEntries * 2) {
+        slots *= 2;
+    }
+    std::vector<uint32_t> index(slots, 0);
+    size_t mask = slots - 1;
+    for (size_t pos = 0; pos < m_entries.size(); ++pos) {
+        if (m_entries[pos].ino == INO_NOTFOUND) {
+            continue;
+        }
+        size_t i = m_entries[pos].hash & mask;
+        while (index[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        index[i] = pos + 1;
+    }
+    m_index.swap(index);
+    m_indexUsed = m_liveEntries;
+}
+
+/* DropIndex: Fall back to scanning, e.g. when the index can't be grown */
+void Directory::DropIndex() {
+    std::vector<uint32_t>().swap(m_index);
+    m_indexUsed = 0;
+}
+
+void Directory::IndexInsert(size_t pos) {
+    /* Keep at least a quarter of the slots free so probes stay short */
+    if ((m_indexUsed + 1) * 4 > m_index.size() * 3) {
+        RebuildIndex();
+        return;
+    }
+    size_t mask = m_index.size() - 1;
+    size_t i = m_entries[pos].hash & mask;
+    while (m_index[i] != 0 && m_index[i] != IndexTombstone) {
+        i = (i + 1) & mask;
+    }
+    if (m_index[i] == 0) {
+        ++m_indexUsed;
+    }
+    m_index[i] = pos + 1;
 }
 
-fuse_ino_t Directory::_ChildInodeNumberWithName(const string &name) {
-    if (m_children.find(name) == m_children.end()) {
+void Directory::IndexErase(size_t pos) {
+    size_t mask = m_index.size() - 1;
+    for (size_t i = m_entries[pos].hash & mask; m_index[i] != 0; i = (i + 1) & mask) {
+        if (m_index[i] == pos + 1) {
+            m_index[i] = IndexTombstone;
+            return;
+        }
+    }
+}
+
+/* Compact: Squeeze the holes out of m_entries. Cookies are kept, so they
+ * still grow along the array. */
+void Directory::Compact() {
+    auto end = std::remove_if(m_entries.begin(), m_entries.end(),
+                              [](const Entry &e) { return e.ino == INO_NOTFOUND; });
+    m_entries.erase(end, m_entries.end());
+    ++m_version;
+    if (!m_index.empty()) {
+        try {
+            RebuildIndex();
+        } catch (std::bad_alloc &e) {
+            DropIndex();
+        }
+    }
+}
+
+fuse_ino_t Directory::_ChildInodeNumberWithName(std::string_view name) {
+    size_t pos = FindEntry(name, Hash(name));
+    if (pos == NoEntry) {
         return INO_NOTFOUND;
     }
     
-    return m_children[name];
+    return m_entries[pos].ino;
 }
 
 /**
@@ -50,24 +167,45 @@ fuse_ino_t Directory::_ChildInodeNumberWithName(const string &name) {
  @param name The child file / dir name.
  @return The child inode number if the child is found. -1 otherwise.
  */
-fuse_ino_t Directory::ChildInodeNumberWithName(const string &name) {
+fuse_ino_t Directory::ChildInodeNumberWithName(std::string_view name) {
     std::shared_lock<std::shared_mutex> lk(childrenRwSem);
 
     return _ChildInodeNumberWithName(name);
 }
 
 int Directory::_AddChild(const string &name, fuse_ino_t ino) {
-    if (m_children.find(name) != m_children.end())
+    /* Dropped while a process still had it as its cwd */
+    if (HasNoLinks())
+        return -ENOENT;
+
+    size_t hash = Hash(name);
+    if (FindEntry(name, hash) != NoEntry)
         return -EEXIST;
 
-    size_t elem_size = sizeof(_Rb_tree_node_base) + sizeof(fuse_ino_t) + sizeof(std::string) + name.size();
-    if (!FuseRamFs::CheckHasSpaceFor(this, elem_size)) {
-        return -ENOSPC;
+    size_t elem_size = sizeof(Entry) + name.size();
+    int ret = FuseRamFs::CheckHasSpaceFor(this, elem_size);
+    if (ret < 0) {
+        return ret;
     }
 
-    const auto [it, success] = m_children.insert({name, ino});
-    if (!success)
+    try {
+        m_entries.push_back({name, ino, hash, m_nextCookie});
+    } catch (std::bad_alloc &e) {
         return -ENOMEM;
+    }
+    ++m_nextCookie;
+    ++m_liveEntries;
+
+    /* The entry is in place; without an index it can still be found */
+    try {
+        if (!m_index.empty()) {
+            IndexInsert(m_entries.size() - 1);
+        } else if (m_liveEntries >= HashThreshold) {
+            RebuildIndex();
+        }
+    } catch (std::bad_alloc &e) {
+        DropIndex();
+    }
 
     UpdateSize(elem_size);
     return 0;
@@ -86,11 +224,12 @@ int Directory::AddChild(const string &name, fuse_ino_t ino) {
     return _AddChild(name, ino);
 }
 
-int Directory::_UpdateChild(const string &name, fuse_ino_t ino) {
-    if (m_children.find(name) == m_children.end())
+int Directory::_UpdateChild(std::string_view name, fuse_ino_t ino) {
+    size_t pos = FindEntry(name, Hash(name));
+    if (pos == NoEntry)
         return -ENOENT;
 
-    m_children[name] = ino;
+    m_entries[pos].ino = ino;
     
     // TODO: What about directory sizes? Shouldn't we increase the reported size of our dir?
     // NOTE: This is an **update** function, why should we care about increasing size here?
@@ -104,20 +243,32 @@ int Directory::_UpdateChild(const string &name, fuse_ino_t ino) {
  @param ino The new inode number.
  @return 0 if successful, or errno if error occurred
  */
-int Directory::UpdateChild(const string &name, fuse_ino_t ino) {
+int Directory::UpdateChild(std::string_view name, fuse_ino_t ino) {
     std::unique_lock<std::shared_mutex> lk(childrenRwSem);
 
     return _UpdateChild(name, ino);
 }
 
-int Directory::_RemoveChild(const string &name) {
-    auto child = m_children.find(name);
-    if (child == m_children.end())
+int Directory::_RemoveChild(std::string_view name) {
+    size_t pos = FindEntry(name, Hash(name));
+    if (pos == NoEntry)
         return -ENOENT;
 
-    m_children.erase(child);
+    if (!m_index.empty()) {
+        IndexErase(pos);
+    }
+    Entry &e = m_entries[pos];
+    e.ino = INO_NOTFOUND;
+    std::string().swap(e.name);
+    --m_liveEntries;
+
+    /* Once holes outnumber the live entries, squeeze them out */
+    size_t holes = m_entries.size() - m_liveEntries;
+    if (holes > m_liveEntries && holes >= 16) {
+        Compact();
+    }
 
-    size_t elem_size = sizeof(_Rb_tree_node_base) + sizeof(fuse_ino_t) + sizeof(std::string) + name.size();
+    size_t elem_size = sizeof(Entry) + name.size();
     UpdateSize(-elem_size);
     return 0;
 }
@@ -131,7 +282,7 @@ int Directory::_RemoveChild(const string &name) {
  @param name The name of the child to delete.
  @return 0 if successful, or errno if error occurred
  */
-int Directory::RemoveChild(const string &name) {
+int Directory::RemoveChild(std::string_view name) {
     std::unique_lock<std::shared_mutex> lk(childrenRwSem);
 
     return _RemoveChild(name);
@@ -145,47 +296,232 @@ int Directory::ReadAndReply(fuse_req_t req, size_t size, off_t off) {
     return fuse_reply_err(req, EISDIR);
 }
 
-Directory::ReadDirCtx* Directory::PrepareReaddir(off_t cookie) {
-    if (cookie != 0) {
-        /* NOTE: Will throw std::out_of_range if no entry is found */
-        Directory::ReadDirCtx* ctx = readdirStates.at(cookie);
+/* SeekCookie: Find where a listing continues
+ *
+ * @param[in] cookie:   The cookie of the last entry already returned, or 0
+ * @param[in] cursor:   Where the previous reply of this listing stopped
+ *
+ * @return: The position of the first entry with a greater cookie.
+ */
+size_t Directory::SeekCookie(off_t cookie, const ReadDirCursor *cursor) const {
+    if (cursor != nullptr && cursor->version == m_version && cursor->cookie == cookie &&
+        cursor->pos <= m_entries.size()) {
+        return cursor->pos;
+    }
+    auto it = std::upper_bound(m_entries.begin(), m_entries.end(), (uint64_t) cookie,
+                               [](uint64_t ck, const Entry &e) { return ck < e.cookie; });
+    return it - m_entries.begin();
+}
+
+/**
+ Fills a buffer with directory entries, starting after the given cookie.
+ Every entry carries its own cookie as the offset, so a listing can resume
+ from any offset which was handed out, even if entries were added or
+ removed in between.
+
+ @param req The FUSE request.
+ @param buf The buffer to fill.
+ @param bufSize The size of the buffer.
+ @param off The cookie of the last entry already returned, or 0.
+ @param cursor The position of the listing, updated on return. May be null.
+ @param plus Whether to add full entries for readdirplus. Every entry but
+             '.' and '..' then counts as a lookup.
+ @return The number of bytes used in the buffer.
+ */
+size_t Directory::ReadDirBuf(fuse_req_t req, char *buf, size_t bufSize, off_t off, ReadDirCursor *cursor, bool plus) {
+    std::shared_lock<std::shared_mutex> lk(childrenRwSem);
+
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    size_t bytesAdded = 0;
+    size_t pos = SeekCookie(off, cursor);
+    for (; pos < m_entries.size(); ++pos) {
+        const Entry &e = m_entries[pos];
+        if (e.ino == INO_NOTFOUND) {
+            continue;
+        }
+        Inode *childInode = FuseRamFs::GetInode(e.ino);
+        if (childInode == nullptr || childInode->HasNoLinks()) {
+            continue;
+        }
 
-        /* If we have reached the end of the iterator, we should destroy this context 
-         * to release memory */
-        if (ctx->it == ctx->children.end()) {
-            Directory::readdirStates.erase(cookie);
-            delete ctx;
-            throw(std::out_of_range("Not found"));
+        size_t entSize;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 0)
+        if (plus) {
+            struct fuse_entry_param entry;
+            childInode->GetEntry(&entry);
+            entSize = fuse_add_direntry_plus(req, buf + bytesAdded, bufSize - bytesAdded,
+                                             e.name.c_str(), &entry, e.cookie);
+        } else
+#endif
+        {
+            childInode->GetAttr(&stbuf);
+            stbuf.st_ino = e.ino;
+            entSize = fuse_add_direntry(req, buf + bytesAdded, bufSize - bytesAdded,
+                                        e.name.c_str(), &stbuf, e.cookie);
+        }
+        if (entSize > bufSize - bytesAdded) {
+            // There wasn't enough space for this entry. It goes first next time.
+            break;
+        }
+        if (plus && e.name != "." && e.name != "..") {
+            childInode->AddLookup();
         }
-        return ctx;
+        bytesAdded += entSize;
+        off = e.cookie;
     }
-    /* Make a copy of children */
-    std::shared_lock<std::shared_mutex> lk(childrenRwSem);
-    std::map<std::string, fuse_ino_t> copiedChildren(m_children);
-    lk.unlock();
 
-    /* Add it to the table */
-    cookie = rand();
-    /* Make sure there is no duplicate */
-    while (readdirStates.find(cookie) != readdirStates.end()) {
-        cookie = rand();
+    if (cursor != nullptr) {
+        cursor->version = m_version;
+        cursor->pos = pos;
+        cursor->cookie = off;
     }
-    ReadDirCtx *newctx = new ReadDirCtx(cookie, copiedChildren);
-    readdirStates.insert({cookie, newctx});
-    return newctx;
+    return bytesAdded;
 }
 
 bool Directory::IsEmpty() {
     std::shared_lock<std::shared_mutex> lk(childrenRwSem);
-    for (auto it = m_children.begin(); it != m_children.end(); ++it) {
-        if (it->first == "." || it->first == "..") {
+    return _IsEmpty();
+}
+
+bool Directory::_IsEmpty() {
+    /* Every directory has '.' and '..' */
+    return m_liveEntries <= 2;
+}
+
+/**
+ Removes every child but '.' and '..' at once, and the links of the
+ directory itself, as when the whole tree below it is dropped. Nothing
+ can be added to it afterwards.
+
+ @param[out] children Gets the inode numbers the removed entries named.
+ @return 0 if successful, or -ENOMEM if children can't hold them, in
+   which case nothing is removed.
+ */
+int Directory::RemoveAllChildren(std::vector<fuse_ino_t> &children) {
+    std::unique_lock<std::shared_mutex> lk(childrenRwSem);
+    try {
+        children.reserve(children.size() + m_liveEntries);
+    } catch (std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+
+    size_t freed = 0;
+    for (auto &e : m_entries) {
+        if (e.ino == INO_NOTFOUND || e.name == "." || e.name == "..") {
             continue;
         }
-        Inode *entry = FuseRamFs::GetInode(it->second);
-        /* Not empty if it has at least one undeleted inode */
-        if (entry && !entry->HasNoLinks()) {
+        children.push_back(e.ino);
+        freed += sizeof(Entry) + e.name.size();
+        e.ino = INO_NOTFOUND;
+        std::string().swap(e.name);
+        --m_liveEntries;
+    }
+    DropIndex();
+    Compact();
+    UpdateSize(-(ssize_t) freed);
+    /* Under childrenRwSem, so that no create slips in after the children
+     * were taken */
+    while (!HasNoLinks()) {
+        RemoveHardLink();
+    }
+    return 0;
+}
+
+/**
+ Makes the directory the root of a quota, or changes the limits of the
+ quota it is the root of. A quota is attached while the directory is
+ still empty, before it is handed to a tenant, so that all it counts was
+ made under it.
+
+ @param path The path of the directory, for reports.
+ @param blocks The most blocks the tree may take, or 0 for no limit.
+ @param inodes The most inodes the tree may have, or 0 for no limit.
+ @return 0, -ENOTEMPTY if the directory has entries and no quota of its
+   own yet, -ENOENT if it was removed, or -ENOMEM.
+ */
+int Directory::SetQuota(const std::string &path, uint64_t blocks, uint64_t inodes) {
+    /* No entry comes or goes, and the size stays put, while we attach */
+    std::unique_lock<std::shared_mutex> lk(childrenRwSem);
+    std::unique_lock<std::shared_mutex> alk(entryRwSem);
+    /* Dropped or removed meanwhile; its charges may be given back already */
+    if (m_attr.nlink == 0) {
+        return -ENOENT;
+    }
+    Quota *quota = GetQuota();
+    if (quota == nullptr || quota->Root() != m_attr.ino) {
+        if (!_IsEmpty()) {
+            return -ENOTEMPTY;
+        }
+        Quota *parent = quota;
+        quota = Quota::Create(parent, m_attr.ino, path, m_attr.blocks);
+        if (quota == nullptr) {
+            return -ENOMEM;
+        }
+        m_quota.store(quota, std::memory_order_release);
+        /* The new quota refers to the one above in the directory's stead */
+        Quota::Release(parent);
+    }
+    quota->SetLimits(blocks, inodes);
+    return 0;
+}
+
+/**
+ Writes the directory to a snapshot: its entries, in order, including
+ "." and "..".
+
+ @param out The image being written.
+ */
+void Directory::Save(ImageWriter &out) {
+    Inode::Save(out);
+
+    std::shared_lock<std::shared_mutex> lk(childrenRwSem);
+    out.PutU64(m_liveEntries);
+    for (auto const &e : m_entries) {
+        if (e.ino != INO_NOTFOUND) {
+            out.PutU64(e.ino);
+            out.PutString(e.name);
+        }
+    }
+}
+
+/**
+ Reads back what Save() wrote. The entries are taken in one go rather
+ than added one at a time, and the size is worked out from them.
+
+ @param in The record of the directory in the image.
+ @param ino The inode number.
+ @param mode The mode of the directory.
+ @return false if the record is damaged.
+ */
+bool Directory::Load(ImageReader &in, fuse_ino_t ino, mode_t mode) {
+    uint64_t count;
+    if (!Inode::Load(in, ino, mode) || !in.GetU64(count)) {
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lk(childrenRwSem);
+    size_t size = sizeof(m_entries);
+    for (uint64_t n = 0; n < count; ++n) {
+        uint64_t child;
+        std::string name;
+        if (!in.GetU64(child) || !in.GetString(name) || child == INO_NOTFOUND || name.empty()) {
             return false;
         }
+        size += sizeof(Entry) + name.size();
+        size_t hash = Hash(name);
+        m_entries.push_back({std::move(name), child, hash, m_nextCookie++});
+        ++m_liveEntries;
     }
+    if (m_liveEntries >= HashThreshold) {
+        RebuildIndex();
+    }
+    lk.unlock();
+
+    std::unique_lock<std::shared_mutex> alk(entryRwSem);
+    Attr attr = m_attr;
+    attr.size = size;
+    attr.blocks = get_nblocks(size, Inode::BufBlockSize);
+    StoreAttr(attr);
     return true;
 }
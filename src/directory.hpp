@@ -8,48 +8,95 @@
 #include "common.h"
 
 class Directory : public Inode {
+public:
+    static const enum InodeKinds Kind = INODE_KIND_DIRECTORY;
+    /* Directories with at least this many entries get a hash index */
+    static const size_t DefaultHashThreshold = 64;
+    static size_t HashThreshold;
+
+    /* Where a listing stopped. FuseOpenDir() hands one out in fi->fh so
+     * that a sequential listing resumes without searching for its cookie;
+     * the position is only trusted while m_version is unchanged. */
+    struct ReadDirCursor {
+        uint64_t version;
+        size_t pos;
+        off_t cookie;
+        ReadDirCursor() : version(0), pos(0), cookie(0) {}
+    };
+
 private:
-    std::map<std::string, fuse_ino_t> m_children;
+    /* One child of the directory. Entries stay in the order they were
+     * added, so cookies only ever grow along the array. Removing a child
+     * leaves a hole (ino == INO_NOTFOUND) until the array is compacted. */
+    struct Entry {
+        std::string name;
+        fuse_ino_t ino;
+        size_t hash;
+        uint64_t cookie;
+    };
+    std::vector<Entry> m_entries;
+    size_t m_liveEntries;
+    uint64_t m_nextCookie;
+    /* Bumped whenever entries move within m_entries */
+    uint64_t m_version;
+
+    /* Open addressing index of m_entries holding position + 1, or 0 for
+     * a free slot. Small directories have no index and are scanned. */
+    std::vector<uint32_t> m_index;
+    /* Index slots in use, tombstones included */
+    size_t m_indexUsed;
+    static const uint32_t IndexTombstone = UINT32_MAX;
+    static const size_t NoEntry = SIZE_MAX;
+
     std::shared_mutex childrenRwSem;
+    static Slab m_slab;
 
     void UpdateSize(ssize_t delta);
+    size_t FindEntry(std::string_view name, size_t hash) const;
+    static size_t Hash(std::string_view name) { return std::hash<std::string_view>()(name); }
+    void IndexInsert(size_t pos);
+    void IndexErase(size_t pos);
+    void RebuildIndex();
+    void DropIndex();
+    void Compact();
+    size_t SeekCookie(off_t cookie, const ReadDirCursor *cursor) const;
 public:
-    struct ReadDirCtx {
-        off_t cookie;
-        std::map<std::string, fuse_ino_t>::iterator it;
-        std::map<std::string, fuse_ino_t> children;
-        ReadDirCtx() {}
-        ReadDirCtx(off_t ck, std::map<std::string, fuse_ino_t> &ch)
-            : cookie(ck) {
-                children = ch;
-                it = children.begin();
-            }
-    };
+    /* Each type of inode is allocated from its own slab */
+    static void *operator new(size_t size) { return m_slab.Alloc(size); }
+    static void operator delete(void *obj) { m_slab.Free(obj); }
+
+    Directory() :
+    Inode(Kind),
+    m_liveEntries(0),
+    m_nextCookie(1),
+    m_version(1),
+    m_indexUsed(0)
+    {}
 
-    static std::unordered_map<off_t, Directory::ReadDirCtx *> readdirStates;
-    ReadDirCtx* PrepareReaddir(off_t cookie);
-public:
     ~Directory() {}
 
     void Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
-    fuse_ino_t _ChildInodeNumberWithName(const std::string &name);
-    fuse_ino_t ChildInodeNumberWithName(const std::string &name);
+    fuse_ino_t _ChildInodeNumberWithName(std::string_view name);
+    fuse_ino_t ChildInodeNumberWithName(std::string_view name);
     int _AddChild(const std::string &name, fuse_ino_t);
     int AddChild(const std::string &name, fuse_ino_t);
-    int _UpdateChild(const std::string &name, fuse_ino_t ino);
-    int UpdateChild(const std::string &name, fuse_ino_t ino);
-    int _RemoveChild(const std::string &name);
-    int RemoveChild(const std::string &name);
+    int _UpdateChild(std::string_view name, fuse_ino_t ino);
+    int UpdateChild(std::string_view name, fuse_ino_t ino);
+    int _RemoveChild(std::string_view name);
+    int RemoveChild(std::string_view name);
+    int RemoveAllChildren(std::vector<fuse_ino_t> &children);
+    int SetQuota(const std::string &path, uint64_t blocks, uint64_t inodes);
     int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off);
     int ReadAndReply(fuse_req_t req, size_t size, off_t off);
+    size_t ReadDirBuf(fuse_req_t req, char *buf, size_t bufSize, off_t off, ReadDirCursor *cursor, bool plus = false);
+
+    void Save(ImageWriter &out);
+    bool Load(ImageReader &in, fuse_ino_t ino, mode_t mode);
 
     /* Atomic children operations */
+    bool _IsEmpty();
     bool IsEmpty();
    
-    /* NOTE: Not guarded, so accuracy is not guaranteed.
-     * Mainly intended for readdir() method. */
-    const std::map<std::string, fuse_ino_t> &Children() { return m_children; }
-
     std::shared_mutex& DirLock() { return childrenRwSem; }
 };
 
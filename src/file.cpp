@@ -4,130 +4,1216 @@
 
 #include "common.h"
 
+#include <optional>
+#include <sys/uio.h>
+
 #include "inode.hpp"
 #include "fuse_cpp_ramfs.hpp"
 #include "file.hpp"
+#include "snapshot.hpp"
+#include "metrics.hpp"
+#include "compressor.hpp"
+#include "dedup.hpp"
+#include "spill.hpp"
+#include "quota.hpp"
+
+const char File::ZeroPage[File::PageSize] = {};
+enum AtimeModes File::AtimeMode = ATIME_MODE_RELATIME;
+bool File::WritebackCache = false;
+bool File::Discarding = false;
+Slab File::m_slab("file", sizeof(File));
 
 File::~File() {
-    free(m_buf);
+    FreePages(0);
+    delete m_pageLocks;
 }
 
-int File::FileTruncate(size_t newSize) {
-    size_t newBlocks = get_nblocks(newSize, File::BufBlockSize);
-    size_t oldBlocks = Inode::UsedBlocks();
-    size_t oldSize = Inode::Size();
+/* The blocks a file is charged for an entry of its page table */
+size_t File::PageBlocks(const char *page) {
+    if (page == nullptr || Spill::IsSpilled(page)) {
+        return 0;
+    }
+    return Compressor::IsCompressed(page) ? Compressor::Blocks(page) : File::BlocksPerPage;
+}
+
+/* Releases an entry of the page table, whatever it holds */
+void File::ReleasePage(char *page) {
+    if (Compressor::IsCompressed(page)) {
+        Compressor::Free(page);
+    } else if (Discarding) {
+        /* The pool and the spill file are emptied wholesale */
+    } else if (Spill::IsSpilled(page)) {
+        Spill::Free(page);
+    } else if (page != nullptr && DataPool::FreePage(page)) {
+        /* A merged page costs the filesystem nothing until its last owner
+         * goes, but the caller gives back the file's blocks for it */
+        FuseRamFs::UpdateUsedBlocks(File::BlocksPerPage);
+    }
+}
+
+/* Whether an entry of the page table is compressed or spilled rather
+ * than in memory as it is */
+bool File::IsPacked(const char *page) {
+    return Compressor::IsCompressed(page) || Spill::IsSpilled(page);
+}
 
-    if (!FuseRamFs::CheckHasSpaceFor(this, newSize - oldSize)) {
+/**
+ Decompresses or reads back a page for which IsPacked() holds.
+
+ @param page The entry of the page table.
+ @param out Where to put the PageSize bytes of the page.
+ @return false if the page is lost.
+ */
+bool File::Unpack(const char *page, char *out) {
+    if (Spill::IsSpilled(page)) {
+        return Spill::Read(page, out);
+    }
+    return Compressor::Decompress(page, out);
+}
+
+/**
+ Releases every page from the given index on and shrinks the page table.
+ The caller must hold entryRwSem exclusively.
+
+ @param first The index of the first page to free.
+ @return The number of blocks the pages were charged for.
+ */
+size_t File::FreePages(size_t first) {
+    size_t freed = 0;
+    if (first >= m_pages.size()) {
+        return 0;
+    }
+    for (size_t i = first; i < m_pages.size(); ++i) {
+        freed += PageBlocks(m_pages[i]);
+        ReleasePage(m_pages[i]);
+    }
+    m_pages.resize(first);
+    if (first == 0) {
+        m_pages.shrink_to_fit();
+    }
+    return freed;
+}
+
+/**
+ Makes the page table long enough for a number of pages. The table has
+ an entry for every page up to the last, holes included, so one write
+ far past the end of a sparse file could make it huge while the file
+ uses next to no blocks. A jump of more than a page of entries is only
+ allowed if the filesystem, and every quota the file is under, still has
+ the blocks the whole table takes. The caller must hold entryRwSem
+ exclusively.
+
+ @param pages The number of pages the table must hold.
+ @return 0, -ENOSPC or -EDQUOT.
+ */
+int File::GrowTable(size_t pages) {
+    if (pages <= m_pages.size()) {
+        return 0;
+    }
+    if ((pages - m_pages.size()) * sizeof(char *) > File::PageSize) {
+        size_t tableBlocks = get_nblocks(pages * sizeof(char *), Inode::BufBlockSize);
+        if (FuseRamFs::GetFreeBlocks() < (int64_t) tableBlocks) {
+            return -ENOSPC;
+        }
+        if (!Quota::Allows(GetQuota(), tableBlocks, 0)) {
+            return -EDQUOT;
+        }
+    }
+    try {
+        m_pages.resize(pages, nullptr);
+    } catch (std::bad_alloc &e) {
         return -ENOSPC;
     }
+    return 0;
+}
+
+/**
+ Moves inline data to a page of its own, before the file outgrows the
+ inode. The caller must hold entryRwSem exclusively.
 
-    /* Realloc if needed */
-    if (newBlocks != oldBlocks) {
-        void *newbuf = realloc(m_buf, newBlocks * File::BufBlockSize);
-        if (newbuf == nullptr && newBlocks > 0) {
-            /* Probably because newsize exceeds limit;
-             * return EINVAL in this case */
-            return EINVAL;
+ @return 0, -ENOSPC if no page is left, or -EDQUOT.
+ */
+int File::Promote() {
+    size_t size = m_attr.size;
+    if (size > 0) {
+        if (!Quota::Allows(GetQuota(), File::BlocksPerPage, 0)) {
+            return -EDQUOT;
+        }
+        if (!FuseRamFs::ReserveBlocks(File::BlocksPerPage)) {
+            return -ENOSPC;
         }
-        if (newBlocks == 0) {
-            newbuf = nullptr;
+        char *page = DataPool::AllocPage();
+        if (page == nullptr) {
+            FuseRamFs::UpdateUsedBlocks(-(ssize_t) File::BlocksPerPage);
+            return -ENOSPC;
         }
-        m_buf = newbuf;
+        try {
+            m_pages.assign(1, page);
+        } catch (std::bad_alloc &e) {
+            DataPool::FreePage(page);
+            FuseRamFs::UpdateUsedBlocks(-(ssize_t) File::BlocksPerPage);
+            return -ENOSPC;
+        }
+        memcpy(page, m_inline, size);
+
+        Attr attr = m_attr;
+        attr.blocks += File::BlocksPerPage;
+        StoreAttr(attr);
     }
+    memset(m_inline, 0, sizeof(m_inline));
+    m_isInline = false;
+    return 0;
+}
 
-    /* If the file is expanded, zero out outstanding bytes */
-    if (newSize > oldSize) {
-        memset((char *)m_buf + oldSize, 0, newSize - oldSize);
+/**
+ Moves the data of a file which shrinks to at most InlineSize back into
+ the inode and frees its pages. The caller must hold entryRwSem
+ exclusively.
+
+ @param newSize The size the file is truncated to.
+ */
+void File::Demote(size_t newSize) {
+    size_t keep = std::min(newSize, (size_t) m_attr.size);
+    if (keep > 0 && !m_pages.empty() && m_pages[0] != nullptr) {
+        char page[File::PageSize];
+        const char *data = m_pages[0];
+        if (IsPacked(data)) {
+            data = Unpack(data, page) ? page : ZeroPage;
+        }
+        memcpy(m_inline, data, keep);
     }
+    size_t freedBlocks = FreePages(0);
+    FuseRamFs::UpdateUsedBlocks(-freedBlocks);
+
+    Attr attr = m_attr;
+    attr.blocks -= freedBlocks;
+    StoreAttr(attr);
+    m_isInline = true;
+}
 
-    /* Update size / block usage */
-    FuseRamFs::UpdateUsedBlocks(newBlocks - oldBlocks);
+int File::FileTruncate(size_t newSize) {
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
-    m_fuseEntryParam.attr.st_blocks = newBlocks;
-    m_fuseEntryParam.attr.st_size = newSize;
-    
+    if (m_isInline && newSize > File::InlineSize) {
+        int ret = Promote();
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (!m_isInline && newSize <= File::InlineSize) {
+        Demote(newSize);
+    }
+
+    Attr attr = m_attr;
+    size_t oldSize = attr.size;
+
+    if (m_isInline) {
+        /* Keep the bytes past the end zeroed */
+        size_t end = std::min(oldSize, (size_t) File::InlineSize);
+        if (newSize < end) {
+            memset(m_inline + newSize, 0, end - newSize);
+        }
+    } else if (newSize < oldSize) {
+        /* Drop the pages which are now entirely past the end */
+        size_t keepPages = get_nblocks(newSize, File::PageSize);
+        ssize_t inflated = 0;
+        if (newSize % File::PageSize != 0 && keepPages <= m_pages.size() && !Unshare(keepPages - 1, &inflated)) {
+            return -ENOSPC;
+        }
+        attr.blocks += inflated;
+        size_t freedBlocks = FreePages(keepPages);
+
+        /* Keep the tail of the last page zeroed */
+        size_t tail = newSize % File::PageSize;
+        if (tail != 0 && keepPages <= m_pages.size() && m_pages[keepPages - 1] != nullptr) {
+            memset(m_pages[keepPages - 1] + tail, 0, File::PageSize - tail);
+        }
+
+        FuseRamFs::UpdateUsedBlocks(-freedBlocks);
+        attr.blocks -= freedBlocks;
+    }
+    /* Growing the file only creates a hole; no pages are needed */
+    attr.size = newSize;
+
     /* Changes to file content: both mtime and ctime will change */
-#ifdef __APPLE__
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctimespec));
-    m_fuseEntryParam.attr.st_mtimespec = m_fuseEntryParam.attr.st_ctimespec;
-#else
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctim));
-    m_fuseEntryParam.attr.st_mtim = m_fuseEntryParam.attr.st_ctim;
-#endif
+    clock_gettime(CLOCK_REALTIME, &attr.ctime);
+    attr.mtime = attr.ctime;
+    StoreAttr(attr);
     return 0;
 }
 
 int File::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) {
-    // Allocate more memory if we don't have space.
-    size_t newSize = off + size;
-    size_t originalCapacity = Inode::BufBlockSize * File::UsedBlocks();
-    size_t newBlocks = newSize/Inode::BufBlockSize + (newSize % Inode::BufBlockSize != 0);
-
-    /* Request for more memory if write() expands the file */
-    if (newSize > originalCapacity) {
-        if (!FuseRamFs::CheckHasSpaceFor(this, newSize - File::Size())) {
-            return fuse_reply_err(req, ENOSPC);
-        }
-        void *newBuf = realloc(m_buf, newBlocks * Inode::BufBlockSize);
-        // If we ran out of memory, let the caller know that no bytes were
-        // written.
-        if (newBuf == NULL) {
-            return fuse_reply_write(req, 0);;
-        }
-        
-        // Update our buffer size
-        m_buf = newBuf;
-    }
-    
-    // Write to the buffer. TODO: Check if SRC and DST overlap.
-    // We assume that there can be no buffer overflow since realloc has already
-    // been called with the new size and offset. If realloc failed, we wouldn't
-    // be here.
-    memcpy((char *) m_buf + off, buf, size);
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void *) buf;
+    return WriteBufAndReply(req, &bufv, off);
+}
 
-    /* Update size and block usage info */
-    if (newSize > originalCapacity) {
-        FuseRamFs::UpdateUsedBlocks(newBlocks - m_fuseEntryParam.attr.st_blocks);
+/**
+ Writes into the inline data of a small file. The caller must hold
+ entryRwSem exclusively.
+
+ @param bufv The buffers holding the data to write.
+ @param off The offset to write at.
+ @param size The number of bytes to write; off + size is at most InlineSize.
+ @return The number of bytes written, or a negative errno.
+ */
+ssize_t File::WriteInline(struct fuse_bufvec *bufv, off_t off, size_t size) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = m_inline + off;
+    ssize_t res = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+    if (res <= 0) {
+        return res;
+    }
+
+    Attr attr = m_attr;
+    if (off + res > attr.size) {
+        attr.size = off + res;
+    }
+    ContentChanged(attr);
+    StoreAttr(attr);
+    return res;
+}
+
+/**
+ Records a write in the attributes about to be stored. The caller must
+ hold entryRwSem exclusively, or shared along with m_pageLocks->attr.
+
+ With WritebackCache the kernel keeps the mtime and ctime of cached
+ writes itself and sends them in a setattr later, so the clock isn't
+ read on every write; Flush() only catches the times up if the kernel
+ hasn't sent them by then.
+
+ @param attr The new attributes.
+ */
+void File::ContentChanged(Attr &attr) {
+    if (WritebackCache) {
+        m_timesPending = true;
+        return;
     }
+    clock_gettime(CLOCK_REALTIME, &attr.ctime);
+    attr.mtime = attr.ctime;
+}
 
+/**
+ Sets the attributes. Times the kernel sends replace those of the writes
+ it cached.
+ */
+int File::ReplySetAttr(fuse_req_t req, struct stat *attr, int to_set) {
+    if (WritebackCache && (to_set & FUSE_SET_ATTR_MTIME)) {
+        std::unique_lock<std::shared_mutex> lk(entryRwSem);
+        m_timesPending = false;
+    }
+    return Inode::ReplySetAttr(req, attr, to_set);
+}
+
+/**
+ Updates the mtime and ctime for writes the kernel cached, if it hasn't
+ sent their times yet, and offers a partial last page for deduplication.
+ Called when the file is flushed, synced or released.
+ */
+void File::Flush() {
+    if (!WritebackCache && !Dedup::Enabled) {
+        return;
+    }
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
-    if (newSize > originalCapacity) {
-        m_fuseEntryParam.attr.st_blocks = newBlocks;
-        m_fuseEntryParam.attr.st_size = newSize;
+    /* Writes only merge the pages they fill */
+    if (Dedup::Enabled && !m_isInline && m_attr.size % File::PageSize != 0 &&
+        (size_t) m_attr.size / File::PageSize < m_pages.size()) {
+        MergePage(m_attr.size / File::PageSize);
     }
-    
+    if (!m_timesPending) {
+        return;
+    }
+    Attr attr = m_attr;
+    clock_gettime(CLOCK_REALTIME, &attr.ctime);
+    attr.mtime = attr.ctime;
+    StoreAttr(attr);
+    m_timesPending = false;
+}
+
+/**
+ Gives page i a copy of its own if other files share it, or decompresses
+ or reads it back, before it is written. The caller must hold entryRwSem exclusively,
+ or shared with the page locked in m_pageLocks.
+
+ @param i The index of the page.
+ @param blocks Where to add the blocks a decompressed page takes on top.
+ @param makeRoom Whether to wait for a spill round when no blocks are
+   free, rather than fail.
+ @return false if no page was left for the copy.
+ */
+bool File::Unshare(size_t i, ssize_t *blocks, bool makeRoom) {
+    char *page = m_pages[i];
+    if (IsPacked(page)) {
+        size_t extra = File::BlocksPerPage - PageBlocks(page);
+        if (!(makeRoom ? FuseRamFs::ReserveBlocks(extra) : FuseRamFs::ReserveFreeBlocks(extra))) {
+            return false;
+        }
+        char *copy = DataPool::AllocPage();
+        if (copy == nullptr) {
+            FuseRamFs::UpdateUsedBlocks(-(ssize_t) extra);
+            return false;
+        }
+        if (!Unpack(page, copy)) {
+            memset(copy, 0, File::PageSize);
+        }
+        ReleasePage(page);
+        m_pages[i] = copy;
+        *blocks += extra;
+        return true;
+    }
+    if (page == nullptr || !DataPool::IsShared(page)) {
+        return true;
+    }
+    /* A merged page is charged to the filesystem once; a copy is charged
+     * again. Its only owner may simply take it out of the index. */
+    bool merged = DataPool::IsIndexed(page);
+    if (merged && Dedup::Unindex(page)) {
+        return true;
+    }
+    if (merged && !FuseRamFs::ReserveBlocks(File::BlocksPerPage)) {
+        return false;
+    }
+    char *copy = DataPool::AllocPage();
+    if (copy == nullptr) {
+        if (merged) {
+            FuseRamFs::UpdateUsedBlocks(-(ssize_t) File::BlocksPerPage);
+        }
+        return false;
+    }
+    memcpy(copy, page, File::PageSize);
+    /* The others may have let go meanwhile, leaving this the last owner */
+    if (!DataPool::FreePage(page) && merged) {
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) File::BlocksPerPage);
+    }
+    m_pages[i] = copy;
+    return true;
+}
+
+/**
+ Shares page i with an identical page of another file, if there is one,
+ and enters it in the dedup index otherwise. The caller must hold
+ entryRwSem exclusively, or shared with the page locked in m_pageLocks.
+
+ @param i The index of the page.
+ */
+void File::MergePage(size_t i) {
+    char *page = m_pages[i];
+    if (page == nullptr || IsPacked(page) || DataPool::IsShared(page)) {
+        return;
+    }
+    char *same = Dedup::Merge(page);
+    if (same != page) {
+        m_pages[i] = same;
+        /* The file keeps its blocks in st_blocks */
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) File::BlocksPerPage);
+    }
+}
+
+int File::WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off) {
+    size_t size = fuse_buf_size(bufv);
+    if (size == 0) {
+        return fuse_reply_write(req, 0);
+    }
+
+    Touch();
+    ssize_t res;
+    if (!WriteWithin(bufv, off, size, &res)) {
+        /* Pages may be added below, so keep readers out until we're done */
+        std::unique_lock<std::shared_mutex> lk(entryRwSem);
+        bool within = off + size <= (size_t) m_attr.size;
+        res = WriteBuf(bufv, off, size);
+        /* Overwrites are likely to go on, perhaps from several writers */
+        if (res > 0 && within && !m_isInline && m_pageLocks == nullptr) {
+            m_pageLocks = new (std::nothrow) PageLocks();
+        }
+    }
+    if (res < 0) {
+        return fuse_reply_err(req, -res);
+    }
+    Metrics::Count(Metrics::BytesWritten, res);
+    return fuse_reply_write(req, res);
+}
+
+/**
+ Writes data straight into the file's pages. The source may be the FUSE
+ pipe itself, in which case the payload is read from the pipe into the
+ pages without an intermediate buffer. The caller must hold entryRwSem
+ exclusively.
+
+ @param bufv The buffers holding the data to write.
+ @param off The offset to write at.
+ @param size The number of bytes in bufv, at least 1.
+ @return The number of bytes written, or a negative errno.
+ */
+ssize_t File::WriteBuf(struct fuse_bufvec *bufv, off_t off, size_t size) {
+    if (m_isInline) {
+        if ((size_t) off + size <= File::InlineSize) {
+            return WriteInline(bufv, off, size);
+        }
+        int ret = Promote();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    size_t lastPage = (off + size - 1) / File::PageSize;
+    int ret = GrowTable(lastPage + 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ssize_t blocks;
+    ssize_t written = WritePages(bufv, off, size, &blocks);
+    if (written <= 0) {
+        if (blocks != 0) {
+            Attr attr = m_attr;
+            attr.blocks += blocks;
+            StoreAttr(attr);
+        }
+        return written;
+    }
+
+    /* Update size and block usage info */
+    Attr attr = m_attr;
+    attr.blocks += blocks;
+    if (off + written > attr.size) {
+        attr.size = off + written;
+    }
+
     /* Changes to file content: both mtime and ctime will change */
-#ifdef __APPLE__
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctimespec));
-    m_fuseEntryParam.attr.st_mtimespec = m_fuseEntryParam.attr.st_ctimespec;
-#else
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctim));
-    m_fuseEntryParam.attr.st_mtim = m_fuseEntryParam.attr.st_ctim;
-#endif
-    
-    return fuse_reply_write(req, size);
-}
-
-int File::ReadAndReply(fuse_req_t req, size_t size, off_t off) {    
-    // Don't start the read past our file size
-    if (off > m_fuseEntryParam.attr.st_size) {
-        return fuse_reply_buf(req, (const char *) m_buf, 0);
+    ContentChanged(attr);
+    StoreAttr(attr);
+
+    return written;
+}
+
+/**
+ Writes within the file's size while other writers may do the same
+ elsewhere in it. Only the pages written are locked, and entryRwSem is
+ held shared, so readers and writers of other pages aren't held up. The
+ caller must not hold entryRwSem.
+
+ Writes which grow the file, or land in the inline data, go through
+ WriteBuf() instead, as do all writes to a file which has only been
+ appended to so far.
+
+ @param bufv The buffers holding the data to write.
+ @param off The offset to write at.
+ @param size The number of bytes in bufv, at least 1.
+ @param res Where to put the number of bytes written, or a negative errno.
+ @return false if the write has to take entryRwSem exclusively.
+ */
+bool File::WriteWithin(struct fuse_bufvec *bufv, off_t off, size_t size, ssize_t *res) {
+    std::shared_lock<std::shared_mutex> lk(entryRwSem);
+    size_t firstPage = off / File::PageSize;
+    size_t lastPage = (off + size - 1) / File::PageSize;
+    if (m_pageLocks == nullptr || m_isInline || off + size > (size_t) LoadField(m_attr.size) ||
+        lastPage >= m_pages.size()) {
+        return false;
+    }
+
+    /* Whole pages: filling a hole or unsharing affects the entire page */
+    RangeLock::Guard pages(m_pageLocks->pages, firstPage, lastPage + 1, true);
+    ssize_t blocks;
+    *res = WritePages(bufv, off, size, &blocks);
+    if (*res <= 0 && blocks == 0) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> attrLk(m_pageLocks->attr);
+    Attr attr = m_attr;
+    attr.blocks += blocks;
+    if (*res > 0) {
+        ContentChanged(attr);
+    }
+    StoreAttr(attr);
+    return true;
+}
+
+/**
+ Writes data straight into the file's pages, allocating those which
+ are holes. The page table must already reach the end of the write. The
+ caller must hold entryRwSem exclusively, or shared with the pages of
+ the write locked in m_pageLocks.
+
+ @param bufv The buffers holding the data to write.
+ @param off The offset to write at.
+ @param size The number of bytes in bufv, at least 1.
+ @param blocks Where to put the blocks the file takes on top now, even
+   if the write fails: pages may have been decompressed.
+ @return The number of bytes written, or a negative errno.
+ */
+ssize_t File::WritePages(struct fuse_bufvec *bufv, off_t off, size_t size, ssize_t *blocks) {
+    size_t firstPage = off / File::PageSize;
+    size_t lastPage = (off + size - 1) / File::PageSize;
+    *blocks = 0;
+
+    /* Only the pages which don't exist yet cost any space */
+    std::vector<size_t> newPages;
+    try {
+        for (size_t i = firstPage; i <= lastPage; ++i) {
+            if (m_pages[i] == nullptr) {
+                newPages.push_back(i);
+            } else if (!Unshare(i, blocks)) {
+                return -ENOSPC;
+            }
+        }
+    } catch (std::bad_alloc &e) {
+        return -ENOSPC;
+    }
+    if (!Quota::Allows(GetQuota(), newPages.size() * File::BlocksPerPage, 0)) {
+        return -EDQUOT;
+    }
+    /* Reserve the blocks up front so concurrent writers can't overcommit */
+    if (!FuseRamFs::ReserveBlocks(newPages.size() * File::BlocksPerPage)) {
+        return -ENOSPC;
+    }
+
+    /* Allocate all the missing pages first so that a failure leaves the
+     * file untouched */
+    for (size_t n = 0; n < newPages.size(); ++n) {
+        char *page = DataPool::AllocPage();
+        if (page == nullptr) {
+            for (size_t k = 0; k < n; ++k) {
+                DataPool::FreePage(m_pages[newPages[k]]);
+                m_pages[newPages[k]] = nullptr;
+            }
+            FuseRamFs::UpdateUsedBlocks(-(ssize_t) (newPages.size() * File::BlocksPerPage));
+            return -ENOSPC;
+        }
+        m_pages[newPages[n]] = page;
+    }
+
+    /* Describe the destination as runs of pages which are adjacent in the
+     * pool, and copy everything in one go. */
+    std::vector<struct fuse_buf> runs;
+    size_t remaining = size;
+    for (size_t i = firstPage; i <= lastPage; ++i) {
+        size_t pageOff = (i == firstPage) ? off % File::PageSize : 0;
+        size_t len = std::min(File::PageSize - pageOff, remaining);
+        char *mem = m_pages[i] + pageOff;
+        remaining -= len;
+
+        if (!runs.empty() && (char *) runs.back().mem + runs.back().size == mem) {
+            runs.back().size += len;
+            continue;
+        }
+        struct fuse_buf run = {};
+        run.size = len;
+        run.mem = mem;
+        run.fd = -1;
+        runs.push_back(run);
+    }
+    std::vector<char> storage(sizeof(struct fuse_bufvec) + (runs.size() - 1) * sizeof(struct fuse_buf));
+    struct fuse_bufvec *dst = (struct fuse_bufvec *) storage.data();
+    dst->count = runs.size();
+    dst->idx = 0;
+    dst->off = 0;
+    std::copy(runs.begin(), runs.end(), dst->buf);
+
+    ssize_t res = fuse_buf_copy(dst, bufv, (enum fuse_buf_copy_flags) 0);
+    size_t written = res > 0 ? res : 0;
+
+    /* A short copy leaves some of the new pages unused; give them back */
+    size_t usedPages = 0;
+    for (size_t n = 0; n < newPages.size(); ++n) {
+        if (written > 0 && newPages[n] <= (off + written - 1) / File::PageSize) {
+            ++usedPages;
+        } else {
+            DataPool::FreePage(m_pages[newPages[n]]);
+            m_pages[newPages[n]] = nullptr;
+        }
+    }
+    FuseRamFs::UpdateUsedBlocks(-(ssize_t) ((newPages.size() - usedPages) * File::BlocksPerPage));
+    *blocks += usedPages * File::BlocksPerPage;
+
+    /* Pages the write filled up to their end are likely complete */
+    if (Dedup::Enabled && written > 0) {
+        for (size_t i = firstPage; (i + 1) * File::PageSize <= off + written; ++i) {
+            MergePage(i);
+        }
+    }
+    return written > 0 ? (ssize_t) written : res;
+}
+
+/**
+ Makes page i of the file refer to the same page as another file. The
+ caller must hold entryRwSem exclusively.
+
+ @param i The index of the page.
+ @param page The pool or image page to share, or nullptr for a hole.
+ @return 0, or -ENOSPC.
+ */
+int File::SharePage(size_t i, char *page) {
+    if (i >= m_pages.size()) {
+        if (page == nullptr) {
+            return 0;
+        }
+        int ret = GrowTable(i + 1);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    char *old = m_pages[i];
+    if (old == page) {
+        return 0;
+    }
+
+    /* Every file is charged for the pages it refers to, shared or not */
+    ssize_t blocks = (ssize_t) PageBlocks(page) - (ssize_t) PageBlocks(old);
+    if (blocks > 0 && !Quota::Allows(GetQuota(), blocks, 0)) {
+        return -EDQUOT;
+    }
+    if (blocks > 0 && !FuseRamFs::ReserveBlocks(blocks)) {
+        return -ENOSPC;
+    }
+    /* Like a merge, another owner of an indexed page costs the filesystem
+     * nothing */
+    if (page != nullptr && DataPool::Share(page)) {
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) File::BlocksPerPage);
+    }
+    ReleasePage(old);
+    if (blocks < 0) {
+        FuseRamFs::UpdateUsedBlocks(blocks);
+    }
+    m_pages[i] = page;
+
+    Attr attr = m_attr;
+    attr.blocks += blocks;
+    StoreAttr(attr);
+    return 0;
+}
+
+/**
+ Copies a range of another file, or of this one, into this file. Whole
+ pages at page-aligned offsets are shared rather than copied, and only
+ get copied once either file writes to them.
+
+ @param src The file to copy from.
+ @param srcOff Where the range starts in src.
+ @param off Where to copy the range to.
+ @param len The length of the range. It is cut short at the end of src.
+ @return The number of bytes copied, or a negative errno.
+ */
+ssize_t File::CopyFrom(File *src, off_t srcOff, off_t off, size_t len) {
+    if (srcOff < 0 || off < 0) {
+        return -EINVAL;
+    }
+
+    /* Lock in address order so two copies in opposite directions can't
+     * deadlock */
+    std::shared_lock<std::shared_mutex> srcLk;
+    std::unique_lock<std::shared_mutex> lk;
+    if (src == this) {
+        lk = std::unique_lock<std::shared_mutex>(entryRwSem);
+    } else if (src < this) {
+        srcLk = std::shared_lock<std::shared_mutex>(src->entryRwSem);
+        lk = std::unique_lock<std::shared_mutex>(entryRwSem);
+    } else {
+        lk = std::unique_lock<std::shared_mutex>(entryRwSem);
+        srcLk = std::shared_lock<std::shared_mutex>(src->entryRwSem);
+    }
+
+    size_t srcSize = LoadField(src->m_attr.size);
+    if ((size_t) srcOff >= srcSize || len == 0) {
+        return 0;
+    }
+    len = std::min(len, srcSize - srcOff);
+    if (src == this && (size_t) srcOff < off + len && (size_t) off < srcOff + len) {
+        return -EINVAL;
+    }
+    /* Writers within src may still be at work on other pages */
+    std::optional<RangeLock::Guard> srcPages;
+    if (src != this && src->m_pageLocks != nullptr) {
+        srcPages.emplace(src->m_pageLocks->pages, srcOff / File::PageSize,
+                         (srcOff + len - 1) / File::PageSize + 1, false);
+    }
+
+    Touch();
+    src->Touch();
+    size_t done = 0;
+    ssize_t err = 0;
+    /* Compressed and spilled pages of src are copied, from here */
+    std::vector<char> inflated;
+    while (done < len) {
+        size_t from = srcOff + done, to = off + done;
+        if (!src->m_isInline && !m_isInline && len - done >= File::PageSize &&
+            from % File::PageSize == 0 && to % File::PageSize == 0) {
+            size_t i = from / File::PageSize;
+            char *page = i < src->m_pages.size() ? src->m_pages[i] : nullptr;
+            if (!IsPacked(page)) {
+                if ((err = SharePage(to / File::PageSize, page)) < 0) {
+                    break;
+                }
+                done += File::PageSize;
+                continue;
+            }
+        }
+
+        /* Copy up to the next page boundary on either side */
+        size_t chunk = len - done;
+        const char *mem;
+        if (src->m_isInline) {
+            mem = src->m_inline + from;
+        } else {
+            size_t i = from / File::PageSize, pageOff = from % File::PageSize;
+            chunk = std::min(chunk, File::PageSize - pageOff);
+            const char *page = i < src->m_pages.size() ? src->m_pages[i] : nullptr;
+            if (IsPacked(page)) {
+                inflated.resize(File::PageSize);
+                page = Unpack(page, inflated.data()) ? inflated.data() : nullptr;
+            }
+            mem = (page != nullptr ? page : ZeroPage) + pageOff;
+        }
+        chunk = std::min(chunk, File::PageSize - to % File::PageSize);
+
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(chunk);
+        bufv.buf[0].mem = (void *) mem;
+        ssize_t res = WriteBuf(&bufv, to, chunk);
+        if (res <= 0) {
+            err = res;
+            break;
+        }
+        done += res;
+    }
+
+    /* Stamped here even with WritebackCache: the kernel didn't see this
+     * write and won't send its times */
+    if (done > 0) {
+        Attr attr = m_attr;
+        if (off + done > (size_t) attr.size) {
+            attr.size = off + done;
+        }
+        clock_gettime(CLOCK_REALTIME, &attr.ctime);
+        attr.mtime = attr.ctime;
+        StoreAttr(attr);
+        m_timesPending = false;
+    }
+    return done > 0 ? (ssize_t) done : err;
+}
+
+/* Records that the file is in use, so it isn't compressed for a while */
+void File::Touch() {
+    if (Compressor::ColdSeconds == 0 && !Spill::Enabled()) {
+        return;
+    }
+    uint32_t now = Compressor::Now();
+    if (m_touched.load(std::memory_order_relaxed) != now) {
+        m_touched.store(now, std::memory_order_relaxed);
+    }
+}
+
+/**
+ Compresses the pages of the file if it went untouched since a given
+ time, and was touched since it was last compressed. Pages are done a
+ batch at a time, giving up as soon as the file is in use again, so
+ nobody waits for more than a batch. Only the compressor thread calls
+ this.
+
+ @param coldBefore Files touched later than this aren't cold yet.
+ @return The number of pages compressed.
+ */
+size_t File::CompressCold(uint32_t coldBefore) {
+    uint32_t touched = m_touched.load(std::memory_order_relaxed);
+    if (touched == m_compressedTouch || (int32_t) (touched - coldBefore) > 0) {
+        return 0;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0;;) {
+        std::unique_lock<std::shared_mutex> lk(entryRwSem, std::try_to_lock);
+        if (!lk.owns_lock() || m_touched.load(std::memory_order_relaxed) != touched) {
+            break;
+        }
+        if (m_isInline || i >= m_pages.size()) {
+            m_compressedTouch = touched;
+            break;
+        }
+        ssize_t saved = 0;
+        for (size_t end = std::min(m_pages.size(), i + CompressBatch); i < end; ++i) {
+            char *page = m_pages[i];
+            /* Shared pages would need a copy each; image pages cost nothing */
+            if (page == nullptr || Compressor::IsCompressed(page) || !DataPool::Contains(page) ||
+                DataPool::IsShared(page)) {
+                continue;
+            }
+            char *compressed = Compressor::Compress(page);
+            if (compressed == nullptr) {
+                continue;
+            }
+            saved += File::BlocksPerPage - Compressor::Blocks(compressed);
+            DataPool::FreePage(page);
+            m_pages[i] = compressed;
+            ++count;
+        }
+        if (saved > 0) {
+            FuseRamFs::UpdateUsedBlocks(-saved);
+            Attr attr = m_attr;
+            attr.blocks -= saved;
+            StoreAttr(attr);
+        }
+    }
+    Metrics::Count(Metrics::PagesCompressed, count);
+    return count;
+}
+
+/**
+ Writes the pages of the file out to the spill file, unless they went
+ there since the file was last touched. Pages are done a batch at a time
+ like in CompressCold(), and only until the filesystem has room again.
+ Shared pages and those of a snapshot image stay in memory. Only the
+ spill thread calls this.
+
+ @return The number of pages spilled, or -ENOSPC if the spill file is
+   full.
+ */
+ssize_t File::SpillPages() {
+    uint32_t touched = m_touched.load(std::memory_order_relaxed);
+    if (touched == m_spilledTouch) {
+        return 0;
+    }
+
+    ssize_t count = 0;
+    bool full = false;
+    for (size_t i = 0; !full && !Spill::HasRoom();) {
+        std::unique_lock<std::shared_mutex> lk(entryRwSem, std::try_to_lock);
+        if (!lk.owns_lock() || m_touched.load(std::memory_order_relaxed) != touched) {
+            break;
+        }
+        if (m_isInline || i >= m_pages.size()) {
+            /* The file may be touched again within this tick of the clock */
+            if (touched != Compressor::Now()) {
+                m_spilledTouch = touched;
+            }
+            break;
+        }
+        ssize_t freed = 0;
+        for (size_t end = std::min(m_pages.size(), i + SpillBatch); i < end; ++i) {
+            char *page = m_pages[i];
+            char inflated[File::PageSize];
+            const char *data = page;
+            if (Compressor::IsCompressed(page)) {
+                if (!Compressor::Decompress(page, inflated)) {
+                    continue;
+                }
+                data = inflated;
+            } else if (page == nullptr || Spill::IsSpilled(page) || !DataPool::Contains(page) ||
+                       DataPool::IsShared(page)) {
+                continue;
+            }
+            char *spilled = Spill::Write(data);
+            if (spilled == nullptr) {
+                full = true;
+                break;
+            }
+            freed += PageBlocks(page);
+            ReleasePage(page);
+            m_pages[i] = spilled;
+            ++count;
+        }
+        if (freed > 0) {
+            FuseRamFs::UpdateUsedBlocks(-freed);
+            Attr attr = m_attr;
+            attr.blocks -= freed;
+            StoreAttr(attr);
+        }
+    }
+    return full ? -ENOSPC : count;
+}
+
+/**
+ Tells whether relatime would update the atime: it is no newer than the
+ last modification or change, or it is at least a day old.
+
+ @param attr The attributes of the file.
+ @param now The time of the read.
+ */
+bool File::AtimeIsStale(const Attr &attr, const struct timespec &now) {
+    const struct timespec &atime = attr.atime;
+    const struct timespec &mtime = attr.mtime;
+    const struct timespec &ctime = attr.ctime;
+    auto notAfter = [](const struct timespec &a, const struct timespec &b) {
+        return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+    };
+    return notAfter(atime, mtime) || notAfter(atime, ctime) ||
+           now.tv_sec - atime.tv_sec >= 24 * 60 * 60;
+}
+
+/**
+ Records a read. With lazytime this only stores the time in an atomic,
+ otherwise it takes entryRwSem, which the caller must not hold.
+
+ @param now The time of the read.
+ */
+void File::TouchAtime(const struct timespec &now) {
+    if (AtimeMode == ATIME_MODE_LAZY) {
+        m_lazyAtime.store((int64_t) now.tv_sec * 1000000000 + now.tv_nsec, std::memory_order_relaxed);
+        return;
     }
-    
-    // Update access time. TODO: This could get very intensive. Some
-    // filesystems buffer this with options at mount time. Look into this.
-    // TODO: What do we do if this fails? Do we care? Log the event?
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
-#ifdef __APPLE__
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atimespec));
-#else
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atim));
-#endif
-    
-    // Handle reading past the file size as well as inside the size.
-    size_t bytesRead = off + size > m_fuseEntryParam.attr.st_size ? m_fuseEntryParam.attr.st_size - off : size;
-    
+    Attr attr = m_attr;
+    attr.atime = now;
+    StoreAttr(attr);
+}
+
+/**
+ Replies with a range of the file's pages. The caller must hold
+ entryRwSem.
+
+ @param req The FUSE request.
+ @param off Where the range starts.
+ @param size The length of the range, which lies within the file.
+ */
+int File::ReplyPages(fuse_req_t req, off_t off, size_t size) {
+    /* Collect the pages covering the range, merging runs of pages which
+     * are adjacent in the pool. Holes are read from ZeroPage. Pages from
+     * outside the pool can't be spliced and are sent from memory, as are
+     * compressed and spilled pages once unpacked into a buffer of the
+     * read. */
+    struct Segment {
+        const char *mem;
+        size_t len;
+        bool pooled;
+    };
+    std::vector<Segment> segs;
+    size_t pooledBytes = 0, pooledSegs = 0;
+    size_t firstPage = off / File::PageSize;
+    size_t lastPage = (off + size - 1) / File::PageSize;
+    size_t packed = 0;
+    for (size_t i = firstPage; i <= lastPage && i < m_pages.size(); ++i) {
+        packed += IsPacked(m_pages[i]);
+    }
+    std::vector<char> inflated(packed * File::PageSize);
+    char *nextInflated = inflated.data();
+    size_t remaining = size;
+    for (size_t i = firstPage; i <= lastPage; ++i) {
+        size_t pageOff = (i == firstPage) ? off % File::PageSize : 0;
+        size_t len = std::min(File::PageSize - pageOff, remaining);
+        const char *page = i < m_pages.size() ? m_pages[i] : nullptr;
+        if (IsPacked(page)) {
+            page = Unpack(page, nextInflated) ? nextInflated : nullptr;
+            nextInflated += File::PageSize;
+        }
+        bool pooled = page != nullptr && DataPool::Contains(page);
+        const char *mem = (page != nullptr ? page : ZeroPage) + pageOff;
+        remaining -= len;
+
+        if (pooled) {
+            pooledBytes += len;
+        }
+        if (!segs.empty() && segs.back().pooled == pooled && segs.back().mem + segs.back().len == mem) {
+            segs.back().len += len;
+            continue;
+        }
+        if (pooled) {
+            ++pooledSegs;
+        }
+        segs.push_back({mem, len, pooled});
+    }
+
+    /* Splicing only pays off for runs of at least a couple of pages;
+     * a fragmented range goes out through a single writev instead. */
+    if (FuseRamFs::SpliceReads() && pooledSegs > 0 &&
+        pooledBytes >= pooledSegs * 2 * File::PageSize) {
+        std::vector<char> storage(sizeof(struct fuse_bufvec) + (segs.size() - 1) * sizeof(struct fuse_buf));
+        struct fuse_bufvec *bufv = (struct fuse_bufvec *) storage.data();
+        bufv->count = segs.size();
+        bufv->idx = 0;
+        bufv->off = 0;
+        for (size_t i = 0; i < segs.size(); ++i) {
+            struct fuse_buf *b = &bufv->buf[i];
+            b->size = segs[i].len;
+            if (segs[i].pooled) {
+                b->flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                b->mem = NULL;
+                b->fd = DataPool::Fd();
+                b->pos = DataPool::Offset(segs[i].mem);
+            } else {
+                b->flags = (enum fuse_buf_flags) 0;
+                b->mem = (void *) segs[i].mem;
+                b->fd = -1;
+                b->pos = 0;
+            }
+        }
+        return fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    }
+
+    std::vector<struct iovec> iov(segs.size());
+    for (size_t i = 0; i < segs.size(); ++i) {
+        iov[i].iov_base = (void *) segs[i].mem;
+        iov[i].iov_len = segs[i].len;
+    }
+
     // TODO: There are all sorts of other replies. What about them?
-    return fuse_reply_buf(req, (const char *) m_buf + off, bytesRead);
+    return fuse_reply_iov(req, iov.data(), (int) iov.size());
+}
+
+int File::ReadAndReply(fuse_req_t req, size_t size, off_t off) {
+    /* Readers only share the lock; the atime is updated after replying */
+    std::shared_lock<std::shared_mutex> lk(entryRwSem);
+
+    /* Writers within the file may change the blocks and times meanwhile,
+     * but not the size */
+    off_t fileSize = LoadField(m_attr.size);
+
+    // Don't start the read past our file size
+    if (off >= fileSize || size == 0) {
+        return fuse_reply_buf(req, NULL, 0);
+    }
+    Touch();
+
+    struct timespec now;
+    bool touch = false;
+    if (AtimeMode != ATIME_MODE_NONE) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        touch = AtimeMode != ATIME_MODE_RELATIME || AtimeIsStale(LoadAttr(), now);
+    }
+
+    // Handle reading past the file size as well as inside the size.
+    size_t bytesRead = off + size > (size_t) fileSize ? fileSize - off : size;
+
+    int ret;
+    size_t firstPage = off / File::PageSize, endPage = (off + bytesRead - 1) / File::PageSize + 1;
+    bool spilled = false;
+    if (m_isInline) {
+        ret = fuse_reply_buf(req, m_inline + off, bytesRead);
+    } else {
+        std::optional<RangeLock::Guard> pages;
+        if (m_pageLocks != nullptr) {
+            pages.emplace(m_pageLocks->pages, firstPage, endPage, false);
+        }
+        ret = ReplyPages(req, off, bytesRead);
+        for (size_t i = firstPage; Spill::Enabled() && i < endPage && i < m_pages.size() && !spilled; ++i) {
+            spilled = Spill::IsSpilled(m_pages[i]);
+        }
+    }
+
+    lk.unlock();
+    /* Only bytes which made it to the kernel count */
+    if (ret == 0) {
+        Metrics::Count(Metrics::BytesRead, bytesRead);
+    }
+    /* Pages read from the spill file are likely to be read again */
+    if (spilled && Spill::HasRoom()) {
+        FaultIn(firstPage, endPage);
+    }
+    if (touch) {
+        TouchAtime(now);
+    }
+    return ret;
+}
+
+/**
+ Brings spilled pages back into memory, unless the file is busy or no
+ blocks are free. Pages which can't come back stay spilled and are read
+ through; this never waits for spilling, which holding entryRwSem would
+ stall every other user of the file on. The caller must not hold
+ entryRwSem.
+
+ @param first The first page.
+ @param end One past the last page.
+ */
+void File::FaultIn(size_t first, size_t end) {
+    std::unique_lock<std::shared_mutex> lk(entryRwSem, std::try_to_lock);
+    if (!lk.owns_lock()) {
+        return;
+    }
+    ssize_t blocks = 0;
+    for (size_t i = first; i < end && i < m_pages.size(); ++i) {
+        if (Spill::IsSpilled(m_pages[i]) && !Unshare(i, &blocks, false)) {
+            break;
+        }
+    }
+    if (blocks != 0) {
+        Attr attr = m_attr;
+        attr.blocks += blocks;
+        StoreAttr(attr);
+    }
+}
+
+/**
+ Writes the file to a snapshot: its inline data, or the pages it has.
+
+ @param out The image being written.
+ */
+void File::Save(ImageWriter &out) {
+    Inode::Save(out);
+
+    std::shared_lock<std::shared_mutex> lk(entryRwSem);
+    out.PutU32(m_isInline);
+    if (m_isInline) {
+        out.PutString(m_inline, m_attr.size);
+        return;
+    }
+    std::optional<RangeLock::Guard> pages;
+    if (m_pageLocks != nullptr) {
+        pages.emplace(m_pageLocks->pages, 0, m_pages.size(), false);
+    }
+    uint64_t count = 0;
+    for (char *page : m_pages) {
+        count += page != nullptr;
+    }
+    out.PutU64(count);
+    char inflated[File::PageSize];
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        const char *page = m_pages[i];
+        if (page == nullptr) {
+            continue;
+        }
+        out.PutU64(i);
+        if (IsPacked(page)) {
+            /* Images hold plain pages; this one has no other owner */
+            if (!Unpack(page, inflated)) {
+                memset(inflated, 0, sizeof(inflated));
+            }
+            out.PutU64(out.PutPage(inflated, false));
+        } else {
+            out.PutU64(out.PutPage(page));
+        }
+    }
 }
 
+/**
+ Reads back what Save() wrote. The pages are left in the image, which is
+ only read as they are, and copied into the pool when written.
+
+ @param in The record of the file in the image.
+ @param ino The inode number.
+ @param mode The mode of the file.
+ @return false if the record is damaged.
+ */
+bool File::Load(ImageReader &in, fuse_ino_t ino, mode_t mode) {
+    uint32_t isInline;
+    if (!Inode::Load(in, ino, mode) || !in.GetU32(isInline)) {
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    Attr attr = m_attr;
+    if (isInline) {
+        std::string data;
+        if (!in.GetString(data) || data.size() > File::InlineSize || (off_t) data.size() != attr.size) {
+            return false;
+        }
+        memcpy(m_inline, data.data(), data.size());
+        attr.blocks = 0;
+    } else {
+        m_isInline = false;
+        uint64_t count;
+        if (!in.GetU64(count)) {
+            return false;
+        }
+        size_t maxPages = get_nblocks(attr.size, File::PageSize);
+        for (uint64_t n = 0; n < count; ++n) {
+            uint64_t i;
+            const char *page;
+            if (!in.GetU64(i) || i >= maxPages || i < m_pages.size() || (page = in.GetPage()) == nullptr) {
+                return false;
+            }
+            m_pages.resize(i + 1, nullptr);
+            m_pages[i] = (char *) page;
+        }
+        attr.blocks = count * File::BlocksPerPage;
+    }
+    StoreAttr(attr);
+    return true;
+}
@@ -5,20 +5,109 @@
 #ifndef file_hpp
 #define file_hpp
 
+#include "data_pool.hpp"
+#include "range_lock.hpp"
+
 class File : public Inode {
+public:
+    static const enum InodeKinds Kind = INODE_KIND_FILE;
+    /* File contents are kept in fixed-size pages from the DataPool */
+    static const size_t PageSize = DataPool::PageSize;
+    static const size_t BlocksPerPage = PageSize / Inode::BufBlockSize;
+    /* Files no larger than this keep their data in the inode itself */
+    static const size_t InlineSize = 128;
+    /* When reads update the atime, for all files */
+    static enum AtimeModes AtimeMode;
+    /* Whether the kernel caches writes, and with them the file times */
+    static bool WritebackCache;
+    /* Set while all files go away at once, when the filesystem does. Pool
+     * pages and spilled pages are then left for DataPool::Reset() and
+     * Spill::Reset() instead of being given back one by one. */
+    static bool Discarding;
+
 private:
-    void *m_buf;
-    
+    /* Page i holds bytes [i * PageSize, (i + 1) * PageSize). A null
+     * entry is a hole which reads back as zeros and uses no blocks.
+     * Bytes of a page past the end of the file are always zero. It is
+     * grown through GrowTable(). */
+    std::vector<char *> m_pages;
+    /* The data of a small file while m_isInline, in which case there are
+     * no pages. Bytes past the end of the file are always zero. Inline
+     * data takes no blocks. */
+    char m_inline[InlineSize];
+    bool m_isInline;
+    /* Written since the kernel last sent the times; see Flush() */
+    bool m_timesPending;
+    /* Set up once the file is overwritten rather than only appended to.
+     * From then on, writes within the file hold entryRwSem shared and
+     * lock just the pages they change, and readers lock the pages they
+     * read; see WriteWithin(). */
+    struct PageLocks {
+        RangeLock pages;
+        /* Serializes StoreAttr() among writers holding entryRwSem shared */
+        std::mutex attr;
+    };
+    PageLocks *m_pageLocks;
+    /* When the file was last read or written, by Compressor::Now(), while
+     * compression or spilling is on; and the times it was last compressed
+     * and spilled after */
+    std::atomic<uint32_t> m_touched;
+    uint32_t m_compressedTouch;
+    uint32_t m_spilledTouch;
+
+    /* Pages compressed or spilled at a time while holding the file's lock */
+    static const size_t CompressBatch = 64;
+    static const size_t SpillBatch = 64;
+
+    static const char ZeroPage[PageSize];
+    static Slab m_slab;
+
+    static size_t PageBlocks(const char *page);
+    static void ReleasePage(char *page);
+    static bool IsPacked(const char *page);
+    static bool Unpack(const char *page, char *out);
+    size_t FreePages(size_t first);
+    int GrowTable(size_t pages);
+    int Promote();
+    void Demote(size_t newSize);
+    int ReplyPages(fuse_req_t req, off_t off, size_t size);
+    void FaultIn(size_t first, size_t end);
+    ssize_t WriteInline(struct fuse_bufvec *bufv, off_t off, size_t size);
+    ssize_t WriteBuf(struct fuse_bufvec *bufv, off_t off, size_t size);
+    bool WriteWithin(struct fuse_bufvec *bufv, off_t off, size_t size, ssize_t *res);
+    ssize_t WritePages(struct fuse_bufvec *bufv, off_t off, size_t size, ssize_t *blocks);
+    void ContentChanged(Attr &attr);
+    bool Unshare(size_t i, ssize_t *blocks, bool makeRoom = true);
+    void MergePage(size_t i);
+    int SharePage(size_t i, char *page);
+    bool AtimeIsStale(const Attr &attr, const struct timespec &now);
+    void TouchAtime(const struct timespec &now);
+    void Touch();
+
 public:
+    /* Each type of inode is allocated from its own slab */
+    static void *operator new(size_t size) { return m_slab.Alloc(size); }
+    static void operator delete(void *obj) { m_slab.Free(obj); }
+
     File() :
-    m_buf(NULL) {}
-    
+    Inode(Kind), m_inline(), m_isInline(true), m_timesPending(false), m_pageLocks(nullptr),
+    m_touched(0), m_compressedTouch(0), m_spilledTouch(UINT32_MAX) {}
+
     ~File();
-    
+
     int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off);
+    int WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off);
     int ReadAndReply(fuse_req_t req, size_t size, off_t off);
     int FileTruncate(size_t newSize);
-    
+    int ReplySetAttr(fuse_req_t req, struct stat *attr, int to_set);
+    void Flush();
+    ssize_t CopyFrom(File *src, off_t srcOff, off_t off, size_t len);
+    size_t CompressCold(uint32_t coldBefore);
+    ssize_t SpillPages();
+    uint32_t Touched() { return m_touched.load(std::memory_order_relaxed); }
+    void Save(ImageWriter &out);
+    bool Load(ImageReader &in, fuse_ino_t ino, mode_t mode);
+
 //    size_t Size();
 };
 
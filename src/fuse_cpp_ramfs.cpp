@@ -8,34 +8,40 @@
 
 #include "common.h"
 
+#include <algorithm>
+
 #include "inode.hpp"
 #include "file.hpp"
 #include "directory.hpp"
 #include "special_inode.hpp"
 #include "symlink.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "data_pool.hpp"
+#include "ramfs_ioctl.h"
+#include "snapshot.hpp"
+#include "metrics.hpp"
+#include "compressor.hpp"
 
 using namespace std;
 
-/**
- All the Inode objects in the system.
- */
-vector<Inode *> FuseRamFs::Inodes = vector<Inode *>();
-std::shared_mutex FuseRamFs::inodesRwSem;
-
-/**
- The Inodes which have been deleted.
- */
-queue<fuse_ino_t> FuseRamFs::DeletedInodes = queue<fuse_ino_t>();
-std::mutex FuseRamFs::deletedInodesMutex;
-
 /**
  The constants defining the capabilities and sizes of the filesystem.
  */
 struct statvfs FuseRamFs::m_stbuf = {};
-std::shared_mutex FuseRamFs::stbufMutex;
+/* Shards take blocks a couple of pages' worth at a time */
+SpaceCounter FuseRamFs::m_freeBlocks(64);
+SpaceCounter FuseRamFs::m_freeInodes(16);
 
 std::mutex FuseRamFs::renameMutex;
+
+bool FuseRamFs::m_spliceReads = false;
+struct fuse_chan *FuseRamFs::m_chan = nullptr;
+
+double FuseRamFs::NegativeTimeout = 0.0;
+bool FuseRamFs::KeepCache = false;
+bool FuseRamFs::WritebackCache = false;
+size_t FuseRamFs::MaxWrite = 0;
+size_t FuseRamFs::MaxReadahead = 0;
 /**
  All the supported filesystem operations mapped to object-methods.
  */
@@ -44,38 +50,50 @@ struct fuse_lowlevel_ops FuseRamFs::FuseOps = {};
 
 FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes)
 {
-    FuseOps.init        = FuseRamFs::FuseInit;
-    FuseOps.destroy     = FuseRamFs::FuseDestroy;
-    FuseOps.lookup      = FuseRamFs::FuseLookup;
-    FuseOps.forget      = FuseRamFs::FuseForget;
-    FuseOps.getattr     = FuseRamFs::FuseGetAttr;
-    FuseOps.setattr     = FuseRamFs::FuseSetAttr;
-    FuseOps.readlink    = FuseRamFs::FuseReadLink;
-    FuseOps.mknod       = FuseRamFs::FuseMknod;
-    FuseOps.mkdir       = FuseRamFs::FuseMkdir;
-    FuseOps.unlink      = FuseRamFs::FuseUnlink;
-    FuseOps.rmdir       = FuseRamFs::FuseRmdir;
-    FuseOps.symlink     = FuseRamFs::FuseSymlink;
-    FuseOps.rename      = FuseRamFs::FuseRename;
-    FuseOps.link        = FuseRamFs::FuseLink;
-    FuseOps.open        = FuseRamFs::FuseOpen;
-    FuseOps.read        = FuseRamFs::FuseRead;
-    FuseOps.write       = FuseRamFs::FuseWrite;
-    FuseOps.flush       = FuseRamFs::FuseFlush;
-    FuseOps.release     = FuseRamFs::FuseRelease;
-    FuseOps.fsync       = FuseRamFs::FuseFsync;
-    FuseOps.opendir     = FuseRamFs::FuseOpenDir;
-    FuseOps.readdir     = FuseRamFs::FuseReadDir;
-    FuseOps.releasedir  = FuseRamFs::FuseReleaseDir;
-    FuseOps.fsyncdir    = FuseRamFs::FuseFsyncDir;
-    FuseOps.statfs      = FuseRamFs::FuseStatfs;
-    FuseOps.setxattr    = FuseRamFs::FuseSetXAttr;
-    FuseOps.getxattr    = FuseRamFs::FuseGetXAttr;
-    FuseOps.listxattr   = FuseRamFs::FuseListXAttr;
-    FuseOps.removexattr = FuseRamFs::FuseRemoveXAttr;
-    FuseOps.access      = FuseRamFs::FuseAccess;
-    FuseOps.create      = FuseRamFs::FuseCreate;
-    FuseOps.getlk       = FuseRamFs::FuseGetLock;
+    /* Every handler is timed for Metrics::Report() */
+#define RAMFS_TIMED(op, handler) Metrics::Timed<Metrics::op, FuseRamFs::handler>::Call
+    FuseOps.init        = RAMFS_TIMED(Init, FuseInit);
+    FuseOps.destroy     = RAMFS_TIMED(Destroy, FuseDestroy);
+    FuseOps.lookup      = RAMFS_TIMED(Lookup, FuseLookup);
+    FuseOps.forget      = RAMFS_TIMED(Forget, FuseForget);
+    FuseOps.forget_multi = RAMFS_TIMED(ForgetMulti, FuseForgetMulti);
+    FuseOps.getattr     = RAMFS_TIMED(GetAttr, FuseGetAttr);
+    FuseOps.setattr     = RAMFS_TIMED(SetAttr, FuseSetAttr);
+    FuseOps.readlink    = RAMFS_TIMED(ReadLink, FuseReadLink);
+    FuseOps.mknod       = RAMFS_TIMED(Mknod, FuseMknod);
+    FuseOps.mkdir       = RAMFS_TIMED(Mkdir, FuseMkdir);
+    FuseOps.unlink      = RAMFS_TIMED(Unlink, FuseUnlink);
+    FuseOps.rmdir       = RAMFS_TIMED(Rmdir, FuseRmdir);
+    FuseOps.symlink     = RAMFS_TIMED(Symlink, FuseSymlink);
+    FuseOps.rename      = RAMFS_TIMED(Rename, FuseRename);
+    FuseOps.link        = RAMFS_TIMED(Link, FuseLink);
+    FuseOps.open        = RAMFS_TIMED(Open, FuseOpen);
+    FuseOps.read        = RAMFS_TIMED(Read, FuseRead);
+    FuseOps.write       = RAMFS_TIMED(Write, FuseWrite);
+    FuseOps.write_buf   = RAMFS_TIMED(WriteBuf, FuseWriteBuf);
+    FuseOps.flush       = RAMFS_TIMED(Flush, FuseFlush);
+    FuseOps.release     = RAMFS_TIMED(Release, FuseRelease);
+    FuseOps.fsync       = RAMFS_TIMED(Fsync, FuseFsync);
+    FuseOps.opendir     = RAMFS_TIMED(OpenDir, FuseOpenDir);
+    FuseOps.readdir     = RAMFS_TIMED(ReadDir, FuseReadDir);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 0)
+    FuseOps.readdirplus = RAMFS_TIMED(ReadDirPlus, FuseReadDirPlus);
+#endif
+    FuseOps.releasedir  = RAMFS_TIMED(ReleaseDir, FuseReleaseDir);
+    FuseOps.fsyncdir    = RAMFS_TIMED(FsyncDir, FuseFsyncDir);
+    FuseOps.statfs      = RAMFS_TIMED(Statfs, FuseStatfs);
+    FuseOps.setxattr    = RAMFS_TIMED(SetXAttr, FuseSetXAttr);
+    FuseOps.getxattr    = RAMFS_TIMED(GetXAttr, FuseGetXAttr);
+    FuseOps.listxattr   = RAMFS_TIMED(ListXAttr, FuseListXAttr);
+    FuseOps.removexattr = RAMFS_TIMED(RemoveXAttr, FuseRemoveXAttr);
+    FuseOps.access      = RAMFS_TIMED(Access, FuseAccess);
+    FuseOps.create      = RAMFS_TIMED(Create, FuseCreate);
+    FuseOps.getlk       = RAMFS_TIMED(GetLock, FuseGetLock);
+    FuseOps.ioctl       = RAMFS_TIMED(Ioctl, FuseIoctl);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+    FuseOps.copy_file_range = RAMFS_TIMED(CopyFileRange, FuseCopyFileRange);
+#endif
+#undef RAMFS_TIMED
     
     if (blocks <= 0) {
         blocks = kTotalBlocks;
@@ -96,11 +114,18 @@ FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes)
     m_stbuf.f_fsid    = kFilesystemId;         /* Filesystem ID */
     m_stbuf.f_flag    = 0;                     /* Bit mask of values */
     m_stbuf.f_namemax = kMaxFilenameLength;    /* Max file name length */
+    m_freeBlocks.Reset(blocks);
+    m_freeInodes.Reset(inodes);
+
+    /* File data can never outgrow the block capacity */
+    if (!DataPool::Init(blocks * Inode::BufBlockSize)) {
+        exit(1);
+    }
 }
 
 FuseRamFs::~FuseRamFs()
 {
-
+    DataPool::Destroy();
 }
 
 
@@ -120,6 +145,52 @@ void FuseRamFs::FuseInit(void *userdata, struct fuse_conn_info *conn)
     m_stbuf.f_ffree  = m_stbuf.f_files;	/* Free inodes */
     m_stbuf.f_favail = m_stbuf.f_files;	/* Free inodes for non-root */
     m_stbuf.f_flag   = 0;		/* Bit mask of values */
+    m_freeBlocks.Reset(m_stbuf.f_blocks);
+    m_freeInodes.Reset(m_stbuf.f_files);
+
+    /* Reads can be spliced straight out of the pool's memfd */
+    if (DataPool::Fd() >= 0 && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+            conn->want |= FUSE_CAP_SPLICE_MOVE;
+        }
+    }
+    m_spliceReads = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+
+    /* Let large writes stay in the pipe until they are copied into pages */
+    if (conn->capable & FUSE_CAP_SPLICE_READ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
+
+    /* Several reads of a file may be in flight; each takes a shared lock */
+    if (conn->capable & FUSE_CAP_ASYNC_READ) {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+#ifdef FUSE_CAP_BIG_WRITES
+    /* Otherwise every write is a page at the most */
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    /* The kernel gathers small writes in its page cache and sends them
+     * in batches, along with the times they set */
+    if (WritebackCache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+    File::WritebackCache = (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+#else
+    if (WritebackCache) {
+        fprintf(stderr, "fuse-cpp-ramfs: writeback_cache needs libfuse 3, ignored\n");
+    }
+#endif
+    /* libfuse sizes its buffers for its own maximum, so it may only be lowered */
+    if (MaxWrite > 0 && MaxWrite < conn->max_write) {
+        conn->max_write = MaxWrite;
+    }
+    if (MaxReadahead > 0) {
+        conn->max_readahead = MaxReadahead;
+    }
     
     // We start out with a special inode and a single directory (the root directory).
     Inode *inode_p;
@@ -131,14 +202,30 @@ void FuseRamFs::FuseInit(void *userdata, struct fuse_conn_info *conn)
     uid_t uid = getuid();
     inode_p = new SpecialInode(SPECIAL_INODE_TYPE_NO_BLOCK);
     RegisterInode(inode_p, 0, 0, gid, uid);
+    UpdateUsedInodes(1);
+
+    if (!Snapshot::RestoreFrom.empty()) {
+        if (Snapshot::Restore(Snapshot::RestoreFrom.c_str())) {
+            InodeTable::StartReaper();
+            Compressor::Start();
+            Spill::Start();
+            return;
+        }
+        fprintf(stderr, "fuse-cpp-ramfs: starting with an empty filesystem\n");
+    }
     
     Directory *root = new Directory();
     
     // I think that that the root directory should have a hardlink count of 3.
     // This is what I believe I've surmised from reading around.
     fuse_ino_t rootno = RegisterInode(root, S_IFDIR | 0777, 3, gid, uid);
+    UpdateUsedInodes(1);
     root->AddChild(string("."), rootno);
     root->AddChild(string(".."), rootno);
+
+    InodeTable::StartReaper();
+    Compressor::Start();
+    Spill::Start();
 }
 
 
@@ -150,9 +237,21 @@ void FuseRamFs::FuseInit(void *userdata, struct fuse_conn_info *conn)
 void FuseRamFs::FuseDestroy(void *userdata)
 {
     /* No need for locking because it's destruction of the file system */
-    for(auto const& inode: Inodes) {
-        delete inode;
-    }
+    Compressor::Stop();
+    Spill::Stop();
+    if (!Snapshot::SaveTo.empty()) {
+        Snapshot::Save(Snapshot::SaveTo.c_str());
+    }
+    InodeTable::StopReaper();
+    /* Nothing can use a page any more, so they all go back at once */
+    File::Discarding = true;
+    InodeTable::Clear();
+    Quota::Clear();
+    DataPool::Reset();
+    Spill::Reset();
+    File::Discarding = false;
+    /* Only now does no file point into a restored image */
+    Snapshot::Unmap();
 }
 
 
@@ -171,23 +270,26 @@ void FuseRamFs::FuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name)
         return;
     }
 
-    Directory *dir = dynamic_cast<Directory *>(parentInode);
+    Directory *dir = inode_cast<Directory>(parentInode);
     if (dir == NULL) {
         // The parent wasn't a directory. It can't have any children.
         fuse_reply_err(req, ENOTDIR);
         return;
     }
     
-    fuse_ino_t ino = dir->ChildInodeNumberWithName(string(name));
-    if (ino == INO_NOTFOUND) {
-        fuse_reply_err(req, ENOENT);
-        return;
-    }
-    
-    Inode *inode = GetInode(ino);
-    /* Return ENOENT if this inode has been deleted */
+    fuse_ino_t ino = dir->ChildInodeNumberWithName(name);
+    Inode *inode = ino == INO_NOTFOUND ? nullptr : GetInode(ino);
+    /* Return ENOENT if there's no such child or it has been deleted */
     if (inode == nullptr || inode->HasNoLinks()) {
-        fuse_reply_err(req, ENOENT);
+        if (NegativeTimeout > 0) {
+            /* An entry with inode 0 lets the kernel cache the miss */
+            struct fuse_entry_param e;
+            memset(&e, 0, sizeof(e));
+            e.entry_timeout = NegativeTimeout;
+            fuse_reply_entry(req, &e);
+        } else {
+            fuse_reply_err(req, ENOENT);
+        }
         return;
     }
     inode->ReplyEntry(req);
@@ -232,10 +334,11 @@ void FuseRamFs::FuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, i
         return;
     }
 
-    /* Non-null fi means the setattr() is called by ftruncate(). */
-    if (fi && (to_set & FUSE_SET_ATTR_SIZE)) {
-        File *file = dynamic_cast<File *>(inode);
-        /* Cannot ftruncate a non-regular file */
+    /* Both ftruncate() (fi is non-null) and truncate() change the size.
+     * With writeback caching, the kernel may send the times along. */
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        File *file = inode_cast<File>(inode);
+        /* Cannot truncate a non-regular file */
         if (file == nullptr) {
             if (S_ISDIR(inode->GetMode())) {
                 fuse_reply_err(req, EISDIR);
@@ -245,15 +348,17 @@ void FuseRamFs::FuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, i
             return;
         }
         int ret = file->FileTruncate(attr->st_size);
-        if (ret == 0) {
+        if (ret != 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+        to_set &= (~FUSE_SET_ATTR_SIZE);
+        if (to_set == 0) {
             file->ReplyAttr(req);
-        } else {
-            fuse_reply_err(req, ret);
+            return;
         }
-        return;
     }
 
-    to_set &= (~FUSE_SET_ATTR_SIZE);
     inode->ReplySetAttr(req, attr, to_set);
 }
 
@@ -273,7 +378,7 @@ void FuseRamFs::FuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
         return;
     }   
     // You can't open a file with 'opendir'. Check for this.
-    File *file = dynamic_cast<File *>(inode);
+    File *file = inode_cast<File>(inode);
     if (file != NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -282,6 +387,10 @@ void FuseRamFs::FuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
     // TODO: Handle permissions on files:
     //    else if ((fi->flags & 3) != O_RDONLY)
     //        fuse_reply_err(req, EACCES);
+
+    /* Remember where readdir stops. Without a cursor readdir still works,
+     * it just has to look up the offset every time. */
+    fi->fh = (uintptr_t) new (std::nothrow) Directory::ReadDirCursor();
     
     fuse_reply_open(req, fi);
 }
@@ -296,6 +405,10 @@ void FuseRamFs::FuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
  */
 void FuseRamFs::FuseReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+    /* The cursor goes away with the handle, whatever became of the dir */
+    delete (Directory::ReadDirCursor *) (uintptr_t) fi->fh;
+    fi->fh = 0;
+
     Inode *inode = GetInode(ino);
     /* return enoent if this inode has been deleted */
     if (inode == nullptr || inode->HasNoLinks()) {
@@ -303,7 +416,7 @@ void FuseRamFs::FuseReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_
         return;
     }   
     // You can't close a file with 'closedir'. Check for this.
-    File *file = dynamic_cast<File *>(inode);
+    File *file = inode_cast<File>(inode);
     if (file != NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -318,19 +431,18 @@ void FuseRamFs::FuseReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_
 
 
 /**
- Reads a directory.
+ Fills a readdir or readdirplus reply with as many entries as fit in size.
 
  @param req The FUSE request.
  @param ino The directory inode.
  @param size The maximum response size.
  @param off The offset into the list of children.
  @param fi The file info (information about an open file).
+ @param plus Whether to reply with full entries.
  */
-void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
-                             off_t off, struct fuse_file_info *fi)
+void FuseRamFs::do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi, bool plus)
 {
-    (void) fi;
-   
     Inode *inode = GetInode(ino);
     /* return ENOENT if this inode has been deleted */
     if (inode == nullptr || inode->HasNoLinks()) {
@@ -338,92 +450,62 @@ void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
         return;
     }
 
-    Directory *dir = dynamic_cast<Directory *>(inode);
+    Directory *dir = inode_cast<Directory>(inode);
     if (dir == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
     }
-    
-    Directory::ReadDirCtx *ctx;
-    try {
-        ctx = dir->PrepareReaddir(off);
-    } catch (std::out_of_range &e) {
-        fuse_reply_buf(req, NULL, 0);
-        return;
-    }
-    
-    // Loop through and put children into a buffer until we have either:
-    // a) exceeded the passed in size parameter, or
-    // b) filled the maximum number of children per response, or
-    // c) come to the end of the directory listing
-    //
-    // In the case of (a), we won't know if this is the case until we've
-    // added a child and exceeded the size. In that case, we need to back up.
-    // In the process, we may end up exceeding our buffer size for this
-    // resonse. In that case, increase the buffer size and add the child again.
-    //
-    // We must exercise care not to re-send children because one may have been
-    // added in the middle of our map of children while we were sending them.
-    // This is why we access the children with an iterator (instead of using
-    // some sort of index).
-    
-    struct stat stbuf;
-    memset(&stbuf, 0, sizeof(stbuf));
-    
-    // Pick the lesser of the max response size or our max size.
-    size_t bufSize = FuseRamFs::kReadDirBufSize < size ? FuseRamFs::kReadDirBufSize : size;
-    char *buf = (char *) malloc(bufSize);
+
+    // The offset is the cookie of the last entry we returned, so nothing
+    // about the listing has to be remembered between calls. The cursor
+    // from opendir only saves looking the cookie up again.
+    Directory::ReadDirCursor *cursor = fi ? (Directory::ReadDirCursor *) (uintptr_t) fi->fh : nullptr;
+
+    char *buf = (char *) malloc(size);
     if (buf == NULL) {
         fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    // We'll assume that off is 0 when we start. This means that
-    // childIterator hasn't been newed up yet.
-    size_t bytesAdded = 0;
-    size_t entriesAdded = 0;
-    
-    while (entriesAdded < FuseRamFs::kReadDirEntriesPerResponse &&
-           ctx->it != ctx->children.end()) {
-        fuse_ino_t child_ino = ctx->it->second;
-        Inode *childInode = GetInode(child_ino);
-        if (childInode == nullptr || childInode->HasNoLinks()) {
-            ++(ctx->it);
-            continue;
-        }
-
-        childInode->GetAttr(&stbuf);
-        stbuf.st_ino = ctx->it->second;
-        
-        // TODO: We don't look at sticky bits, etc. Revisit this in the future.
-//        Inode &childInode = Inodes[stbuf.st_ino];
-//        Directory *childDir = dynamic_cast<Directory *>(&childInode);
-//        if (childDir == NULL) {
-//            // This must be a file.
-//            stbuf.st_mode
-//        }
-        
-        size_t oldSize = bytesAdded;
-        bytesAdded += fuse_add_direntry(req,
-                                        buf + bytesAdded,
-                                        bufSize - bytesAdded,
-                                        ctx->it->first.c_str(),
-                                        &stbuf,
-                                        ctx->cookie);
-        if (bytesAdded > bufSize) {
-            // Oops. There wasn't enough space for that last item. Back up and exit.
-            --(ctx->it);
-            bytesAdded = oldSize;
-            break;
-        } else {
-            ++(ctx->it);
-            ++entriesAdded;
-        }
-    }
+    size_t bytesAdded = dir->ReadDirBuf(req, buf, size, off, cursor, plus);
 
     fuse_reply_buf(req, buf, bytesAdded);
     std::free(buf);
 }
 
+/**
+ Reads a directory.
+
+ @param req The FUSE request.
+ @param ino The directory inode.
+ @param size The maximum response size.
+ @param off The offset into the list of children.
+ @param fi The file info (information about an open file).
+ */
+void FuseRamFs::FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t off, struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, off, fi, false);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 0)
+/**
+ Reads a directory along with the attributes of every child, which saves
+ the kernel a lookup per entry.
+
+ @param req The FUSE request.
+ @param ino The directory inode.
+ @param size The maximum response size.
+ @param off The offset into the list of children.
+ @param fi The file info (information about an open file).
+ */
+void FuseRamFs::FuseReadDirPlus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t off, struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, off, fi, true);
+}
+#endif
+
 void FuseRamFs::FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     Inode *inode = GetInode(ino);
@@ -434,7 +516,7 @@ void FuseRamFs::FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
     }
 
     // You can't open a dir with 'open'. Check for this.
-    Directory *dir = dynamic_cast<Directory *>(inode);
+    Directory *dir = inode_cast<Directory>(inode);
     if (dir != NULL) {
         fuse_reply_err(req, EISDIR);
         return;
@@ -446,6 +528,12 @@ void FuseRamFs::FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
     
     // TODO: We seem to be able to delete a file and copy it back without a new inode being created. The only evidence is the open call. How do we handle this?
 
+    /* All writes come through the kernel, so its cached pages stay valid
+     * across opens. Anything else changing the data invalidates them. */
+    if (KeepCache) {
+        fi->keep_cache = 1;
+    }
+
     fuse_reply_open(req, fi);
 }
 
@@ -459,7 +547,7 @@ void FuseRamFs::FuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
     }
 
     // You can't release a dir with 'close'. Check for this.
-    Directory *dir = dynamic_cast<Directory *>(inode_p);
+    Directory *dir = inode_cast<Directory>(inode_p);
     if (dir != NULL) {
         fuse_reply_err(req, EISDIR);
         return;
@@ -469,16 +557,25 @@ void FuseRamFs::FuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
     //    else if ((fi->flags & 3) != O_RDONLY)
     //        fuse_reply_err(req, EACCES);
     
+    File *file = inode_cast<File>(inode_p);
+    if (file != nullptr) {
+        file->Flush();
+    }
     fuse_reply_err(req, 0);
 }
 
 void FuseRamFs::FuseFsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-    if (GetInode(ino) == nullptr) {
+    Inode *inode_p = GetInode(ino);
+    if (inode_p == nullptr) {
         fuse_reply_err(req, ENOENT);
         return;
     }
     
+    File *file = inode_cast<File>(inode_p);
+    if (file != nullptr) {
+        file->Flush();
+    }
     fuse_reply_err(req, 0);
 }
 
@@ -492,7 +589,7 @@ void FuseRamFs::FuseFsyncDir(fuse_req_t req, fuse_ino_t ino, int datasync, struc
     }
     
     // You can only sync a dir with 'fsyncdir'. Check for this.
-    Directory *dir_p = dynamic_cast<Directory *>(inode_p);
+    Directory *dir_p = inode_cast<Directory>(inode_p);
     if (dir_p == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -512,7 +609,7 @@ void FuseRamFs::FuseMknod(fuse_req_t req, fuse_ino_t parent, const char *name,
     }
 
     // You can only make something inside a directory
-    Directory *parentDir_p = dynamic_cast<Directory *>(parentInode);
+    Directory *parentDir_p = inode_cast<Directory>(parentInode);
     if (parentDir_p == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -525,7 +622,7 @@ void FuseRamFs::FuseMknod(fuse_req_t req, fuse_ino_t parent, const char *name,
     }
 
     /* Don't use an existing name */
-    if (parentDir_p->ChildInodeNumberWithName(string(name)) != INO_NOTFOUND) {
+    if (parentDir_p->ChildInodeNumberWithName(name) != INO_NOTFOUND) {
         fuse_reply_err(req, EEXIST);
         return;
     }
@@ -588,38 +685,60 @@ long FuseRamFs::do_create_node(Directory *parent, const char *name, mode_t mode,
         return -ENOSPC;
     }
 
-    if (GetFreeInodes() <= 0) {
+    if (!ReserveInode()) {
         delete new_node;
         return -ENOSPC;
     }
 
     /* Register the new inode into file system */
-    fuse_ino_t ino = RegisterInode(new_node, mode, links, ctx->gid, ctx->uid);
+    fuse_ino_t ino;
+    try {
+        ino = RegisterInode(new_node, mode, links, ctx->gid, ctx->uid);
+    } catch (std::bad_alloc &e) {
+        FuseRamFs::UpdateUsedInodes(-1);
+        delete new_node;
+        return -ENOSPC;
+    }
     int ret = 0;
 
     /* Special treatment for directories */
     if (S_ISDIR(mode)) {
         /* Initialize the new directory: Add '.' and '..' */
-        Directory *dir_p = dynamic_cast<Directory *>(new_node);
+        Directory *dir_p = inode_cast<Directory>(new_node);
         ret = dir_p->AddChild(string("."), ino);
         ret = dir_p->AddChild(string(".."), parent->GetIno());
     }
 
+    /* The new inode counts against the quotas its directory is under,
+     * with all the blocks it was made with */
+    Quota *quota = parent->GetQuota();
+    if (!Quota::Allows(quota, new_node->UsedBlocks(), 1)) {
+        FuseRamFs::UpdateUsedInodes(-1);
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) new_node->UsedBlocks());
+        InodeTable::Retire(ino);
+        return -EDQUOT;
+    }
+    new_node->JoinQuota(quota);
+
     // Insert the new entry into the directory.
-    ret = parent->AddChild(string(name), ino);
+    {
+        std::unique_lock<std::shared_mutex> lk(parent->DirLock());
+        ret = parent->_AddChild(string(name), ino);
+        /* Only add hard link to the parent dir if everything above
+         * succeeded, and under its lock, so that a drop of the parent
+         * doesn't leave it one */
+        if (ret == 0 && S_ISDIR(mode)) {
+            parent->AddHardLink();
+        }
+    }
     /* If the first AddChild failed with ENOSPC/ENOMEM, the second one
      * will certainly fail because the space is already run out */
     if (ret < 0) {
         FuseRamFs::UpdateUsedInodes(-1);
-        FuseRamFs::UpdateUsedBlocks(new_node->UsedBlocks());
-        delete new_node;
-        FuseRamFs::DeleteInode(ino);
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) new_node->UsedBlocks());
+        InodeTable::Retire(ino);
         return ret;
     }
-    /* Only add hard link to the parent dir if everything above succeeded */
-    if (S_ISDIR(mode)) {
-        parent->AddHardLink();
-    }
     return ino;
 }
 
@@ -633,7 +752,7 @@ void FuseRamFs::FuseMkdir(fuse_req_t req, fuse_ino_t parent, const char *name, m
     }
 
     // You can only make something inside a directory
-    Directory *parentDir_p = dynamic_cast<Directory *>(parentInode);
+    Directory *parentDir_p = inode_cast<Directory>(parentInode);
     if (parentDir_p == nullptr) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -675,7 +794,7 @@ void FuseRamFs::FuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 
     // You can only delete something inside a directory
-    Directory *parentDir_p = dynamic_cast<Directory *>(parentInode);
+    Directory *parentDir_p = inode_cast<Directory>(parentInode);
     if (parentDir_p == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -686,15 +805,21 @@ void FuseRamFs::FuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     //        fuse_reply_err(req, EACCES);
     
     // Return an error if the child doesn't exist.
-    fuse_ino_t ino = parentDir_p->ChildInodeNumberWithName(string(name));
+    fuse_ino_t ino;
+    {
+        /* Look up and remove the name in one go, so that a drop taking it
+         * meanwhile doesn't leave the link to be dropped twice */
+        std::unique_lock<std::shared_mutex> lk(parentDir_p->DirLock());
+        ino = parentDir_p->_ChildInodeNumberWithName(name);
+        if (ino != INO_NOTFOUND && parentDir_p->_RemoveChild(name) != 0) {
+            ino = INO_NOTFOUND;
+        }
+    }
     if (ino == INO_NOTFOUND) {
         fuse_reply_err(req, ENOENT);
         return;
     }
     
-    // Point the name to the deleted block
-    parentDir_p->RemoveChild(string(name));
-    
     Inode *inode_p = GetInode(ino);
     // TODO: Any way we can fail here? What if the inode doesn't exist? That probably indicates
     // a problem that happened earlier.
@@ -717,7 +842,7 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 
     // You can only delete something inside a directory
-    Directory *parentDir_p = dynamic_cast<Directory *>(parentInode);
+    Directory *parentDir_p = inode_cast<Directory>(parentInode);
     if (parentDir_p == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
@@ -728,7 +853,7 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
     //        fuse_reply_err(req, EACCES);
     
     // Return an error if the child doesn't exist.
-    fuse_ino_t ino = parentDir_p->ChildInodeNumberWithName(string(name));
+    fuse_ino_t ino = parentDir_p->ChildInodeNumberWithName(name);
     if (ino == INO_NOTFOUND) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -748,7 +873,7 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
         return;
     }
 
-    Directory *dir_p = dynamic_cast<Directory *>(inode_p);
+    Directory *dir_p = inode_cast<Directory>(inode_p);
     if (dir_p == NULL) {
         // Someone tried to rmdir on something that wasn't a directory.
         fuse_reply_err(req, ENOTDIR);
@@ -763,9 +888,19 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
         return;
     }
     
-    parentDir_p->RemoveChild(name);
-    // Update the number of hardlinks in the parent dir
-    parentDir_p->RemoveHardLink();
+    {
+        /* A drop may have removed the name, or the parent, since it was
+         * looked up, and then took the parent's link itself */
+        std::unique_lock<std::shared_mutex> lk(parentDir_p->DirLock());
+        if (parentDir_p->_ChildInodeNumberWithName(name) != ino ||
+            parentDir_p->_RemoveChild(name) != 0) {
+            lk.unlock();
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        // Update the number of hardlinks in the parent dir
+        parentDir_p->RemoveHardLink();
+    }
     
     // Remove the hard links to this dir so it can be cleaned up later
     // TODO: What if there's a real hardlink to this dir? Hardlinks to dirs allowed?
@@ -778,36 +913,324 @@ void FuseRamFs::FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
     fuse_reply_err(req, 0);
 }
 
-void FuseRamFs::FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+/**
+ Splits a path below the mount point into its names, for the control
+ socket's commands. Empty names and "." are skipped.
+
+ @param path The path.
+ @param names Where to put the names.
+ @return 0, -EINVAL if the path goes up with "..", or -ENOMEM.
+ */
+int FuseRamFs::SplitPath(const std::string &path, std::vector<std::string_view> &names)
 {
-    Inode *inode_p = GetInode(ino);
-    
-    if (inode_p == nullptr) {
-        return;
+    try {
+        std::string_view rest(path);
+        while (!rest.empty()) {
+            size_t slash = rest.find('/');
+            std::string_view name = rest.substr(0, slash);
+            rest = (slash == std::string_view::npos) ? std::string_view() : rest.substr(slash + 1);
+            if (name == "..") {
+                return -EINVAL;
+            }
+            if (!name.empty() && name != ".") {
+                names.push_back(name);
+            }
+        }
+    } catch (std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ Walks from the root down a list of names. The caller must hold a Guard
+ for as long as it uses what was found.
+
+ @param names The names, as from SplitPath().
+ @param parentDir Where to put the directory holding the last name, or
+   nullptr if there are no names.
+ @param ino Where to put the inode number the names lead to.
+ @return 0, -ENOENT or -ENOTDIR.
+ */
+int FuseRamFs::ResolvePath(const std::vector<std::string_view> &names, Directory **parentDir, fuse_ino_t *ino)
+{
+    *parentDir = nullptr;
+    *ino = FUSE_ROOT_ID;
+    for (auto name : names) {
+        Inode *inode_p = GetInode(*ino);
+        if (inode_p == nullptr || inode_p->HasNoLinks()) {
+            return -ENOENT;
+        }
+        *parentDir = inode_cast<Directory>(inode_p);
+        if (*parentDir == nullptr) {
+            return -ENOTDIR;
+        }
+        *ino = (*parentDir)->ChildInodeNumberWithName(name);
+        if (*ino == INO_NOTFOUND) {
+            return -ENOENT;
+        }
     }
+    return 0;
+}
+
+/**
+ Removes a name and, if it is a directory, everything below it in one
+ go, instead of an unlink or rmdir per entry. For the control socket's
+ drop command. Inodes the kernel still knows of go once it forgets them,
+ as after rmdir; the others go right away.
 
-    inode_p->Forget(req, nlookup);
+ @param path The path of the name below the mount point.
+ @return The number of names removed, or a negative errno.
+ */
+ssize_t FuseRamFs::DropTree(const std::string &path)
+{
+    std::vector<std::string_view> names;
+    std::vector<fuse_ino_t> dirs, children;
+    int ret = SplitPath(path, names);
+    if (ret < 0) {
+        return ret;
+    }
+    try {
+        dirs.reserve(64);
+    } catch (std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+    /* The root itself stays */
+    if (names.empty()) {
+        return -EINVAL;
+    }
 
-    if (inode_p->Forgotten())
+    size_t removed = 0, inodes = 0, blocks = 0;
+    fuse_ino_t parent = FUSE_ROOT_ID;
     {
-        if (inode_p->HasNoLinks())
-        {
-            // Let's just delete this inode and free memory.
-            size_t blocks_freed = inode_p->UsedBlocks();
-            delete inode_p;
-            /* Atomically erase the record in inodes table and
-             * push this ino to the DeletedInodes list */
-            DeleteInode(ino);
-            FuseRamFs::UpdateUsedInodes(-1);
-            FuseRamFs::UpdateUsedBlocks(-blocks_freed);
+        InodeTable::Guard guard;
+        Directory *parentDir;
+        fuse_ino_t ino;
+        ret = ResolvePath(names, &parentDir, &ino);
+        if (ret < 0) {
+            return ret;
+        }
+        parent = parentDir->GetIno();
+        Inode *inode_p = GetInode(ino);
+        if (inode_p == nullptr) {
+            return -ENOENT;
         }
-        else
+        bool isDir = inode_cast<Directory>(inode_p) != nullptr;
         {
-            // TODO: Verify that this only happens on unmount. It's OK on unmount but bad elsewhere.
+            /* A rename may have put another inode under the name since
+             * it was looked up */
+            std::unique_lock<std::shared_mutex> lk(parentDir->DirLock());
+            if (parentDir->_ChildInodeNumberWithName(names.back()) != ino ||
+                parentDir->_RemoveChild(names.back()) != 0) {
+                return -ENOENT;
+            }
+            if (isDir) {
+                parentDir->RemoveHardLink();
+            }
+        }
+        removed = 1;
+        /* A directory keeps its links, and so stays in the table, until
+         * the names below it are gone */
+        if (isDir) {
+            dirs.push_back(ino);
+        } else {
+            inode_p->RemoveHardLink();
+            if (do_forget(ino, 0, &blocks)) {
+                ++inodes;
+            }
         }
     }
-    
-    // Note that there's no reply here. That was done in the steps above this check.
+    InvalidateEntry(parent, string(names.back()));
+
+    ssize_t err = 0;
+    while (!dirs.empty()) {
+        /* A guard per directory, so that the reaper keeps up */
+        InodeTable::Guard guard;
+        fuse_ino_t ino = dirs.back();
+        dirs.pop_back();
+        Directory *dir_p = inode_cast<Directory>(GetInode(ino));
+        if (dir_p == nullptr) {
+            continue;
+        }
+        children.clear();
+        if (dir_p->RemoveAllChildren(children) != 0) {
+            err = -ENOMEM;
+        }
+        removed += children.size();
+        for (fuse_ino_t child : children) {
+            Inode *inode_p = GetInode(child);
+            if (inode_p == nullptr) {
+                continue;
+            }
+            if (inode_cast<Directory>(inode_p) != nullptr) {
+                try {
+                    dirs.push_back(child);
+                } catch (std::bad_alloc &e) {
+                    /* Whatever is below it stays until unmount */
+                    err = -ENOMEM;
+                }
+                continue;
+            }
+            inode_p->RemoveHardLink();
+            if (do_forget(child, 0, &blocks)) {
+                ++inodes;
+            }
+        }
+        if (do_forget(ino, 0, &blocks)) {
+            ++inodes;
+        }
+    }
+
+    FuseRamFs::UpdateUsedInodes(-(ssize_t) inodes);
+    FuseRamFs::UpdateUsedBlocks(-(ssize_t) blocks);
+    return err < 0 ? err : (ssize_t) removed;
+}
+
+/**
+ Puts a directory under a quota, or changes the limits of its quota. For
+ the control socket's quota command.
+
+ @param path The path of the directory below the mount point.
+ @param bytes The most bytes of st_blocks the tree may take, or 0.
+ @param inodes The most inodes the tree may have, or 0.
+ @return 0 or a negative errno.
+ */
+int FuseRamFs::SetQuota(const std::string &path, uint64_t bytes, uint64_t inodes)
+{
+    std::vector<std::string_view> names;
+    int ret = SplitPath(path, names);
+    if (ret < 0) {
+        return ret;
+    }
+    InodeTable::Guard guard;
+    Directory *parentDir;
+    fuse_ino_t ino;
+    ret = ResolvePath(names, &parentDir, &ino);
+    if (ret < 0) {
+        return ret;
+    }
+    Inode *inode_p = GetInode(ino);
+    if (inode_p == nullptr || inode_p->HasNoLinks()) {
+        return -ENOENT;
+    }
+    Directory *dir = inode_cast<Directory>(inode_p);
+    if (dir == nullptr) {
+        return -ENOTDIR;
+    }
+    std::string where;
+    try {
+        for (auto name : names) {
+            where += '/';
+            where += name;
+        }
+        if (where.empty()) {
+            where = "/";
+        }
+    } catch (std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+    return dir->SetQuota(where, get_nblocks(bytes, Inode::BufBlockSize), inodes);
+}
+
+/**
+ Tells the usage and limits of the quota a directory is the root of.
+
+ @param path The path of the directory below the mount point.
+ @param out Where to put the line describing the quota.
+ @return 0, -ENOENT if there is no such directory or it has no quota, or
+   another negative errno.
+ */
+int FuseRamFs::DescribeQuota(const std::string &path, std::string &out)
+{
+    std::vector<std::string_view> names;
+    int ret = SplitPath(path, names);
+    if (ret < 0) {
+        return ret;
+    }
+    InodeTable::Guard guard;
+    Directory *parentDir;
+    fuse_ino_t ino;
+    ret = ResolvePath(names, &parentDir, &ino);
+    if (ret < 0) {
+        return ret;
+    }
+    Inode *inode_p = GetInode(ino);
+    if (inode_p == nullptr || inode_p->HasNoLinks()) {
+        return -ENOENT;
+    }
+    Quota *quota = inode_p->GetQuota();
+    if (quota == nullptr || quota->Root() != ino) {
+        return -ENOENT;
+    }
+    try {
+        out = quota->Describe();
+    } catch (std::bad_alloc &e) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ Drops references the kernel held to an inode, and removes the inode once
+ the kernel holds none and no name refers to it any more.
+
+ @param ino The inode.
+ @param nlookup The number of references to drop.
+ @param[in,out] blocks Grows by the blocks the inode used if it was removed.
+ @return true if the inode was removed.
+ */
+bool FuseRamFs::do_forget(fuse_ino_t ino, uint64_t nlookup, size_t *blocks)
+{
+    Inode *inode_p = GetInode(ino);
+    /* A lookup which found the inode before its last name went may take a
+     * reference even now; then it is left for that one's forget */
+    if (inode_p == nullptr || !inode_p->Forget(nlookup) || !inode_p->HasNoLinks() ||
+        !inode_p->MarkRetired()) {
+        return false;
+    }
+    size_t used = inode_p->UsedBlocks();
+    inode_p->LeaveQuota();
+    /* Erase the record in the inode table. The reaper deletes the inode
+     * once no other request can still be using it. */
+    if (!InodeTable::Retire(ino)) {
+        return false;
+    }
+    *blocks += used;
+    return true;
+}
+
+void FuseRamFs::FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    size_t blocks = 0;
+    if (do_forget(ino, nlookup, &blocks)) {
+        FuseRamFs::UpdateUsedInodes(-1);
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) blocks);
+    }
+    fuse_reply_none(req);
+}
+
+/**
+ Drops references to many inodes at once, as the kernel does when it
+ shrinks its caches. The space of every removed inode is given back in
+ one go.
+
+ @param req The FUSE request.
+ @param count The number of inodes.
+ @param forgets The inodes and how many references to drop from each.
+ */
+void FuseRamFs::FuseForgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    size_t inodes = 0, blocks = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (do_forget(forgets[i].ino, forgets[i].nlookup, &blocks)) {
+            ++inodes;
+        }
+    }
+    if (inodes > 0) {
+        FuseRamFs::UpdateUsedInodes(-(ssize_t) inodes);
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) blocks);
+    }
+    fuse_reply_none(req);
 }
 
 void FuseRamFs::FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
@@ -828,10 +1251,39 @@ void FuseRamFs::FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_
     inode_p->WriteAndReply(req, buf, size, off);
 }
 
+/**
+ Writes data handed over as a buffer vector. When FUSE splices the request
+ from the kernel the data is still in a pipe and is copied only once, into
+ the file's pages. FUSE calls this instead of FuseWrite() whenever it is
+ registered.
+
+ @param req The FUSE request.
+ @param ino The inode to write to.
+ @param bufv The buffers holding the data.
+ @param off The offset to write at.
+ @param fi The file info for the open file.
+ */
+void FuseRamFs::FuseWriteBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+    Inode *inode_p = GetInode(ino);
+    if (inode_p == nullptr || inode_p->HasNoLinks()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // TODO: Handle info in fi.
+
+    inode_p->WriteBufAndReply(req, bufv, off);
+}
+
 void FuseRamFs::FuseFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     // TODO: Handle info in fi.
     
+    /* The kernel has sent the writes it cached for this file by now */
+    File *file = inode_cast<File>(GetInode(ino));
+    if (file != nullptr) {
+        file->Flush();
+    }
     fuse_reply_err(req, 0);
 }
 
@@ -850,6 +1302,58 @@ void FuseRamFs::FuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 }
 
 
+/**
+ Locks directories exclusively in inode number order, so that operations
+ locking several directories can't deadlock.
+
+ @param dirs The directories. Null entries and duplicates are skipped.
+ @return The locks.
+ */
+std::vector<std::unique_lock<std::shared_mutex>> FuseRamFs::LockDirectories(std::vector<Directory *> dirs)
+{
+    dirs.erase(std::remove(dirs.begin(), dirs.end(), nullptr), dirs.end());
+    std::sort(dirs.begin(), dirs.end(), [](Directory *a, Directory *b) {
+        return a->GetIno() < b->GetIno();
+    });
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    locks.reserve(dirs.size());
+    for (Directory *dir : dirs) {
+        locks.emplace_back(dir->DirLock(), std::defer_lock);
+        Metrics::Acquire(locks.back(), Metrics::DirectoryLock);
+    }
+    return locks;
+}
+
+/**
+ Tells whether a directory is an ancestor of another one, or the same
+ one. The caller must hold renameMutex, so that no directory changes its
+ parent meanwhile, and no directory lock.
+
+ @param ancestor The possible ancestor.
+ @param ino The directory to start from.
+ @return true if ancestor is on the path from ino up to the root.
+ */
+bool FuseRamFs::IsAncestor(fuse_ino_t ancestor, fuse_ino_t ino)
+{
+    for (;;) {
+        if (ino == ancestor) {
+            return true;
+        }
+        Directory *dir = inode_cast<Directory>(GetInode(ino));
+        if (dir == nullptr) {
+            return false;
+        }
+        fuse_ino_t parent = dir->ChildInodeNumberWithName("..");
+        /* The root is its own parent */
+        if (parent == ino || parent == INO_NOTFOUND) {
+            return false;
+        }
+        ino = parent;
+    }
+}
+
 void FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
 {
     // Make sure the parents still exists.
@@ -868,53 +1372,90 @@ void FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name,
     }
 
     // You can only rename something inside a directory
-    Directory *parentDir = dynamic_cast<Directory *>(parentInode);
+    Directory *parentDir = inode_cast<Directory>(parentInode);
     if (parentDir == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
     }
 
-    Directory *newParentDir = dynamic_cast<Directory *>(newParentInode);
+    Directory *newParentDir = inode_cast<Directory>(newParentInode);
     if (newParentDir == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
     }
 
-    std::unique_lock<std::mutex> G(FuseRamFs::renameMutex, std::defer_lock);
-    std::unique_lock<std::shared_mutex> L1(parentDir->DirLock(), std::defer_lock);
-    std::unique_lock<std::shared_mutex> L2(newParentDir->DirLock(), std::defer_lock);
-    
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        strcmp(newname, ".") == 0 || strcmp(newname, "..") == 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
     // TODO: Handle permissions on dirs. You can't just rename anything you please!:
     //    else if ((fi->flags & 3) != O_RDONLY)
     //        fuse_reply_err(req, EACCES);
-    
-    // Return an error if the source doesn't exist.
-    fuse_ino_t srcIno = parentDir->ChildInodeNumberWithName(string(name));
-    Inode *srcInode = GetInode(srcIno);
-    if (srcInode == nullptr || srcInode->HasNoLinks()) {
+
+    /* Only moving a directory to another parent can create a loop, so only
+     * that takes the global lock, which keeps every directory's parent
+     * fixed while we check the move. Every rename then locks the
+     * directories it touches in inode order. The names are looked up
+     * before locking to find those directories, and looked up again once
+     * they are locked in case they changed meanwhile. */
+    std::unique_lock<std::mutex> G(FuseRamFs::renameMutex, std::defer_lock);
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    fuse_ino_t srcIno, existingIno;
+    Inode *srcInode, *existingInode;
+    Directory *srcDir, *existingDir;
+    for (;;) {
+        // Return an error if the source doesn't exist.
+        srcIno = parentDir->ChildInodeNumberWithName(name);
+        srcInode = GetInode(srcIno);
+        if (srcInode == nullptr || srcInode->HasNoLinks()) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        srcDir = inode_cast<Directory>(srcInode);
+
+        if (srcDir != nullptr && parent != newparent) {
+            if (!G.owns_lock()) {
+                Metrics::Acquire(G, Metrics::RenameLock);
+                continue;
+            }
+            /* A directory can't be moved into itself or its subdirectories */
+            if (IsAncestor(srcIno, newparent)) {
+                fuse_reply_err(req, EINVAL);
+                return;
+            }
+        }
+
+        existingIno = newParentDir->ChildInodeNumberWithName(newname);
+        existingInode = GetInode(existingIno);
+        existingDir = inode_cast<Directory>(existingInode);
+
+        locks = LockDirectories({parentDir, newParentDir, srcDir, existingDir});
+        if (parentDir->_ChildInodeNumberWithName(name) == srcIno &&
+            newParentDir->_ChildInodeNumberWithName(newname) == existingIno) {
+            break;
+        }
+        locks.clear();
+    }
+
+    /* A drop may have emptied and unlinked either directory meanwhile */
+    if (parentDir->HasNoLinks() || newParentDir->HasNoLinks()) {
         fuse_reply_err(req, ENOENT);
         return;
     }
- 
-    /* Lock directories */
-    if (S_ISDIR(srcInode->GetMode())) {
-        if (parent == newparent) {
-            std::lock(G, L1);
-        } else {
-            std::lock(G, L1, L2);
-        }
-    } else {
-        if (parent == newparent) {
-            L1.lock();
-        } else {
-            std::lock(L1, L2);
-        }
+
+    /* Both names refer to the same inode: nothing to do */
+    if (srcIno == existingIno) {
+        fuse_reply_err(req, 0);
+        return;
     }
 
-    // Look for an existing child with the same name in the new parent
-    // directory
-    fuse_ino_t existingIno = newParentDir->_ChildInodeNumberWithName(string(newname));
-    Inode *existingInode = GetInode(existingIno);
+    /* Charges never move from one quota to another; mv copies instead */
+    if (parentDir->GetQuota() != newParentDir->GetQuota()) {
+        fuse_reply_err(req, EXDEV);
+        return;
+    }
 
     /* If the newname (or destination) already exists, rename() should replace
      * the destination with the source.
@@ -930,11 +1471,11 @@ void FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name,
         }
         /* If dest is a non-empty directory, return ENOTEMPTY */
         if (S_ISDIR(existingInode->GetMode())) {
-            Directory *existingDir = dynamic_cast<Directory *>(existingInode);
+            Directory *existingDir = inode_cast<Directory>(existingInode);
             /* If the mode indicates a directory but it's not,
                something bad might have happened */
             assert(existingDir);
-            if (!existingDir->IsEmpty()) {
+            if (!existingDir->_IsEmpty()) {
                 fuse_reply_err(req, ENOTEMPTY);
                 return;
             }
@@ -946,8 +1487,11 @@ void FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name,
         }
 
         /* Otherwise, let's replace the existing dest */
-        newParentDir->_UpdateChild(string(newname), srcIno);
-        parentDir->_RemoveChild(string(name));
+        newParentDir->_UpdateChild(newname, srcIno);
+        parentDir->_RemoveChild(name);
+        if (srcDir != nullptr && parent != newparent) {
+            srcDir->_UpdateChild("..", newparent);
+        }
         existingInode->RemoveHardLink();
         if (S_ISDIR(existingInode->GetMode())) {
             /* An empty dir has two hard links
@@ -960,8 +1504,15 @@ void FuseRamFs::FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name,
         fuse_reply_err(req, 0);
     } else {
         /* If the destination does not exist */
-        newParentDir->_AddChild(string(newname), srcIno);
-        parentDir->_RemoveChild(string(name));
+        int ret = newParentDir->_AddChild(string(newname), srcIno);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+        parentDir->_RemoveChild(name);
+        if (srcDir != nullptr && parent != newparent) {
+            srcDir->_UpdateChild("..", newparent);
+        }
         if (S_ISDIR(srcInode->GetMode())) {
             /* Decrement one link for the old parent because the source
              * dir has been moved out */
@@ -991,14 +1542,20 @@ void FuseRamFs::FuseLink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, c
 
     // The new parent must be a directory. TODO: Do we need this check? Will FUSE
     // ever give us a parent that isn't a dir? Test this.
-    Directory *parentDir = dynamic_cast<Directory *>(parent);
+    Directory *parentDir = inode_cast<Directory>(parent);
     if (parentDir == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
     }
 
+    /* An inode counts against one quota, whichever name it is under */
+    if (src->MemberQuota() != parentDir->GetQuota()) {
+        fuse_reply_err(req, EXDEV);
+        return;
+    }
+
     /* If newname exists, we do NOT overwrite it */
-    fuse_ino_t existingIno = parentDir->ChildInodeNumberWithName(string(newname));
+    fuse_ino_t existingIno = parentDir->ChildInodeNumberWithName(newname);
     // Type is unsigned so we have to explicitly check for largest value. TODO: Refactor please.
     if (existingIno != INO_NOTFOUND) {
         // There's already a child with that name. Return an error.
@@ -1016,7 +1573,8 @@ void FuseRamFs::FuseLink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, c
     // Update the number of hardlinks in the target
     src->AddHardLink();
     
-    parent->ReplyEntry(req);
+    // The new name refers to the source inode, not to the directory.
+    src->ReplyEntry(req);
 }
 
 void FuseRamFs::FuseSymlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
@@ -1029,22 +1587,21 @@ void FuseRamFs::FuseSymlink(fuse_req_t req, const char *link, fuse_ino_t parent,
     }
 
     // You can only make something inside a directory
-    Directory *dir = dynamic_cast<Directory *>(parent_p);
+    Directory *dir = inode_cast<Directory>(parent_p);
     if (dir == NULL) {
         fuse_reply_err(req, ENOTDIR);
         return;
     }
 
     /* Check free space and free inodes */
-    if (FuseRamFs::CheckHasSpaceFor(nullptr, strnlen(name, PATH_MAX))) {
-        fuse_reply_err(req, ENOSPC);
-    }
-    if (FuseRamFs::GetFreeInodes() <= 0) {
+    if (FuseRamFs::CheckHasSpaceFor(nullptr, strnlen(link, PATH_MAX)) < 0 ||
+        FuseRamFs::GetFreeInodes() <= 0) {
         fuse_reply_err(req, ENOSPC);
+        return;
     }
 
     /* We don't overwrite if name exists in parent directory */
-    if (dir->ChildInodeNumberWithName(string(name)) != INO_NOTFOUND) {
+    if (dir->ChildInodeNumberWithName(name) != INO_NOTFOUND) {
         fuse_reply_err(req, EEXIST);
         return;
     }
@@ -1075,7 +1632,7 @@ void FuseRamFs::FuseReadLink(fuse_req_t req, fuse_ino_t ino)
     }
 
     // You can only readlink on a symlink
-    SymLink *link_p = dynamic_cast<SymLink *>(inode_p);
+    SymLink *link_p = inode_cast<SymLink>(inode_p);
     if (link_p == NULL) {
         fuse_reply_err(req, EINVAL);
         return;
@@ -1094,6 +1651,10 @@ void FuseRamFs::FuseStatfs(fuse_req_t req, fuse_ino_t ino)
 {
     struct statvfs info;
     FuseRamFs::FsStat(&info);
+    Inode *inode_p = GetInode(ino);
+    if (inode_p != nullptr) {
+        Quota::Limit(inode_p->GetQuota(), &info);
+    }
     fuse_reply_statfs(req, &info);
 }
 
@@ -1114,7 +1675,7 @@ void FuseRamFs::FuseSetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, c
     uint32_t position = 0;
 #endif
 
-    inode_p->SetXAttrAndReply(req, string(name), value, size, flags, position);
+    inode_p->SetXAttrAndReply(req, name, value, size, flags, position);
 }
 
 #ifdef __APPLE__
@@ -1134,7 +1695,7 @@ void FuseRamFs::FuseGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, s
     uint32_t position = 0;
 #endif
     
-    inode_p->GetXAttrAndReply(req, string(name), size, position);
+    inode_p->GetXAttrAndReply(req, name, size, position);
 }
 
 void FuseRamFs::FuseListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size)
@@ -1157,7 +1718,7 @@ void FuseRamFs::FuseRemoveXAttr(fuse_req_t req, fuse_ino_t ino, const char *name
         fuse_reply_err(req, ENOENT);
         return;
     }
-    inode_p->RemoveXAttrAndReply(req, string(name));
+    inode_p->RemoveXAttrAndReply(req, name);
 }
 
 void FuseRamFs::FuseAccess(fuse_req_t req, fuse_ino_t ino, int mask)
@@ -1180,7 +1741,7 @@ void FuseRamFs::FuseCreate(fuse_req_t req, fuse_ino_t parent, const char *name,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    Directory *parentDir_p = dynamic_cast<Directory *>(parent_p);
+    Directory *parentDir_p = inode_cast<Directory>(parent_p);
     if (parentDir_p == NULL) {
         // The parent wasn't a directory. It can't have any children.
         fuse_reply_err(req, ENOTDIR);
@@ -1203,18 +1764,134 @@ void FuseRamFs::FuseGetLock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
     //inode_p->ReplyGetLock(req, lock);
 }
 
-fuse_ino_t FuseRamFs::RegisterInode(Inode *inode_p, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid)
+/**
+ Looks up the two files of a copy between files.
+
+ @param srcIno The file to copy from.
+ @param dstIno The file to copy to.
+ @param[out] src The file to copy from.
+ @param[out] dst The file to copy to.
+ @return 0, or the errno to reply with.
+ */
+int FuseRamFs::GetCopyFiles(fuse_ino_t srcIno, fuse_ino_t dstIno, File **src, File **dst)
 {
-    // Either re-use a deleted inode or push one back depending on whether we're reclaiming inodes now or
-    // not.
-    fuse_ino_t ino;
-    if (DeletedInodes.empty()) {
-        ino = FuseRamFs::AddInode(inode_p);
+    Inode *src_p = GetInode(srcIno);
+    Inode *dst_p = GetInode(dstIno);
+    if (src_p == nullptr || src_p->HasNoLinks() || dst_p == nullptr || dst_p->HasNoLinks()) {
+        return ENOENT;
+    }
+    *src = inode_cast<File>(src_p);
+    *dst = inode_cast<File>(dst_p);
+    if (*src == nullptr || *dst == nullptr) {
+        return (S_ISDIR(src_p->GetMode()) || S_ISDIR(dst_p->GetMode())) ? EISDIR : EINVAL;
+    }
+    return 0;
+}
+
+void FuseRamFs::FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+                          unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    if ((unsigned int) cmd != RAMFS_IOC_CLONE_RANGE) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    if (in_bufsz < sizeof(struct ramfs_clone_range)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    struct ramfs_clone_range range;
+    memcpy(&range, in_buf, sizeof(range));
+
+    File *src, *dst;
+    int err = GetCopyFiles(range.src_ino, ino, &src, &dst);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    /* The source is named by number rather than by a descriptor the caller
+     * opened, so check that the caller could have opened it for reading,
+     * and the destination for writing */
+    const struct fuse_ctx *ctx_p = fuse_req_ctx(req);
+    if (ctx_p->uid != 0 &&
+        (!src->HasAccess(R_OK, ctx_p->gid, ctx_p->uid) || !dst->HasAccess(W_OK, ctx_p->gid, ctx_p->uid))) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if (range.src_offset > (uint64_t) LLONG_MAX || range.dest_offset > (uint64_t) LLONG_MAX) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    size_t len = range.src_length == 0 ? SIZE_MAX : range.src_length;
+
+    ssize_t res = dst->CopyFrom(src, range.src_offset, range.dest_offset, len);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_ioctl(req, 0, NULL, 0);
+    /* The kernel may have cached the old content */
+    InvalidateInode(ino);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+void FuseRamFs::FuseCopyFileRange(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+                                  fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out,
+                                  size_t len, int flags)
+{
+    if (flags != 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    File *src, *dst;
+    int err = GetCopyFiles(ino_in, ino_out, &src, &dst);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    ssize_t res = dst->CopyFrom(src, off_in, off_out, len);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
     } else {
-        ino = PopOneDeletedInode();
-        FuseRamFs::UpdateInode(ino, inode_p);
+        fuse_reply_write(req, res);
+    }
+}
+#endif
+
+/**
+ Drops the kernel's cached attributes and data of an inode. Needed when the
+ inode changes other than through a request from the kernel.
+
+ @param ino The inode.
+ */
+void FuseRamFs::InvalidateInode(fuse_ino_t ino)
+{
+    if (m_chan == nullptr) {
+        return;
     }
-    FuseRamFs::UpdateUsedInodes(1);
+    /* -ENOENT just means the kernel doesn't know the inode */
+    fuse_lowlevel_notify_inval_inode(m_chan, ino, 0, 0);
+}
+
+/**
+ Drops the kernel's cached lookup of a name, negative or not.
+
+ @param parent The directory holding the name.
+ @param name The name.
+ */
+void FuseRamFs::InvalidateEntry(fuse_ino_t parent, const std::string &name)
+{
+    if (m_chan == nullptr) {
+        return;
+    }
+    fuse_lowlevel_notify_inval_entry(m_chan, parent, name.c_str(), name.size());
+}
+
+fuse_ino_t FuseRamFs::RegisterInode(Inode *inode_p, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid)
+{
+    // The table re-uses the number of a reclaimed inode if there is one.
+    // The caller has already accounted for the inode itself.
+    fuse_ino_t ino = InodeTable::Add(inode_p);
 
     inode_p->Initialize(ino, mode, nlink, gid, uid);
     FuseRamFs::UpdateUsedBlocks(inode_p->UsedBlocks());
@@ -7,62 +7,60 @@
 
 #include "common.h"
 #include "inode.hpp"
+#include "inode_table.hpp"
+#include "space_counter.hpp"
+#include "spill.hpp"
+#include "quota.hpp"
 
 class Directory;
+class File;
 
 class FuseRamFs {
 private:
-    static const size_t kReadDirEntriesPerResponse = 255;
-    static const size_t kReadDirBufSize = 384;
-    static const size_t kInodeReclamationThreshold = 256;
     static const fsblkcnt_t kTotalBlocks = 8388608;
     static const fsfilcnt_t kTotalInodes = 1048576;
     static const unsigned long kFilesystemId = 0xc13f944870434d8f;
     static const size_t kMaxFilenameLength = 1024;
     
-    static std::vector<Inode *> Inodes;
-    static std::shared_mutex inodesRwSem;
-    static std::queue<fuse_ino_t> DeletedInodes;
-    static std::mutex deletedInodesMutex;
+    /* The fixed parts of statfs replies; the free counts come from the
+     * counters below */
     static struct statvfs m_stbuf;
-    static std::shared_mutex stbufMutex;
+    static SpaceCounter m_freeBlocks;
+    static SpaceCounter m_freeInodes;
 
+    /* Held while a directory moves to another parent */
     static std::mutex renameMutex;
+
+    /* Whether the kernel accepts spliced read replies */
+    static bool m_spliceReads;
+
+    /* Where cache invalidations are sent; null until mounted */
+    static struct fuse_chan *m_chan;
     
 public:
     static struct fuse_lowlevel_ops FuseOps;
+
+    /* How long the kernel may remember that a name doesn't exist */
+    static double NegativeTimeout;
+    /* Whether open files keep the kernel's page cache of their data */
+    static bool KeepCache;
+    /* Whether to ask the kernel to cache writes, where it can */
+    static bool WritebackCache;
+    /* Largest write and readahead to offer the kernel; 0 for its default */
+    static size_t MaxWrite;
+    static size_t MaxReadahead;
     
 private:
     static long do_create_node(Directory *parent, const char *name, mode_t mode, dev_t dev, const struct fuse_ctx *ctx, const char *symlink = nullptr);
+    static std::vector<std::unique_lock<std::shared_mutex>> LockDirectories(std::vector<Directory *> dirs);
+    static bool IsAncestor(fuse_ino_t ancestor, fuse_ino_t ino);
+    static bool do_forget(fuse_ino_t ino, uint64_t nlookup, size_t *blocks);
+    static int SplitPath(const std::string &path, std::vector<std::string_view> &names);
+    static int ResolvePath(const std::vector<std::string_view> &names, Directory **parentDir, fuse_ino_t *ino);
+    static int GetCopyFiles(fuse_ino_t srcIno, fuse_ino_t dstIno, File **src, File **dst);
+    static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi, bool plus);
     static fuse_ino_t RegisterInode(Inode *inode_p, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
     static fuse_ino_t NextInode();
-
-    /* Atomic inode table operations */
-    static void DeleteInode(fuse_ino_t ino) {
-        std::unique_lock<std::shared_mutex> L1(inodesRwSem, std::defer_lock);
-        std::unique_lock<std::mutex> L2(deletedInodesMutex, std::defer_lock);
-        std::lock(L1, L2);
-        Inodes[ino] = nullptr;
-        DeletedInodes.push(ino);
-    }
-
-    static fuse_ino_t AddInode(Inode *inode) {
-        std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
-        Inodes.push_back(inode);
-        return Inodes.size() - 1;
-    }
-
-    static void UpdateInode(fuse_ino_t ino, Inode *newInode) {
-        std::unique_lock<std::shared_mutex> writelk(inodesRwSem);
-        Inodes[ino] = newInode;
-    }
-
-    static fuse_ino_t PopOneDeletedInode() {
-        std::lock_guard<std::mutex> lk(deletedInodesMutex);
-        fuse_ino_t ino = DeletedInodes.front();
-        DeletedInodes.pop();
-        return ino;
-    }
     
 public:
     FuseRamFs(fsblkcnt_t blocks = 0, fsfilcnt_t inodes = 0);
@@ -78,6 +76,10 @@ public:
     static void FuseFsyncDir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
     static void FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size,
                             off_t off, struct fuse_file_info *fi);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 0)
+    static void FuseReadDirPlus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t off, struct fuse_file_info *fi);
+#endif
     static void FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
     static void FuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
     static void FuseFsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
@@ -87,7 +89,9 @@ public:
     static void FuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name);
     static void FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
     static void FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+    static void FuseForgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
     static void FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+    static void FuseWriteBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
     static void FuseFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
     static void FuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
     static void FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
@@ -113,35 +117,51 @@ public:
     static void FuseAccess(fuse_req_t req, fuse_ino_t ino, int mask);
     static void FuseCreate(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
     static void FuseGetLock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct flock *lock);
+    static void FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+                          unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+    static void FuseCopyFileRange(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+                                  fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out,
+                                  size_t len, int flags);
+#endif
     
     static void UpdateUsedBlocks(ssize_t blocksAdded) {
-        std::unique_lock<std::shared_mutex> lk(stbufMutex);
-        m_stbuf.f_bfree -= blocksAdded;
-        m_stbuf.f_bavail -= blocksAdded;
+        if (blocksAdded > 0) {
+            m_freeBlocks.Charge(blocksAdded);
+        } else {
+            m_freeBlocks.Release(-blocksAdded);
+        }
     }
     static void UpdateUsedInodes(ssize_t inodesAdded) {
-        std::unique_lock<std::shared_mutex> lk(stbufMutex);
-        m_stbuf.f_ffree -= inodesAdded;
-        m_stbuf.f_favail -= inodesAdded;
+        if (inodesAdded > 0) {
+            m_freeInodes.Charge(inodesAdded);
+        } else {
+            m_freeInodes.Release(-inodesAdded);
+        }
+    }
+    /* Take blocks or inodes only if they are free; undo with UpdateUsed*().
+     * With a spill directory, a spill round may free the blocks first. */
+    static bool ReserveBlocks(size_t blocks) {
+        return m_freeBlocks.Reserve(blocks) || (Spill::MakeRoom() && m_freeBlocks.Reserve(blocks));
     }
+    /* Like ReserveBlocks(), but never waits for a spill round */
+    static bool ReserveFreeBlocks(size_t blocks) { return m_freeBlocks.Reserve(blocks); }
+    static bool ReserveInode() { return m_freeInodes.Reserve(1); }
     static void FsStat(struct statvfs *out) {
-        std::shared_lock<std::shared_mutex> lk(stbufMutex);
         *out = m_stbuf;
+        out->f_bfree = out->f_bavail = m_freeBlocks.Free();
+        out->f_ffree = out->f_favail = m_freeInodes.Free();
     }
 
     static Inode *GetInode(fuse_ino_t ino) {
-        std::shared_lock<std::shared_mutex> readlk(inodesRwSem);
-        try {
-            return Inodes.at(ino);
-        } catch (std::out_of_range e) {
-            return nullptr;
-        }
+        return InodeTable::Get(ino);
     }
 
-    /* Check if the file system can handle the increased size */
-    static bool CheckHasSpaceFor(Inode *inode, ssize_t incSize) {
+    /* Check if the file system, and the quotas the inode is under, can
+     * handle the increased size. Returns 0, -ENOSPC or -EDQUOT. */
+    static int CheckHasSpaceFor(Inode *inode, ssize_t incSize) {
         if (incSize <= 0) {
-            return true;
+            return 0;
         }
         size_t oldBlocks, newSize;
         if (inode) {
@@ -153,16 +173,31 @@ public:
         }
         size_t newBlocks = get_nblocks(newSize, Inode::BufBlockSize);
         if (newBlocks <= oldBlocks) {
-            return true;
-        } else {
-            std::shared_lock<std::shared_mutex> lk(stbufMutex);
-            return m_stbuf.f_bfree >= (newBlocks - oldBlocks);
+            return 0;
+        }
+        if (m_freeBlocks.Free() < (int64_t) (newBlocks - oldBlocks)) {
+            return -ENOSPC;
+        }
+        if (inode && !Quota::Allows(inode->GetQuota(), newBlocks - oldBlocks, 0)) {
+            return -EDQUOT;
         }
+        return 0;
     }
 
+    static bool SpliceReads() { return m_spliceReads; }
+
+    static void SetChannel(struct fuse_chan *ch) { m_chan = ch; }
+    static void InvalidateInode(fuse_ino_t ino);
+    static void InvalidateEntry(fuse_ino_t parent, const std::string &name);
+    static ssize_t DropTree(const std::string &path);
+    static int SetQuota(const std::string &path, uint64_t bytes, uint64_t inodes);
+    static int DescribeQuota(const std::string &path, std::string &out);
+
     static fsfilcnt_t GetFreeInodes() {
-        std::shared_lock<std::shared_mutex> lk(stbufMutex);
-        return m_stbuf.f_ffree;
+        return m_freeInodes.Free();
+    }
+    static int64_t GetFreeBlocks() {
+        return m_freeBlocks.Free();
     }
 };
 
@@ -4,238 +4,436 @@
 
 #include "common.h"
 
+#include <thread>
+
 #include "util.hpp"
 #include "inode.hpp"
+#include "snapshot.hpp"
+#include "quota.hpp"
 
 using namespace std;
 
-Inode::~Inode() {}
+double Inode::AttrTimeout = 1.0;
+double Inode::EntryTimeout = 1.0;
+
+Inode::~Inode() {
+    if (!m_quotaLeft) {
+        Quota::Charge(m_quota.load(), -(ssize_t) LoadField(m_attr.blocks), -1);
+    }
+    Quota::Release(m_quota.load());
+    delete m_cold.load();
+}
+
+/**
+ Puts a new inode under a quota, before it is published, and charges the
+ quota for it. The inode holds a reference to the quota until it is
+ deleted.
+
+ @param quota The quota of the directory the inode is made in, or nullptr.
+ */
+void Inode::JoinQuota(Quota *quota) {
+    Quota::Hold(quota);
+    m_quota.store(quota, std::memory_order_release);
+    Quota::Charge(quota, LoadField(m_attr.blocks), 1);
+}
+
+/* Gives back to its quota what the inode was charged, once it has no
+ * names or lookups left, rather than when the reaper gets to it */
+void Inode::LeaveQuota() {
+    /* Under the same lock as StoreAttr(), so that no change to the blocks
+     * is charged after this gave them back */
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    if (m_quotaLeft) {
+        return;
+    }
+    m_quotaLeft = true;
+    Quota::Charge(m_quota.load(std::memory_order_relaxed), -(ssize_t) m_attr.blocks, -1);
+}
+
+/* The quota a name of the inode counts against: that of its directory */
+Quota *Inode::MemberQuota() {
+    Quota *quota = GetQuota();
+    /* The root of a quota is itself under the one above */
+    if (quota != nullptr && quota->Root() == GetIno()) {
+        return quota->Parent();
+    }
+    return quota;
+}
+
+/**
+ Writes data which may still be sitting in the FUSE pipe. Inodes without
+ a page store of their own get the data gathered into a single buffer and
+ handed to WriteAndReply().
+
+ @param req The FUSE request.
+ @param bufv The buffers holding the data to write.
+ @param off The offset to write at.
+ */
+int Inode::WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off) {
+    size_t size = fuse_buf_size(bufv);
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return WriteAndReply(req, (const char *) bufv->buf[0].mem, size, off);
+    }
+
+    std::vector<char> data;
+    try {
+        data.resize(size);
+    } catch (std::bad_alloc &e) {
+        return fuse_reply_err(req, ENOMEM);
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = data.data();
+    ssize_t res = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+    if (res < 0) {
+        return fuse_reply_err(req, -res);
+    }
+    return WriteAndReply(req, data.data(), res, off);
+}
 
 /** Fix until FUSE 3 is available on all platforms. */
 #ifndef FUSE_SET_ATTR_CTIME
 #define FUSE_SET_ATTR_CTIME   (1 << 10)
 #endif
 
+/**
+ Copies the attributes without locking. A copy which raced with a writer
+ is thrown away and taken again.
+
+ @return The attributes.
+ */
+Inode::Attr Inode::LoadAttr() {
+    static_assert(sizeof(Attr) % sizeof(uint64_t) == 0 && alignof(Attr) >= alignof(uint64_t),
+                  "Attr is copied in 64-bit words");
+    Attr out;
+    uint64_t *dst = (uint64_t *) &out;
+    const uint64_t *src = (const uint64_t *) &m_attr;
+    uint32_t seq;
+    do {
+        while ((seq = m_attrSeq.load(std::memory_order_acquire)) & 1) {
+            std::this_thread::yield();
+        }
+        for (size_t i = 0; i < sizeof(Attr) / sizeof(uint64_t); ++i) {
+            dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while (m_attrSeq.load(std::memory_order_relaxed) != seq);
+    return out;
+}
+
+/**
+ Replaces the attributes. The caller must hold entryRwSem exclusively,
+ or be the only writer otherwise allowed to publish (see Attr).
+
+ @param attr The new attributes.
+ */
+void Inode::StoreAttr(const Attr &attr) {
+    /* Only one thread stores at a time, so m_attr is ours to read */
+    ssize_t grown = (ssize_t) attr.blocks - (ssize_t) m_attr.blocks;
+    uint64_t *dst = (uint64_t *) &m_attr;
+    const uint64_t *src = (const uint64_t *) &attr;
+    uint32_t seq = m_attrSeq.load(std::memory_order_relaxed);
+    m_attrSeq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < sizeof(Attr) / sizeof(uint64_t); ++i) {
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+    m_attrSeq.store(seq + 2, std::memory_order_release);
+    if (grown != 0 && !m_quotaLeft) {
+        Quota::Charge(m_quota.load(std::memory_order_relaxed), grown, 0);
+    }
+}
+
+/**
+ Fills in a struct stat, with the time of a lazily recorded read as the
+ atime.
+
+ @param attr The attributes to fill in from.
+ @param out Where to put them.
+ */
+void Inode::FillStat(const Attr &attr, struct stat *out) {
+    memset(out, 0, sizeof(*out));
+    out->st_ino = attr.ino;
+    out->st_mode = attr.mode;
+    out->st_nlink = attr.nlink;
+    out->st_uid = attr.uid;
+    out->st_gid = attr.gid;
+    out->st_rdev = attr.rdev;
+    out->st_size = attr.size;
+    out->st_blocks = attr.blocks;
+    out->st_blksize = Inode::BufBlockSize;
+#ifdef __APPLE__
+    out->st_atimespec = attr.atime;
+    out->st_mtimespec = attr.mtime;
+    out->st_ctimespec = attr.ctime;
+    out->st_birthtimespec = attr.birthtime;
+    out->st_flags = attr.flags;
+#else
+    out->st_atim = attr.atime;
+    out->st_mtim = attr.mtime;
+    out->st_ctim = attr.ctime;
+#endif
+    int64_t lazy = m_lazyAtime.load(std::memory_order_relaxed);
+    if (lazy != 0) {
+#ifdef __APPLE__
+        out->st_atimespec.tv_sec = lazy / 1000000000;
+        out->st_atimespec.tv_nsec = lazy % 1000000000;
+#else
+        out->st_atim.tv_sec = lazy / 1000000000;
+        out->st_atim.tv_nsec = lazy % 1000000000;
+#endif
+    }
+}
+
+void Inode::GetEntry(struct fuse_entry_param *out) {
+    Attr attr = LoadAttr();
+    memset(out, 0, sizeof(*out));
+    out->ino = attr.ino;
+    out->attr_timeout = AttrTimeout;
+    out->entry_timeout = EntryTimeout;
+    FillStat(attr, &out->attr);
+}
+
+/**
+ Finds the rarely used part of the inode.
+
+ @param create Whether to allocate it if it doesn't exist yet.
+ @return The cold part, or nullptr if there is none.
+ */
+Inode::Cold *Inode::GetCold(bool create) {
+    Cold *cold = m_cold.load(std::memory_order_acquire);
+    if (cold != nullptr || !create) {
+        return cold;
+    }
+    Cold *fresh = new (std::nothrow) Cold();
+    if (fresh == nullptr) {
+        return nullptr;
+    }
+    /* Another thread may have raced us to it */
+    if (m_cold.compare_exchange_strong(cold, fresh, std::memory_order_acq_rel)) {
+        return fresh;
+    }
+    delete fresh;
+    return cold;
+}
+
 int Inode::ReplyEntry(fuse_req_t req) {
-    m_nlookup++;
-    std::shared_lock<std::shared_mutex> lk(entryRwSem);
-    return fuse_reply_entry(req, &m_fuseEntryParam);
+    /* The inode may have lost its last name and been retired since it was
+     * looked up; the kernel must not get a number which will be reused */
+    unsigned long nlookup = m_nlookup.load();
+    do {
+        if (nlookup & Retired) {
+            return fuse_reply_err(req, ENOENT);
+        }
+    } while (!m_nlookup.compare_exchange_weak(nlookup, nlookup + 1));
+    struct fuse_entry_param entry;
+    GetEntry(&entry);
+    return fuse_reply_entry(req, &entry);
 }
 
 int Inode::ReplyCreate(fuse_req_t req, struct fuse_file_info *fi) {
     m_nlookup++;
-    std::shared_lock<std::shared_mutex> lk(entryRwSem);
-    return fuse_reply_create(req, &m_fuseEntryParam, fi);
+    struct fuse_entry_param entry;
+    GetEntry(&entry);
+    return fuse_reply_create(req, &entry, fi);
 }
 
 int Inode::ReplyAttr(fuse_req_t req) {
-    std::shared_lock<std::shared_mutex> lk(entryRwSem);
-    return fuse_reply_attr(req, &(m_fuseEntryParam.attr), 1.0);
+    struct stat attr;
+    GetAttr(&attr);
+    return fuse_reply_attr(req, &attr, AttrTimeout);
 }
 
 int Inode::ReplySetAttr(fuse_req_t req, struct stat *attr, int to_set) {
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    Attr a = m_attr;
     if (to_set & FUSE_SET_ATTR_MODE) {
-        m_fuseEntryParam.attr.st_mode = attr->st_mode;
+        a.mode = attr->st_mode;
     }
     if (to_set & FUSE_SET_ATTR_UID) {
-        m_fuseEntryParam.attr.st_uid = attr->st_uid;
+        a.uid = attr->st_uid;
     }
     if (to_set & FUSE_SET_ATTR_GID) {
-        m_fuseEntryParam.attr.st_gid = attr->st_gid;
+        a.gid = attr->st_gid;
     }
     if (to_set & FUSE_SET_ATTR_SIZE) {
-        m_fuseEntryParam.attr.st_size = attr->st_size;
+        a.size = attr->st_size;
     }
     if (to_set & FUSE_SET_ATTR_ATIME) {
 #ifdef __APPLE__
-        m_fuseEntryParam.attr.st_atimespec = attr->st_atimespec;
+        a.atime = attr->st_atimespec;
 #else
-        m_fuseEntryParam.attr.st_atim = attr->st_atim;
+        a.atime = attr->st_atim;
 #endif
+        /* An explicit atime wins over reads recorded so far */
+        m_lazyAtime = 0;
     }
     if (to_set & FUSE_SET_ATTR_MTIME) {
 #ifdef __APPLE__
-        m_fuseEntryParam.attr.st_mtimespec = attr->st_mtimespec;
+        a.mtime = attr->st_mtimespec;
 #else
-        m_fuseEntryParam.attr.st_mtim = attr->st_mtim;
+        a.mtime = attr->st_mtim;
 #endif
     }
 #ifdef __APPLE__
     if (to_set & FUSE_SET_ATTR_CHGTIME) {
-        m_fuseEntryParam.attr.st_ctimespec = attr->st_ctimespec;
+        a.ctime = attr->st_ctimespec;
 #else
     if (to_set & FUSE_SET_ATTR_CTIME) {
-        m_fuseEntryParam.attr.st_ctim = attr->st_ctim;
+        a.ctime = attr->st_ctim;
 #endif
     }
 #ifdef __APPLE__
     if (to_set & FUSE_SET_ATTR_CRTIME) {
-        m_fuseEntryParam.attr.st_birthtimespec = attr->st_birthtimespec;
+        a.birthtime = attr->st_birthtimespec;
     }
     // TODO: Can't seem to find this one.
 //    if (to_set & FUSE_SET_ATTR_BKUPTIME) {
-//        m_fuseEntryParam.attr.st_ = attr->st_mode;
+//        a.bkuptime = attr->st_bkuptime;
 //    }
     if (to_set & FUSE_SET_ATTR_FLAGS) {
-        m_fuseEntryParam.attr.st_flags = attr->st_flags;
+        a.flags = attr->st_flags;
     }
 #endif /* __APPLE__ */
     
-    // TODO: What do we do if this fails? Do we care? Log the event?
+    /* The kernel sends the ctime along when it keeps the times itself */
 #ifdef __APPLE__
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctimespec));
+    if (!(to_set & FUSE_SET_ATTR_CHGTIME)) {
 #else
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctim));
+    if (!(to_set & FUSE_SET_ATTR_CTIME)) {
 #endif
-    
-    return fuse_reply_attr(req, &(m_fuseEntryParam.attr), 1.0);
+        // TODO: What do we do if this fails? Do we care? Log the event?
+        clock_gettime(CLOCK_REALTIME, &a.ctime);
+    }
+    StoreAttr(a);
+    lk.unlock();
+
+    struct stat out;
+    FillStat(a, &out);
+    return fuse_reply_attr(req, &out, AttrTimeout);
 }
 
-void Inode::Forget(fuse_req_t req, unsigned long nlookup) {
-    m_nlookup -= nlookup;
-    
-    fuse_reply_none(req);
+/**
+ Drops references the kernel held to the inode. Doesn't reply; a forget
+ is answered once per request, which may drop many inodes.
+
+ @param nlookup The number of references to drop.
+ @return true if this dropped the last one.
+ */
+bool Inode::Forget(unsigned long nlookup) {
+    return m_nlookup.fetch_sub(nlookup) == nlookup;
 }
 
-int Inode::SetXAttrAndReply(fuse_req_t req, const string &name, const void *value, size_t size, int flags, uint32_t position) {
-    std::unique_lock<std::shared_mutex> lk(xattrRwSem);
-    if (m_xattr.find(name) == m_xattr.end()) {
-        if (flags & XATTR_CREATE) {
-            return fuse_reply_err(req, EEXIST);
-        }
-        
-    } else {
-        if (flags & XATTR_REPLACE) {
-#ifdef __APPLE__
-            return fuse_reply_err(req, ENOATTR);
-#else
-            return fuse_reply_err(req, ENODATA);
-#endif
-        }
-    }
-    
-    // TODO: What about overflow with size + position?
-    size_t newExtent = size + position;
-    
-    // Expand the space for the value if required.
-    if (m_xattr[name].second < newExtent) {
-        void *newBuf = realloc(m_xattr[name].first, newExtent);
-        if (newBuf == NULL) {
-            return fuse_reply_err(req, E2BIG);
-        }
-        
-        m_xattr[name].first = newBuf;
-        
-        // TODO: How does the user truncate the value? I.e., if they want to replace part, they'll send in
-        // a position and a small size, right? If they want to make the whole thing shorter, then what?
-        m_xattr[name].second = newExtent;
-    }
+/**
+ Claims an inode with no references left for retiring, so that no lookup
+ can hand it to the kernel meanwhile.
 
-    // Copy the data.
-    memcpy((char *) m_xattr[name].first + position, value, size);
-    
-    return fuse_reply_err(req, 0);
+ @return false if a lookup got a reference first; the kernel's forget of
+   it retires the inode then.
+ */
+bool Inode::MarkRetired() {
+    unsigned long none = 0;
+    return m_nlookup.compare_exchange_strong(none, Retired);
 }
 
-int Inode::GetXAttrAndReply(fuse_req_t req, const string &name, size_t size, uint32_t position) {
-    std::shared_lock<std::shared_mutex> lk(xattrRwSem);
-    if (m_xattr.find(name) == m_xattr.end()) {
-#ifdef __APPLE__
-        return fuse_reply_err(req, ENOATTR);
-#else
-        return fuse_reply_err(req, ENODATA);
-#endif
+int Inode::SetXAttrAndReply(fuse_req_t req, std::string_view name, const void *value, size_t size, int flags, uint32_t position) {
+    Cold *cold = GetCold(true);
+    if (cold == nullptr) {
+        return fuse_reply_err(req, ENOSPC);
     }
-    
-    // The requestor wanted the size. TODO: How does position figure into this?
+    std::unique_lock<std::shared_mutex> lk(cold->xattrRwSem);
+    int res = cold->xattr.Set(name, value, size, flags, position);
+    lk.unlock();
+    return fuse_reply_err(req, -res);
+}
+
+int Inode::GetXAttrAndReply(fuse_req_t req, std::string_view name, size_t size, uint32_t position) {
+    Cold *cold = GetCold(false);
+    if (cold == nullptr) {
+        return fuse_reply_err(req, XAttrs::NoAttr);
+    }
+    std::shared_lock<std::shared_mutex> lk(cold->xattrRwSem);
+    const XAttrs::Blob *value = cold->xattr.Get(name);
+    if (value == nullptr) {
+        return fuse_reply_err(req, XAttrs::NoAttr);
+    }
+    size_t avail = value->Size() > position ? value->Size() - position : 0;
+
+    // The requestor wanted the size
     if (size == 0) {
-        return fuse_reply_xattr(req, m_xattr[name].second);
+        return fuse_reply_xattr(req, avail);
     }
     
-    // TODO: What about overflow with size + position?
-    size_t newExtent = size + position;
-    
-    // TODO: Is this the case where "the size is to small for the value"?
-    if (m_xattr[name].second < newExtent) {
+    // "If the size is too small for the value, the ERANGE error should be sent"
+    if (size < avail) {
         return fuse_reply_err(req, ERANGE);
     }
     
-    // TODO: It's fine for someone to just read part of a value, right (i.e. size is less than m_xattr[name].second)?
-    return fuse_reply_buf(req, (char *) m_xattr[name].first + position, size);
+    return fuse_reply_buf(req, value->Data() + position, avail);
 }
 
 int Inode::ListXAttrAndReply(fuse_req_t req, size_t size) {
     
-    size_t listSize = 0;
-    std::shared_lock<std::shared_mutex> lk(xattrRwSem);
-    for(map<string, pair<void *, size_t> >::iterator it = m_xattr.begin(); it != m_xattr.end(); it++) {
-        listSize += (it->first.size() + 1);
+    Cold *cold = GetCold(false);
+    if (cold == nullptr) {
+        return fuse_reply_xattr(req, 0);
     }
+    std::shared_lock<std::shared_mutex> lk(cold->xattrRwSem);
+    const std::string &list = cold->xattr.List();
 
     // The requestor wanted the size
     if (size == 0) {
-        return fuse_reply_xattr(req, listSize);
+        return fuse_reply_xattr(req, list.size());
     }
     
     // "If the size is too small for the list, the ERANGE error should be sent"
-    if (size < listSize) {
+    if (size < list.size()) {
         return fuse_reply_err(req, ERANGE);
     }
     
-    // TODO: Is EIO really the best error to return if we ran out of memory?
-    void *buf = malloc(listSize);
-    if (buf == NULL) {
-        return fuse_reply_err(req, EIO);
-    }
-    
-    size_t position = 0;
-    for(map<string, pair<void *, size_t> >::iterator it = m_xattr.begin(); it != m_xattr.end(); it++) {
-        // Copy the name as well as the null termination character.
-        memcpy((char *) buf + position, it->first.c_str(), it->first.size() + 1);
-        position += (it->first.size() + 1);
-    }
-
-    int retval = fuse_reply_buf(req, (char *) buf, position);
-    free(buf);
-    
-    return retval;
+    return fuse_reply_buf(req, list.data(), list.size());
 }
 
-int Inode::RemoveXAttrAndReply(fuse_req_t req, const string &name) {
-    std::unique_lock<std::shared_mutex> lk(entryRwSem);
-    map<string, pair<void *, size_t> >::iterator it = m_xattr.find(name);
-    if (it == m_xattr.end()) {
-#ifdef __APPLE__
-        return fuse_reply_err(req, ENOATTR);
-#else
-        return fuse_reply_err(req, ENODATA);
-#endif
+int Inode::RemoveXAttrAndReply(fuse_req_t req, std::string_view name) {
+    Cold *cold = GetCold(false);
+    if (cold == nullptr) {
+        return fuse_reply_err(req, XAttrs::NoAttr);
     }
-    
-    m_xattr.erase(it);
-    
-    return fuse_reply_err(req, 0);
+    std::unique_lock<std::shared_mutex> lk(cold->xattrRwSem);
+    int res = cold->xattr.Remove(name);
+    lk.unlock();
+    return fuse_reply_err(req, -res);
 }
 
 int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
+    return fuse_reply_err(req, HasAccess(mask, gid, uid) ? 0 : EACCES);
+}
+
+/**
+ Checks the permission bits of the inode against a caller.
+
+ @param mask R_OK, W_OK and X_OK ored together, or F_OK.
+ @param gid The caller's group.
+ @param uid The caller.
+ @return Whether the caller may have the access asked for.
+ */
+bool Inode::HasAccess(int mask, gid_t gid, uid_t uid) {
     // If all the user wanted was to know if the file existed, it does.
     if (mask == F_OK) {
-        return fuse_reply_err(req, 0);
+        return true;
     }
     
-    std::shared_lock<std::shared_mutex> lk(entryRwSem);
+    Attr attr = LoadAttr();
     // Check other
-    if ((m_fuseEntryParam.attr.st_mode & mask) == mask) {
-        return fuse_reply_err(req, 0);
+    if ((attr.mode & mask) == mask) {
+        return true;
     }
     mask <<= 3;
     
     // Check group. TODO: What about other groups the user is in?
-    if ((m_fuseEntryParam.attr.st_mode & mask) == mask) {
+    if ((attr.mode & mask) == mask) {
         // Go ahead if the user's main group is the same as the file's
-        if (gid == m_fuseEntryParam.attr.st_gid) {
-            return fuse_reply_err(req, 0);
+        if (gid == attr.gid) {
+            return true;
         }
         
         // Now check the user's other groups. TODO: Where is this function?! not on this version of FUSE?
@@ -245,43 +443,132 @@ int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
     mask <<= 3;
     
     // Check owner.
-    if ((uid == m_fuseEntryParam.attr.st_uid) && (m_fuseEntryParam.attr.st_mode & mask) == mask) {
-        return fuse_reply_err(req, 0);
-    }
-    
-    return fuse_reply_err(req, EACCES);
+    return (uid == attr.uid) && (attr.mode & mask) == mask;
 }
 
 void Inode::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid) {
-    
-    // TODO: Still not sure if I should use m_fuseEntryParam = {}
-    memset(&m_fuseEntryParam, 0, sizeof(m_fuseEntryParam));
-    m_fuseEntryParam.ino = ino;
-    m_fuseEntryParam.attr.st_ino = ino;
-    m_fuseEntryParam.attr_timeout = 1.0;
-    m_fuseEntryParam.entry_timeout = 1.0;
-    m_fuseEntryParam.attr.st_mode = mode;
-    m_fuseEntryParam.attr.st_gid = gid;
-    m_fuseEntryParam.attr.st_uid = uid;
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    /* Anything else, like a device number, was set by the constructor */
+    Attr attr = m_attr;
+    attr.ino = ino;
+    attr.mode = mode;
+    attr.gid = gid;
+    attr.uid = uid;
     
     // Note this found on the Internet regarding nlink on dirs:
     // "For the root directory it is at least three; /, /., and /... Make a directory /foo and /foo/.. will have the same inode number as /, incrementing st_nlink.
     //
     // Cheers, Ralph."
-    m_fuseEntryParam.attr.st_nlink = nlink;
-    
-    m_fuseEntryParam.attr.st_blksize = Inode::BufBlockSize;
+    attr.nlink = nlink;
     
     timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
+    attr.atime = ts;
+    attr.ctime = ts;
+    attr.mtime = ts;
 #ifdef __APPLE__
-    m_fuseEntryParam.attr.st_atimespec = ts;
-    m_fuseEntryParam.attr.st_ctimespec = ts;
-    m_fuseEntryParam.attr.st_birthtimespec = ts;
-    m_fuseEntryParam.attr.st_mtimespec = ts;
-#else
-    m_fuseEntryParam.attr.st_atim = ts;
-    m_fuseEntryParam.attr.st_ctim = ts;
-    m_fuseEntryParam.attr.st_mtim = ts;
+    attr.birthtime = ts;
 #endif
-}
\ No newline at end of file
+    StoreAttr(attr);
+}
+
+/**
+ Writes the attributes and xattrs of the inode to a snapshot. Subclasses
+ add their contents after them.
+
+ @param out The image being written.
+ */
+void Inode::Save(ImageWriter &out) {
+    Attr attr = LoadAttr();
+    /* As GetAttr() does, a lazily recorded read is the atime */
+    int64_t lazy = m_lazyAtime.load(std::memory_order_relaxed);
+    if (lazy != 0) {
+        attr.atime.tv_sec = lazy / 1000000000;
+        attr.atime.tv_nsec = lazy % 1000000000;
+    }
+    out.PutU32(attr.nlink);
+    out.PutU32(attr.uid);
+    out.PutU32(attr.gid);
+    out.PutU64(attr.rdev);
+    out.PutU64(attr.size);
+    out.PutU64(attr.blocks);
+    for (const struct timespec *ts : {&attr.atime, &attr.mtime, &attr.ctime}) {
+        out.PutU64(ts->tv_sec);
+        out.PutU64(ts->tv_nsec);
+    }
+
+    Cold *cold = GetCold(false);
+    if (cold == nullptr) {
+        out.PutU32(0);
+        return;
+    }
+    std::shared_lock<std::shared_mutex> lk(cold->xattrRwSem);
+    out.PutU32(cold->xattr.Count());
+    cold->xattr.ForEach([&out](std::string_view name, std::string_view value) {
+        out.PutString(name.data(), name.size());
+        out.PutString(value.data(), value.size());
+    });
+}
+
+/**
+ Reads back what Save() wrote. Subclasses read their contents after it
+ and recompute the size and blocks they derive from them.
+
+ @param in The record of the inode in the image.
+ @param ino The inode number.
+ @param mode The mode of the inode.
+ @return false if the record is damaged.
+ */
+bool Inode::Load(ImageReader &in, fuse_ino_t ino, mode_t mode) {
+    uint32_t nlink, uid, gid;
+    uint64_t rdev, size, blocks;
+    uint64_t times[6];
+    if (!in.GetU32(nlink) || !in.GetU32(uid) || !in.GetU32(gid) ||
+        !in.GetU64(rdev) || !in.GetU64(size) || !in.GetU64(blocks) ||
+        !in.Get(times, sizeof(times)) || nlink == 0 || (int64_t) size < 0) {
+        return false;
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> lk(entryRwSem);
+        Attr attr = m_attr;
+        attr.ino = ino;
+        attr.mode = mode;
+        attr.nlink = nlink;
+        attr.uid = uid;
+        attr.gid = gid;
+        attr.rdev = rdev;
+        attr.size = size;
+        attr.blocks = blocks;
+        attr.atime = {(time_t) times[0], (long) times[1]};
+        attr.mtime = {(time_t) times[2], (long) times[3]};
+        attr.ctime = {(time_t) times[4], (long) times[5]};
+#ifdef __APPLE__
+        attr.birthtime = attr.ctime;
+#endif
+        StoreAttr(attr);
+    }
+
+    uint32_t count;
+    if (!in.GetU32(count)) {
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    Cold *cold = GetCold(true);
+    if (cold == nullptr) {
+        return false;
+    }
+    std::unique_lock<std::shared_mutex> lk(cold->xattrRwSem);
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string name, value;
+        if (!in.GetString(name) || !in.GetString(value)) {
+            return false;
+        }
+        if (cold->xattr.Set(name, value.data(), value.size(), 0, 0) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
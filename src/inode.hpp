@@ -6,78 +6,164 @@
 #define inode_hpp
 
 #include "common.h"
+#include "slab.hpp"
+#include "xattr.hpp"
+
+class ImageWriter;
+class ImageReader;
+class Quota;
+
+/* The subclass of an Inode, so that it can be told without RTTI */
+enum InodeKinds {
+    INODE_KIND_FILE,
+    INODE_KIND_DIRECTORY,
+    INODE_KIND_SYMLINK,
+    INODE_KIND_SPECIAL
+};
 
 class Inode {
 private:    
+    const enum InodeKinds m_kind;
     bool m_markedForDeletion;
+    /* The kernel's references, with Retired set once the inode is on its
+     * way out of the table and can't be handed out again */
     std::atomic_ulong m_nlookup;
+    static const unsigned long Retired = ~(ULONG_MAX >> 1);
+
+    /* Metadata few inodes ever have, allocated on first use */
+    struct Cold {
+        XAttrs xattr;
+        std::shared_mutex xattrRwSem;
+    };
+    std::atomic<Cold *> m_cold;
+
+    Cold *GetCold(bool create);
 
 protected:
-    struct fuse_entry_param m_fuseEntryParam;
+    /* The attributes lookups and getattr need, packed into a couple of
+     * cache lines. Readers copy them with LoadAttr() without locking;
+     * writers hold entryRwSem exclusively and publish with StoreAttr().
+     * Files also let writers holding it shared publish, one at a time;
+     * see File::WriteWithin(). */
+    struct Attr {
+        fuse_ino_t ino;
+        off_t size;
+        blkcnt_t blocks;
+        dev_t rdev;
+        struct timespec atime;
+        struct timespec mtime;
+        struct timespec ctime;
+#ifdef __APPLE__
+        struct timespec birthtime;
+        uint32_t flags;
+        uint32_t padding;
+#endif
+        mode_t mode;
+        uint32_t nlink;
+        uid_t uid;
+        gid_t gid;
+    };
+    Attr m_attr;
+    /* Odd while m_attr is being written */
+    std::atomic<uint32_t> m_attrSeq;
+    /* Serializes writers of m_attr, and guards the contents of subclasses */
     std::shared_mutex entryRwSem;
-    std::map<std::string, std::pair<void *, size_t> > m_xattr;
-    std::shared_mutex xattrRwSem;
+    /* Last read under lazytime in nanoseconds since the epoch, or 0. It is
+     * newer than the atime whenever it is set. */
+    std::atomic<int64_t> m_lazyAtime;
+    /* The quota the inode counts against, or null. Set before the inode
+     * is published; a directory may also become the root of one. */
+    std::atomic<Quota *> m_quota;
+    /* Whether the charges were given back already. Guarded by entryRwSem,
+     * like the blocks they follow. */
+    bool m_quotaLeft;
+
+    Attr LoadAttr();
+    void StoreAttr(const Attr &attr);
+    void FillStat(const Attr &attr, struct stat *out);
+    /* Reads one field of m_attr on its own, without locking */
+    template <typename T> static T LoadField(const T &field) {
+        return __atomic_load_n(&field, __ATOMIC_RELAXED);
+    }
     
 public:
     static const size_t BufBlockSize = 512;
+    /* How long the kernel may cache attributes and names, in seconds */
+    static double AttrTimeout;
+    static double EntryTimeout;
     
 public:
-    Inode() :
+    Inode(enum InodeKinds kind) :
+    m_kind(kind),
     m_markedForDeletion(false),
-    m_nlookup(0)
+    m_nlookup(0),
+    m_cold(nullptr),
+    m_attr(),
+    m_attrSeq(0),
+    m_lazyAtime(0),
+    m_quota(nullptr),
+    m_quotaLeft(false)
     {}
     
     virtual ~Inode() = 0;
     
     virtual int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) = 0;
+    virtual int WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off);
     virtual int ReadAndReply(fuse_req_t req, size_t size, off_t off) = 0;
     int ReplyEntry(fuse_req_t req);
     int ReplyCreate(fuse_req_t req, struct fuse_file_info *fi);
     // TODO: Should this be GetAttr?
     int ReplyAttr(fuse_req_t req);
     // TODO: This is doing more then just replying. Factor out setting attributes?
-    int ReplySetAttr(fuse_req_t req, struct stat *attr, int to_set);
-    void Forget(fuse_req_t req, unsigned long nlookup);
+    virtual int ReplySetAttr(fuse_req_t req, struct stat *attr, int to_set);
+    bool Forget(unsigned long nlookup);
+    bool MarkRetired();
     virtual void Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
-    virtual int SetXAttrAndReply(fuse_req_t req, const std::string &name, const void *value, size_t size, int flags, uint32_t position);
-    virtual int GetXAttrAndReply(fuse_req_t req, const std::string &name, size_t size, uint32_t position);
+    virtual int SetXAttrAndReply(fuse_req_t req, std::string_view name, const void *value, size_t size, int flags, uint32_t position);
+    virtual int GetXAttrAndReply(fuse_req_t req, std::string_view name, size_t size, uint32_t position);
     virtual int ListXAttrAndReply(fuse_req_t req, size_t size);
-    virtual int RemoveXAttrAndReply(fuse_req_t req, const std::string &name);
+    virtual int RemoveXAttrAndReply(fuse_req_t req, std::string_view name);
     virtual int ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid);
+    bool HasAccess(int mask, gid_t gid, uid_t uid);
+    virtual void Save(ImageWriter &out);
+    virtual bool Load(ImageReader &in, fuse_ino_t ino, mode_t mode);
     
     /* Atomic file attribute operations */
     void AddHardLink() {
         std::unique_lock<std::shared_mutex> lk(entryRwSem);
-        m_fuseEntryParam.attr.st_nlink++;
+        Attr attr = m_attr;
+        attr.nlink++;
+        StoreAttr(attr);
     }
     void RemoveHardLink() {
         std::unique_lock<std::shared_mutex> lk(entryRwSem);
-        m_fuseEntryParam.attr.st_nlink--;
+        Attr attr = m_attr;
+        attr.nlink--;
+        StoreAttr(attr);
     }
-    bool HasNoLinks() {
-        std::shared_lock<std::shared_mutex> lk(entryRwSem);
-        return m_fuseEntryParam.attr.st_nlink == 0;
-    }
-    size_t UsedBlocks() {
-        std::shared_lock<std::shared_mutex> lk(entryRwSem);
-        return m_fuseEntryParam.attr.st_blocks;
-    }
-    size_t Size() {
-        std::shared_lock<std::shared_mutex> lk(entryRwSem);
-        return m_fuseEntryParam.attr.st_size;
-    }
-    void GetAttr(struct stat *out) {
-        std::shared_lock<std::shared_mutex> lk(entryRwSem);
-        *out = m_fuseEntryParam.attr;
-    }
-    mode_t GetMode() {
-        std::shared_lock<std::shared_mutex> lk(entryRwSem);
-        return m_fuseEntryParam.attr.st_mode;
-    }
-    /* We assume that attr.st_ino won't change */
-    fuse_ino_t GetIno() { return m_fuseEntryParam.attr.st_ino; }
+    bool HasNoLinks() { return LoadField(m_attr.nlink) == 0; }
+    size_t UsedBlocks() { return LoadField(m_attr.blocks); }
+    size_t Size() { return LoadField(m_attr.size); }
+    void GetAttr(struct stat *out) { FillStat(LoadAttr(), out); }
+    /* Copies the entry without counting it as a lookup; see AddLookup() */
+    void GetEntry(struct fuse_entry_param *out);
+    /* The kernel now holds one more reference, as after ReplyEntry(). Only
+     * while a name of the inode is held in place, so it can't be retired. */
+    void AddLookup() { m_nlookup++; }
+    mode_t GetMode() { return LoadField(m_attr.mode); }
+    fuse_ino_t GetIno() { return LoadField(m_attr.ino); }
+    enum InodeKinds GetKind() const { return m_kind; }
+    Quota *GetQuota() { return m_quota.load(std::memory_order_acquire); }
+    void JoinQuota(Quota *quota);
+    void LeaveQuota();
+    Quota *MemberQuota();
     
     bool Forgotten() { return m_nlookup == 0; }
 };
 
+/* Like dynamic_cast for inodes, by the Kind each subclass declares */
+template <class T> T *inode_cast(Inode *inode) {
+    return inode != nullptr && inode->GetKind() == T::Kind ? static_cast<T *>(inode) : nullptr;
+}
+
 #endif /* inode_hpp */
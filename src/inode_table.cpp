@@ -0,0 +1,350 @@
+/** @file inode_table.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+
+#include "inode.hpp"
+#include "inode_table.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+std::atomic<InodeTable::Slot *> InodeTable::m_chunks[InodeTable::MaxChunks];
+std::atomic<uint64_t> InodeTable::m_next(0);
+std::atomic<uint64_t> InodeTable::m_freeHead(0);
+
+/* Epoch 0 means a reader is not inside a Guard */
+std::atomic<uint64_t> InodeTable::m_epoch(1);
+InodeTable::Reader InodeTable::m_readers[InodeTable::MaxReaders];
+std::atomic<size_t> InodeTable::m_overflowReaders(0);
+std::vector<InodeTable::Retired> InodeTable::m_retired;
+std::mutex InodeTable::m_retiredMutex;
+const unsigned InodeTable::ReapIntervalMs;
+bool InodeTable::m_reaperRunning = false;
+bool InodeTable::m_reaperStopping = false;
+bool InodeTable::m_reapWanted = false;
+std::condition_variable InodeTable::m_reaperCv;
+std::thread InodeTable::m_reaper;
+
+/* Gives a thread's Reader back when the thread exits */
+struct ReaderHandle {
+    std::atomic<bool> *inUse = nullptr;
+    std::atomic<uint64_t> *epoch = nullptr;
+
+    ~ReaderHandle() {
+        if (inUse != nullptr) {
+            inUse->store(false, std::memory_order_release);
+        }
+    }
+};
+
+/**
+ Finds the Reader of the calling thread, claiming a free one the first time.
+
+ @return The epoch of the Reader, or nullptr if all of them are taken.
+ */
+std::atomic<uint64_t> *InodeTable::EnterReader() {
+    static thread_local ReaderHandle handle;
+    if (handle.epoch != nullptr) {
+        return handle.epoch;
+    }
+    for (size_t i = 0; i < MaxReaders; ++i) {
+        bool expected = false;
+        if (!m_readers[i].inUse.load(std::memory_order_relaxed) &&
+            m_readers[i].inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            handle.inUse = &m_readers[i].inUse;
+            handle.epoch = &m_readers[i].epoch;
+            return handle.epoch;
+        }
+    }
+    return nullptr;
+}
+
+InodeTable::Guard::Guard() : m_epoch(nullptr), m_overflow(false) {
+    std::atomic<uint64_t> *epoch = EnterReader();
+    if (epoch == nullptr) {
+        /* Reclamation waits for all such guards to leave */
+        m_overflowReaders.fetch_add(1);
+        m_overflow = true;
+    } else if (epoch->load(std::memory_order_relaxed) == 0) {
+        epoch->store(InodeTable::m_epoch.load());
+        m_epoch = epoch;
+    }
+}
+
+InodeTable::Guard::~Guard() {
+    if (m_overflow) {
+        m_overflowReaders.fetch_sub(1);
+    } else if (m_epoch != nullptr) {
+        m_epoch->store(0, std::memory_order_release);
+    }
+}
+
+/**
+ Finds the slot for an inode number.
+
+ @param ino The inode number.
+ @param create Whether to allocate the chunk holding the slot if needed.
+ @return The slot, or nullptr if its chunk does not exist.
+ */
+InodeTable::Slot *InodeTable::GetSlot(fuse_ino_t ino, bool create) {
+    std::atomic<Slot *> &entry = m_chunks[ino / ChunkSize];
+    Slot *chunk = entry.load(std::memory_order_acquire);
+    if (chunk == nullptr && create) {
+        Slot *fresh = new (std::nothrow) Slot[ChunkSize]();
+        if (fresh == nullptr) {
+            return nullptr;
+        }
+        /* Another thread may have raced us to it */
+        if (entry.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+            chunk = fresh;
+        } else {
+            delete[] fresh;
+        }
+    }
+    return chunk == nullptr ? nullptr : &chunk[ino % ChunkSize];
+}
+
+/**
+ Stores an inode in the table under a free number. Numbers of reclaimed
+ inodes are reused before new ones are taken.
+
+ @param inode The inode to store.
+ @return The inode number.
+ @throws std::bad_alloc if the table is full.
+ */
+fuse_ino_t InodeTable::Add(Inode *inode) {
+    uint64_t head = m_freeHead.load(std::memory_order_acquire);
+    while ((uint32_t) head != 0) {
+        fuse_ino_t ino = (uint32_t) head - 1;
+        Slot *slot = GetSlot(ino, false);
+        uint64_t next = ((head >> 32) + 1) << 32 | slot->nextFree.load(std::memory_order_relaxed);
+        if (m_freeHead.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+            slot->inode.store(inode, std::memory_order_release);
+            return ino;
+        }
+    }
+
+    uint64_t ino = m_next.load(std::memory_order_relaxed);
+    Slot *slot;
+    do {
+        if (ino >= MaxChunks * ChunkSize || (slot = GetSlot(ino, true)) == nullptr) {
+            throw std::bad_alloc();
+        }
+    } while (!m_next.compare_exchange_weak(ino, ino + 1, std::memory_order_acq_rel));
+    slot->inode.store(inode, std::memory_order_release);
+    return ino;
+}
+
+/**
+ Stores an inode under a given number, as when restoring a snapshot.
+ Only safe before the filesystem serves requests; call ReleaseUnused()
+ once every inode is in place.
+
+ @param ino The inode number.
+ @param inode The inode to store.
+ @return false if the number is taken or out of range.
+ */
+bool InodeTable::Put(fuse_ino_t ino, Inode *inode) {
+    Slot *slot = ino < MaxChunks * ChunkSize ? GetSlot(ino, true) : nullptr;
+    if (slot == nullptr || slot->inode.load() != nullptr) {
+        return false;
+    }
+    slot->inode.store(inode, std::memory_order_release);
+    if (ino >= m_next.load()) {
+        m_next = ino + 1;
+    }
+    return true;
+}
+
+/* Puts the numbers Put() skipped on the free list */
+void InodeTable::ReleaseUnused() {
+    uint64_t count = m_next.load();
+    for (fuse_ino_t ino = count; ino-- > 0; ) {
+        Slot *slot = GetSlot(ino, true);
+        if (slot != nullptr && slot->inode.load() == nullptr) {
+            PushFree(ino);
+        }
+    }
+}
+
+void InodeTable::PushFree(fuse_ino_t ino) {
+    Slot *slot = GetSlot(ino, false);
+    uint64_t head = m_freeHead.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        slot->nextFree.store((uint32_t) head, std::memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (ino + 1);
+    } while (!m_freeHead.compare_exchange_weak(head, next, std::memory_order_release,
+                                               std::memory_order_relaxed));
+}
+
+/**
+ Removes an inode from the table. The inode is deleted, and its number
+ reused, once no request which could still see it is running.
+
+ @param ino The inode number.
+ @return false if the inode was not in the table (any more).
+ */
+bool InodeTable::Retire(fuse_ino_t ino) {
+    Slot *slot = GetSlot(ino, false);
+    if (slot == nullptr) {
+        return false;
+    }
+    Inode *inode = slot->inode.exchange(nullptr);
+    if (inode == nullptr) {
+        return false;
+    }
+
+    bool full, wake = false;
+    {
+        std::unique_lock<std::mutex> lk(m_retiredMutex, std::defer_lock);
+        Metrics::Acquire(lk, Metrics::ReclaimLock);
+        m_retired.push_back({m_epoch.load(), ino, inode});
+        full = m_retired.size() >= ReclaimThreshold;
+        if (full && m_reaperRunning && !m_reapWanted) {
+            m_reapWanted = wake = true;
+        }
+    }
+    if (wake) {
+        m_reaperCv.notify_one();
+    } else if (full && !m_reaperRunning) {
+        Reclaim(false);
+    }
+    return true;
+}
+
+/* The reaper thread: reclaims a batch whenever one fills up, and the
+ * leftovers now and then. */
+void InodeTable::Reap() {
+    std::unique_lock<std::mutex> lk(m_retiredMutex);
+    while (!m_reaperStopping) {
+        auto woken = [] { return m_reapWanted || m_reaperStopping; };
+        if (m_retired.empty()) {
+            m_reaperCv.wait(lk, woken);
+        } else {
+            m_reaperCv.wait_for(lk, std::chrono::milliseconds(ReapIntervalMs), woken);
+        }
+        m_reapWanted = false;
+        if (m_retired.empty() || m_reaperStopping) {
+            continue;
+        }
+        lk.unlock();
+        Reclaim(false);
+        lk.lock();
+    }
+}
+
+/**
+ Starts deleting removed inodes on a thread of their own. Until then, and
+ after StopReaper(), the thread removing an inode deletes full batches
+ itself.
+ */
+void InodeTable::StartReaper() {
+    std::lock_guard<std::mutex> lk(m_retiredMutex);
+    if (m_reaperRunning) {
+        return;
+    }
+    m_reaperStopping = false;
+    m_reaper = std::thread(Reap);
+    m_reaperRunning = true;
+}
+
+void InodeTable::StopReaper() {
+    {
+        std::lock_guard<std::mutex> lk(m_retiredMutex);
+        if (!m_reaperRunning) {
+            return;
+        }
+        m_reaperStopping = true;
+    }
+    m_reaperCv.notify_one();
+    m_reaper.join();
+    std::lock_guard<std::mutex> lk(m_retiredMutex);
+    m_reaperRunning = false;
+}
+
+/**
+ Deletes the retired inodes which no running request can reach any more.
+
+ @param force Delete all of them, when no request can be running.
+ */
+void InodeTable::Reclaim(bool force) {
+    std::vector<Retired> done;
+    {
+        std::unique_lock<std::mutex> lk(m_retiredMutex, std::defer_lock);
+        Metrics::Acquire(lk, Metrics::ReclaimLock);
+
+        /* Requests starting from now on can't see anything retired so far */
+        m_epoch.fetch_add(1);
+        uint64_t oldest = UINT64_MAX;
+        if (!force) {
+            if (m_overflowReaders.load() > 0) {
+                oldest = 0;
+            }
+            for (size_t i = 0; i < MaxReaders; ++i) {
+                uint64_t epoch = m_readers[i].epoch.load();
+                if (epoch != 0 && epoch < oldest) {
+                    oldest = epoch;
+                }
+            }
+        }
+
+        /* An inode retired in epoch e may be held by a request which
+         * started in e or earlier */
+        auto keep = std::partition(m_retired.begin(), m_retired.end(),
+                                   [oldest](const Retired &r) { return r.epoch >= oldest; });
+        done.assign(keep, m_retired.end());
+        m_retired.erase(keep, m_retired.end());
+    }
+
+    for (auto const &r : done) {
+        delete r.inode;
+        PushFree(r.ino);
+    }
+}
+
+/**
+ Deletes every inode and empties the table. Only safe once no other
+ thread can use the table. The chunks are shared out between up to
+ ClearThreads threads, so unmounting a large filesystem takes a fraction
+ of the time.
+ */
+void InodeTable::Clear() {
+    Reclaim(true);
+    size_t chunks = (m_next.load() + ChunkSize - 1) / ChunkSize;
+    std::atomic<size_t> nextChunk(0);
+    auto work = [chunks, &nextChunk] {
+        for (size_t c; (c = nextChunk.fetch_add(1)) < chunks; ) {
+            Slot *chunk = m_chunks[c].exchange(nullptr);
+            if (chunk == nullptr) {
+                continue;
+            }
+            for (size_t i = 0; i < ChunkSize; ++i) {
+                delete chunk[i].inode.load();
+            }
+            delete[] chunk;
+        }
+    };
+
+    size_t threads = std::min<size_t>({std::max(1u, std::thread::hardware_concurrency()),
+                                       ClearThreads, chunks});
+    std::vector<std::thread> helpers;
+    for (size_t i = 1; i < threads; ++i) {
+        try {
+            helpers.emplace_back(work);
+        } catch (std::exception &e) {
+            /* The threads there are do the rest */
+            break;
+        }
+    }
+    work();
+    for (auto &t : helpers) {
+        t.join();
+    }
+    m_next = 0;
+    m_freeHead = 0;
+}
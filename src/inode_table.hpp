@@ -0,0 +1,126 @@
+/** @file inode_table.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef inode_table_hpp
+#define inode_table_hpp
+
+#include "common.h"
+
+#include <condition_variable>
+#include <thread>
+
+class Inode;
+
+/**
+ Maps inode numbers to Inode objects.
+
+ The table is split into fixed-size chunks which are never moved or freed
+ while the filesystem is mounted, so a lookup is a couple of atomic loads
+ and never waits for a writer. Inode numbers are handed out from a
+ lock-free free list of reclaimed numbers, or else from a counter.
+
+ Removed inodes are not deleted right away: a worker still serving an
+ older request may hold a pointer to them. Every request runs inside a
+ Guard, which records the epoch it started in, and a removed inode is
+ deleted only once every active request started after its removal.
+ Deleting is left to a reaper thread, which takes the removed inodes in
+ batches, so forgetting a large tree doesn't hold up the workers.
+ */
+class InodeTable {
+public:
+    static const size_t ChunkSize = 4096;
+    static const size_t MaxChunks = 65536;
+    /* Removed inodes are reclaimed in batches of at least this many */
+    static const size_t ReclaimThreshold = 256;
+    /* How often the reaper looks at a batch which isn't full yet */
+    static const unsigned ReapIntervalMs = 100;
+    /* Threads which delete the inodes when the table is cleared */
+    static const unsigned ClearThreads = 16;
+
+    /* Marks the calling thread as reading the table until destroyed */
+    class Guard {
+    private:
+        /* The epoch this guard published, or null if an outer guard of
+         * this thread already covers it */
+        std::atomic<uint64_t> *m_epoch;
+        bool m_overflow;
+
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+private:
+    struct Slot {
+        std::atomic<Inode *> inode;
+        /* Next number on the free list, plus one */
+        std::atomic<uint32_t> nextFree;
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        fuse_ino_t ino;
+        Inode *inode;
+    };
+
+    /* One cache line per thread which has entered a Guard */
+    struct alignas(64) Reader {
+        std::atomic<bool> inUse;
+        std::atomic<uint64_t> epoch;
+    };
+    static const size_t MaxReaders = 256;
+
+    static std::atomic<Slot *> m_chunks[MaxChunks];
+    /* The lowest number which was never handed out */
+    static std::atomic<uint64_t> m_next;
+    /* Free list of reclaimed numbers: (ABA tag << 32) | (ino + 1) */
+    static std::atomic<uint64_t> m_freeHead;
+
+    static std::atomic<uint64_t> m_epoch;
+    static Reader m_readers[MaxReaders];
+    /* Guards held by threads which found no free Reader */
+    static std::atomic<size_t> m_overflowReaders;
+    static std::vector<Retired> m_retired;
+    static std::mutex m_retiredMutex;
+
+    /* Guarded by m_retiredMutex */
+    static bool m_reaperRunning;
+    static bool m_reaperStopping;
+    static bool m_reapWanted;
+    static std::condition_variable m_reaperCv;
+    static std::thread m_reaper;
+
+    static Slot *GetSlot(fuse_ino_t ino, bool create);
+    static void PushFree(fuse_ino_t ino);
+    static void Reclaim(bool force);
+    static std::atomic<uint64_t> *EnterReader();
+    static void Reap();
+
+public:
+    static Inode *Get(fuse_ino_t ino) {
+        if (ino >= m_next.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        Slot *chunk = m_chunks[ino / ChunkSize].load(std::memory_order_acquire);
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        return chunk[ino % ChunkSize].inode.load(std::memory_order_acquire);
+    }
+
+    /* One more than the highest number handed out so far */
+    static fuse_ino_t Limit() { return m_next.load(std::memory_order_acquire); }
+
+    static fuse_ino_t Add(Inode *inode);
+    static bool Put(fuse_ino_t ino, Inode *inode);
+    static void ReleaseUnused();
+    static bool Retire(fuse_ino_t ino);
+    static void Clear();
+    static void StartReaper();
+    static void StopReaper();
+};
+
+#endif /* inode_table_hpp */
@@ -6,6 +6,14 @@
 
 #include "inode.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "directory.hpp"
+#include "file.hpp"
+#include "session_loop.hpp"
+#include "control.hpp"
+#include "snapshot.hpp"
+#include "compressor.hpp"
+#include "dedup.hpp"
+#include "spill.hpp"
 
 using namespace std;
 
@@ -19,6 +27,16 @@ char **copy_args(int argc, const char * argv[]) {
     return new_argv;
 }
 
+/* Daemonizing moves to /, so relative paths are pinned down first */
+std::string absolute_path(const char *path) {
+    std::string abs = path;
+    char cwd[PATH_MAX];
+    if (abs[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        abs = std::string(cwd) + "/" + abs;
+    }
+    return abs;
+}
+
 void delete_args(int argc, char **argv) {
     for (int i = 0; i < argc; ++i) {
         delete argv[i];
@@ -55,15 +73,72 @@ int main(int argc, const char * argv[]) {
     /* Parse command-line args by fuse-ramfs */
     opterr = 0;
     ramfs_parse_cmdline(args, options);
+    /* The data pool is set up by the FuseRamFs constructor */
+    DataPool::HugePages = options.hugepages;
+    DataPool::Numa = options.numa;
     // The core code for our filesystem.
     size_t nblocks = options.capacity / Inode::BufBlockSize;
     FuseRamFs core(nblocks, options.inodes);
+    if (options.dir_hash_threshold > 0) {
+        Directory::HashThreshold = options.dir_hash_threshold;
+    }
+    if (options.attr_timeout >= 0) {
+        Inode::AttrTimeout = options.attr_timeout;
+    }
+    if (options.entry_timeout >= 0) {
+        Inode::EntryTimeout = options.entry_timeout;
+    }
+    /* Names which don't exist are cached as long as those which do */
+    FuseRamFs::NegativeTimeout = options.negative_timeout >= 0 ? options.negative_timeout : Inode::EntryTimeout;
+    FuseRamFs::KeepCache = options.keep_cache;
+    FuseRamFs::WritebackCache = options.writeback_cache;
+    FuseRamFs::MaxWrite = options.max_write;
+    FuseRamFs::MaxReadahead = options.max_readahead;
+    File::AtimeMode = options.atime_mode;
+    if (options.compress_seconds > 0 && !Compressor::Available()) {
+        cerr << "compress needs fuse-cpp-ramfs to be built with LZ4" << endl;
+        exit(1);
+    }
+    Compressor::ColdSeconds = options.compress_seconds;
+    Dedup::Enabled = options.dedup;
+    if (options.spill_high > 0) {
+        Spill::High = options.spill_high;
+    }
+    if (options.spill_low > 0) {
+        Spill::Low = options.spill_low;
+    }
+    if (Spill::Low > Spill::High) {
+        cerr << "spill_low can't be above spill_high" << endl;
+        exit(1);
+    }
+    if (options.spill && !Spill::Open(options.spill)) {
+        exit(1);
+    }
+    if (options.snapshot) {
+        Snapshot::SaveTo = absolute_path(options.snapshot);
+    }
+    if (options.restore) {
+        /* Fail before mounting rather than come up empty by surprise */
+        std::string restore = absolute_path(options.restore);
+        if (access(restore.c_str(), F_OK) != 0 && errno == ENOENT) {
+            cout << "No image at " << restore << " yet, starting empty" << endl;
+        } else if (Snapshot::Check(restore.c_str())) {
+            Snapshot::RestoreFrom = restore;
+        } else {
+            exit(1);
+        }
+    }
     
     if (options.subtype) {
         mountpoint = options.mountpoint;
         if (mountpoint == NULL) {
             cerr << "USAGE: fuse-cpp-ramfs MOUNTPOINT" << endl;
         } else if ((ch = fuse_mount(mountpoint, &args)) != NULL) {
+            std::string control;
+            if (options.control) {
+                control = absolute_path(options.control);
+            }
+
             struct fuse_session *se;
             // The FUSE options come from our core code.
             se = fuse_lowlevel_new(&args, &(core.FuseOps),
@@ -72,7 +147,20 @@ int main(int argc, const char * argv[]) {
                 fuse_daemonize(options.deamonize == 0);
                 if (fuse_set_signal_handlers(se) != -1) {
                     fuse_session_add_chan(se, ch);
-                    err = fuse_session_loop(se);
+                    FuseRamFs::SetChannel(ch);
+                    /* After daemonizing: the serving thread wouldn't survive the fork */
+                    if (!control.empty()) {
+                        ControlSocket::Start(control.c_str());
+                    }
+                    size_t nthreads = options.threads;
+                    if (options.single_thread) {
+                        nthreads = 1;
+                    } else if (nthreads == 0) {
+                        nthreads = ramfs_default_threads();
+                    }
+                    err = ramfs_session_loop(se, nthreads);
+                    ControlSocket::Stop();
+                    FuseRamFs::SetChannel(nullptr);
                     fuse_remove_signal_handlers(se);
                     fuse_session_remove_chan(ch);
                 }
@@ -0,0 +1,176 @@
+/** @file metrics.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+
+#include "metrics.hpp"
+#include "data_pool.hpp"
+
+using namespace std;
+
+const char *const Metrics::OpNames[OpCount] = {
+    "init", "destroy", "lookup", "forget", "forget_multi", "getattr", "setattr", "readlink",
+    "mknod", "mkdir", "unlink", "rmdir", "symlink", "rename", "link", "open", "read", "write",
+    "write_buf", "flush", "release", "fsync", "opendir", "readdir", "readdirplus",
+    "releasedir", "fsyncdir", "statfs", "setxattr", "getxattr", "listxattr",
+    "removexattr", "access", "create", "getlk", "ioctl", "copy_file_range",
+};
+
+const char *const Metrics::LockNames[LockCount] = {
+    "rename", "directory", "reclaim", "file_range",
+};
+
+/* Constant-initialized, so threads may record from any static constructor */
+std::atomic<Metrics::ThreadStats *> Metrics::m_all(nullptr);
+
+/* Finds the counters of the calling thread, creating them on first use */
+Metrics::ThreadStats &Metrics::Local() {
+    static thread_local ThreadStats *local = nullptr;
+    if (local == nullptr) {
+        /* Value-initialized: all counters start at zero */
+        local = new ThreadStats();
+        ThreadStats *head = m_all.load();
+        do {
+            local->next = head;
+        } while (!m_all.compare_exchange_weak(head, local));
+    }
+    return *local;
+}
+
+/**
+ Records a request.
+
+ @param op The operation.
+ @param nanoseconds How long it took.
+ */
+void Metrics::RecordRequest(Op op, uint64_t nanoseconds) {
+    ThreadStats &stats = Local();
+    Add(stats.requests[op], 1);
+    Add(stats.nanoseconds[op], nanoseconds);
+    /* The first bucket whose bound, 1us << i, is at least the latency */
+    size_t i = nanoseconds <= 1000 ? 0 : 64 - __builtin_clzll((nanoseconds - 1) / 1000);
+    if (i < Buckets) {
+        Add(stats.buckets[op][i], 1);
+    }
+}
+
+/**
+ Records a wait for a lock which was held by someone else.
+
+ @param lock The lock.
+ @param nanoseconds How long the wait took.
+ */
+void Metrics::RecordLockWait(Lock lock, uint64_t nanoseconds) {
+    ThreadStats &stats = Local();
+    Add(stats.lockWaits[lock], 1);
+    Add(stats.lockNanoseconds[lock], nanoseconds);
+}
+
+/**
+ Sums up the counters of all threads in the Prometheus text format.
+ Operations which haven't been requested yet are left out.
+
+ @return The report.
+ */
+std::string Metrics::Report() {
+    uint64_t requests[OpCount] = {}, nanoseconds[OpCount] = {}, buckets[OpCount][Buckets] = {};
+    uint64_t lockWaits[LockCount] = {}, lockNanoseconds[LockCount] = {};
+    uint64_t counters[CounterCount] = {};
+    for (ThreadStats *stats = m_all.load(); stats != nullptr; stats = stats->next) {
+        for (size_t op = 0; op < OpCount; ++op) {
+            requests[op] += stats->requests[op].load(std::memory_order_relaxed);
+            nanoseconds[op] += stats->nanoseconds[op].load(std::memory_order_relaxed);
+            for (size_t i = 0; i < Buckets; ++i) {
+                buckets[op][i] += stats->buckets[op][i].load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t lock = 0; lock < LockCount; ++lock) {
+            lockWaits[lock] += stats->lockWaits[lock].load(std::memory_order_relaxed);
+            lockNanoseconds[lock] += stats->lockNanoseconds[lock].load(std::memory_order_relaxed);
+        }
+        for (size_t counter = 0; counter < CounterCount; ++counter) {
+            counters[counter] += stats->counters[counter].load(std::memory_order_relaxed);
+        }
+    }
+
+    std::string out;
+    char line[2048];
+    out += "# HELP ramfs_request_duration_seconds Time spent handling FUSE requests.\n"
+           "# TYPE ramfs_request_duration_seconds histogram\n";
+    for (size_t op = 0; op < OpCount; ++op) {
+        if (requests[op] == 0) {
+            continue;
+        }
+        /* The counters are read without stopping the threads, so clamp
+         * the cumulative counts to stay monotonic */
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < Buckets; ++i) {
+            cumulative = std::min(cumulative + buckets[op][i], requests[op]);
+            snprintf(line, sizeof(line), "ramfs_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                     OpNames[op], (double) (1ULL << i) / 1e6, (unsigned long long) cumulative);
+            out += line;
+        }
+        snprintf(line, sizeof(line),
+                 "ramfs_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+                 "ramfs_request_duration_seconds_sum{op=\"%s\"} %.9f\n"
+                 "ramfs_request_duration_seconds_count{op=\"%s\"} %llu\n",
+                 OpNames[op], (unsigned long long) requests[op],
+                 OpNames[op], (double) nanoseconds[op] / 1e9,
+                 OpNames[op], (unsigned long long) requests[op]);
+        out += line;
+    }
+
+    out += "# HELP ramfs_lock_waits_total Times a thread found a lock held and waited.\n"
+           "# TYPE ramfs_lock_waits_total counter\n";
+    for (size_t lock = 0; lock < LockCount; ++lock) {
+        snprintf(line, sizeof(line), "ramfs_lock_waits_total{lock=\"%s\"} %llu\n",
+                 LockNames[lock], (unsigned long long) lockWaits[lock]);
+        out += line;
+    }
+    out += "# HELP ramfs_lock_wait_seconds_total Time threads spent waiting for locks.\n"
+           "# TYPE ramfs_lock_wait_seconds_total counter\n";
+    for (size_t lock = 0; lock < LockCount; ++lock) {
+        snprintf(line, sizeof(line), "ramfs_lock_wait_seconds_total{lock=\"%s\"} %.9f\n",
+                 LockNames[lock], (double) lockNanoseconds[lock] / 1e9);
+        out += line;
+    }
+
+    snprintf(line, sizeof(line),
+             "# HELP ramfs_read_bytes_total Bytes returned by reads.\n"
+             "# TYPE ramfs_read_bytes_total counter\n"
+             "ramfs_read_bytes_total %llu\n"
+             "# HELP ramfs_written_bytes_total Bytes stored by writes.\n"
+             "# TYPE ramfs_written_bytes_total counter\n"
+             "ramfs_written_bytes_total %llu\n"
+             "# HELP ramfs_compressed_pages_total Cold pages compressed.\n"
+             "# TYPE ramfs_compressed_pages_total counter\n"
+             "ramfs_compressed_pages_total %llu\n"
+             "# HELP ramfs_decompressed_pages_total Compressed pages read or written.\n"
+             "# TYPE ramfs_decompressed_pages_total counter\n"
+             "ramfs_decompressed_pages_total %llu\n"
+             "# HELP ramfs_merged_pages_total Pages found identical to another and shared.\n"
+             "# TYPE ramfs_merged_pages_total counter\n"
+             "ramfs_merged_pages_total %llu\n"
+             "# HELP ramfs_spilled_pages_total Pages written out to the spill file.\n"
+             "# TYPE ramfs_spilled_pages_total counter\n"
+             "ramfs_spilled_pages_total %llu\n"
+             "# HELP ramfs_spill_reads_total Pages read back from the spill file.\n"
+             "# TYPE ramfs_spill_reads_total counter\n"
+             "ramfs_spill_reads_total %llu\n"
+             "# HELP ramfs_dedup_saved_bytes Bytes of file data deduplication is saving now.\n"
+             "# TYPE ramfs_dedup_saved_bytes gauge\n"
+             "ramfs_dedup_saved_bytes %lld\n",
+             (unsigned long long) counters[BytesRead],
+             (unsigned long long) counters[BytesWritten],
+             (unsigned long long) counters[PagesCompressed],
+             (unsigned long long) counters[PagesDecompressed],
+             (unsigned long long) counters[PagesMerged],
+             (unsigned long long) counters[PagesSpilled],
+             (unsigned long long) counters[PagesReadBack],
+             (long long) (DataPool::Merged() * DataPool::PageSize));
+    out += line;
+    return out;
+}
@@ -0,0 +1,138 @@
+/** @file metrics.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include "common.h"
+
+/**
+ Counts requests and how long they take, per operation, plus how long
+ threads wait for the locks which serialize operations.
+
+ Every thread records into its own block of counters. Only the owning
+ thread writes a block, so recording takes no locked instructions and
+ touches no cache line another thread writes; Report() merely reads all
+ the blocks. Blocks stay allocated when their thread exits, so nothing
+ counted is lost.
+
+ Latencies go into histogram buckets whose bounds double from 1us.
+ */
+class Metrics {
+public:
+    enum Op {
+        Init, Destroy, Lookup, Forget, ForgetMulti, GetAttr, SetAttr, ReadLink,
+        Mknod, Mkdir, Unlink, Rmdir, Symlink, Rename, Link, Open, Read, Write,
+        WriteBuf, Flush, Release, Fsync, OpenDir, ReadDir, ReadDirPlus,
+        ReleaseDir, FsyncDir, Statfs, SetXAttr, GetXAttr, ListXAttr,
+        RemoveXAttr, Access, Create, GetLock, Ioctl, CopyFileRange,
+        OpCount
+    };
+
+    enum Lock {
+        /* FuseRamFs::renameMutex */
+        RenameLock,
+        /* The directories locked by FuseRamFs::LockDirectories() */
+        DirectoryLock,
+        /* InodeTable::m_retiredMutex */
+        ReclaimLock,
+        /* The page ranges of files, see RangeLock */
+        FileRangeLock,
+        LockCount
+    };
+
+    enum Counter {
+        BytesRead,
+        BytesWritten,
+        /* See Compressor */
+        PagesCompressed,
+        PagesDecompressed,
+        /* See Dedup */
+        PagesMerged,
+        /* See Spill */
+        PagesSpilled,
+        PagesReadBack,
+        CounterCount
+    };
+
+    /* The upper bound of bucket i is 2^i microseconds */
+    static const size_t Buckets = 24;
+
+private:
+    struct alignas(64) ThreadStats {
+        std::atomic<uint64_t> requests[OpCount];
+        std::atomic<uint64_t> nanoseconds[OpCount];
+        std::atomic<uint64_t> buckets[OpCount][Buckets];
+        std::atomic<uint64_t> lockWaits[LockCount];
+        std::atomic<uint64_t> lockNanoseconds[LockCount];
+        std::atomic<uint64_t> counters[CounterCount];
+        ThreadStats *next;
+    };
+
+    static const char *const OpNames[OpCount];
+    static const char *const LockNames[LockCount];
+
+    static std::atomic<ThreadStats *> m_all;
+
+    static ThreadStats &Local();
+    static void Add(std::atomic<uint64_t> &counter, uint64_t n) {
+        /* Only this thread writes the counter */
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+public:
+    static uint64_t Now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    static void RecordRequest(Op op, uint64_t nanoseconds);
+    static void RecordLockWait(Lock lock, uint64_t nanoseconds);
+    static void Count(Counter counter, uint64_t n) { Add(Local().counters[counter], n); }
+
+    /**
+     Locks a mutex, or a unique_lock or shared_lock on one, recording the
+     wait if it is held. An uncontended lock costs a try_lock() only.
+     */
+    template <typename Lockable>
+    static void Acquire(Lockable &lockable, Lock lock) {
+        if (lockable.try_lock()) {
+            return;
+        }
+        uint64_t start = Now();
+        lockable.lock();
+        RecordLockWait(lock, Now() - start);
+    }
+
+    /* Times a request from construction to destruction */
+    class Timer {
+    private:
+        Op m_op;
+        uint64_t m_start;
+
+    public:
+        explicit Timer(Op op) : m_op(op), m_start(Now()) {}
+        ~Timer() { RecordRequest(m_op, Now() - m_start); }
+    };
+
+    /**
+     Wraps a FUSE handler so that every call to it is timed, e.g.
+     Metrics::Timed<Metrics::Lookup, FuseRamFs::FuseLookup>::Call.
+     */
+    template <Op op, auto Handler>
+    struct Timed;
+
+    template <Op op, typename... Args, void (*Handler)(Args...)>
+    struct Timed<op, Handler> {
+        static void Call(Args... args) {
+            Timer timer(op);
+            Handler(args...);
+        }
+    };
+
+    static std::string Report();
+};
+
+#endif /* metrics_hpp */
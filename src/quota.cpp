@@ -0,0 +1,151 @@
+/** @file quota.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+
+#include "quota.hpp"
+#include "inode.hpp"
+#include "inode_table.hpp"
+
+using namespace std;
+
+std::mutex Quota::m_mutex;
+std::vector<std::unique_ptr<Quota>> Quota::m_all;
+
+/**
+ Makes a quota for a directory, without limits yet. The directory is
+ charged to it already, the quotas above already count it. The quota
+ holds a reference for the directory, and one to the quota above.
+
+ @param parent The quota the directory was under, or nullptr.
+ @param root The directory.
+ @param path Where the directory is, for reports.
+ @param blocks The blocks the directory uses.
+ @return The quota, or nullptr if there is no memory for it.
+ */
+Quota *Quota::Create(Quota *parent, fuse_ino_t root, const std::string &path, size_t blocks) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    try {
+        m_all.emplace_back(new Quota(parent, root, path, blocks));
+    } catch (std::bad_alloc &e) {
+        return nullptr;
+    }
+    Hold(parent);
+    return m_all.back().get();
+}
+
+/* Drops a reference, and frees the quota, and maybe the ones above, if it
+ * was the last */
+void Quota::Release(Quota *quota) {
+    while (quota != nullptr && quota->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        Quota *parent = quota->m_parent;
+        std::lock_guard<std::mutex> lk(m_mutex);
+        auto it = std::find_if(m_all.begin(), m_all.end(),
+                               [quota](const std::unique_ptr<Quota> &q) { return q.get() == quota; });
+        if (it != m_all.end()) {
+            m_all.erase(it);
+        }
+        quota = parent;
+    }
+}
+
+void Quota::ChargeAll(Quota *quota, ssize_t blocks, ssize_t inodes) {
+    for (Quota *q = quota; q != nullptr; q = q->m_parent) {
+        if (blocks != 0) {
+            q->m_blocks.fetch_add(blocks, std::memory_order_relaxed);
+        }
+        if (inodes != 0) {
+            q->m_inodes.fetch_add(inodes, std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ Checks whether blocks and inodes may be added under a quota.
+
+ @param quota The quota, or nullptr for none.
+ @param blocks The blocks to add.
+ @param inodes The inodes to add.
+ @return false if that would exceed the limit of the quota or of one
+   above it.
+ */
+bool Quota::Allows(const Quota *quota, size_t blocks, size_t inodes) {
+    for (const Quota *q = quota; q != nullptr; q = q->m_parent) {
+        uint64_t maxBlocks = q->m_maxBlocks.load(std::memory_order_relaxed);
+        uint64_t maxInodes = q->m_maxInodes.load(std::memory_order_relaxed);
+        if (blocks > 0 && maxBlocks > 0 &&
+            q->m_blocks.load(std::memory_order_relaxed) + (int64_t) blocks > (int64_t) maxBlocks) {
+            return false;
+        }
+        if (inodes > 0 && maxInodes > 0 &&
+            q->m_inodes.load(std::memory_order_relaxed) + (int64_t) inodes > (int64_t) maxInodes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ Shrinks what statfs reports to the tightest quota an inode is under, so
+ that df inside a tenant's directory shows the tenant's share.
+
+ @param quota The quota of the inode statfs was asked about, or nullptr.
+ @param[in,out] info The figures of the whole filesystem.
+ */
+void Quota::Limit(const Quota *quota, struct statvfs *info) {
+    for (const Quota *q = quota; q != nullptr; q = q->m_parent) {
+        uint64_t maxBlocks = q->m_maxBlocks.load(std::memory_order_relaxed);
+        uint64_t maxInodes = q->m_maxInodes.load(std::memory_order_relaxed);
+        if (maxBlocks > 0) {
+            uint64_t used = std::max<int64_t>(q->m_blocks.load(std::memory_order_relaxed), 0);
+            uint64_t left = used < maxBlocks ? maxBlocks - used : 0;
+            info->f_blocks = std::min<uint64_t>(info->f_blocks, maxBlocks);
+            info->f_bfree = info->f_bavail = std::min<uint64_t>(info->f_bfree, left);
+        }
+        if (maxInodes > 0) {
+            uint64_t used = std::max<int64_t>(q->m_inodes.load(std::memory_order_relaxed), 0);
+            uint64_t left = used < maxInodes ? maxInodes - used : 0;
+            info->f_files = std::min<uint64_t>(info->f_files, maxInodes);
+            info->f_ffree = info->f_favail = std::min<uint64_t>(info->f_ffree, left);
+        }
+    }
+}
+
+/* One line of usage and limits, in bytes and inodes; 0 is no limit */
+std::string Quota::Describe() const {
+    char line[512];
+    snprintf(line, sizeof(line), "%s: bytes %lld/%llu inodes %lld/%llu\n", m_path.c_str(),
+             (long long) m_blocks.load() * (long long) Inode::BufBlockSize,
+             (unsigned long long) (m_maxBlocks.load() * Inode::BufBlockSize),
+             (long long) m_inodes.load(), (unsigned long long) m_maxInodes.load());
+    return line;
+}
+
+/* Whether the root of the quota is still there. Needs a Guard. */
+bool Quota::IsLive() {
+    Inode *root = InodeTable::Get(m_root);
+    return root != nullptr && !root->HasNoLinks() && root->GetQuota() == this;
+}
+
+/* The usage and limits of every quota whose root is still there */
+std::string Quota::Report() {
+    InodeTable::Guard guard;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    std::string out;
+    for (auto const &q : m_all) {
+        if (q->IsLive()) {
+            out += q->Describe();
+        }
+    }
+    return out;
+}
+
+/* Forgets every quota, once no inode is left to be charged to one. The
+ * last inode to go has normally freed them already. */
+void Quota::Clear() {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    std::vector<std::unique_ptr<Quota>>().swap(m_all);
+}
@@ -0,0 +1,98 @@
+/** @file quota.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef quota_hpp
+#define quota_hpp
+
+#include "common.h"
+
+#include <memory>
+
+/**
+ A limit on the blocks and inodes of a directory and everything below it,
+ so that many tenants can share one mount.
+
+ A quota is attached to an empty directory, its root. Every inode made in
+ the root or anywhere below it counts against the quota, and so do the
+ quotas of directories below it: quotas nest, and a block counts against
+ every quota it is under. Each inode is charged for itself and for its
+ st_blocks as they change, so the usage of a quota is always at hand
+ without walking the tree.
+
+ Limits are checked before a file grows by new pages, a directory by new
+ entries, or an inode is made, and the request fails with EDQUOT if any
+ enclosing quota would be exceeded. Writers which pass the check at the
+ same time may overshoot a limit by what they write. Renames and links
+ from one quota to another fail with EXDEV, as with XFS project quotas,
+ so that charges never have to move; mv copies instead.
+
+ A quota is referenced by every inode under it directly and by every
+ quota nested in it, and is freed when the last of them goes; inodes drop
+ their reference only when they are deleted, once no request can still
+ reach them. One whose root was removed isn't reported, even while
+ removed inodes still in use keep it.
+ */
+class Quota {
+private:
+    Quota *const m_parent;
+    const fuse_ino_t m_root;
+    /* The path the quota was attached at, for reports */
+    const std::string m_path;
+    /* In Inode::BufBlockSize blocks; 0 for no limit */
+    std::atomic<uint64_t> m_maxBlocks;
+    std::atomic<uint64_t> m_maxInodes;
+    std::atomic<int64_t> m_blocks;
+    std::atomic<int64_t> m_inodes;
+    /* Inodes and nested quotas referring to this one */
+    std::atomic<uint64_t> m_refs;
+
+    static std::mutex m_mutex;
+    /* Guarded by m_mutex */
+    static std::vector<std::unique_ptr<Quota>> m_all;
+
+    static void ChargeAll(Quota *quota, ssize_t blocks, ssize_t inodes);
+    bool IsLive();
+
+public:
+    Quota(Quota *parent, fuse_ino_t root, const std::string &path, size_t blocks) :
+    m_parent(parent),
+    m_root(root),
+    m_path(path),
+    m_maxBlocks(0),
+    m_maxInodes(0),
+    m_blocks(blocks),
+    m_inodes(1),
+    m_refs(1)
+    {}
+
+    static Quota *Create(Quota *parent, fuse_ino_t root, const std::string &path, size_t blocks);
+    static void Hold(Quota *quota) {
+        if (quota != nullptr) {
+            quota->m_refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static void Release(Quota *quota);
+    void SetLimits(uint64_t blocks, uint64_t inodes) {
+        m_maxBlocks = blocks;
+        m_maxInodes = inodes;
+    }
+    Quota *Parent() const { return m_parent; }
+    fuse_ino_t Root() const { return m_root; }
+    std::string Describe() const;
+
+    /* Whether every quota from this one up has room for more */
+    static bool Allows(const Quota *quota, size_t blocks, size_t inodes);
+    /* Counts blocks and inodes against every quota from this one up */
+    static void Charge(Quota *quota, ssize_t blocks, ssize_t inodes) {
+        if (quota != nullptr) {
+            ChargeAll(quota, blocks, inodes);
+        }
+    }
+    static void Limit(const Quota *quota, struct statvfs *info);
+
+    static std::string Report();
+    static void Clear();
+};
+
+#endif /* quota_hpp */
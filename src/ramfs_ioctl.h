@@ -0,0 +1,32 @@
+/** @file ramfs_ioctl.h
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ *
+ *  The ioctls understood by fuse-cpp-ramfs. Plain C so that tools can
+ *  include it.
+ */
+
+#ifndef _RAMFS_IOCTL_H
+#define _RAMFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ Clones a range of one file into the file the ioctl is issued on. Whole
+ pages are shared copy-on-write, the rest is copied.
+
+ FUSE can't pass a file descriptor through, so unlike FICLONERANGE the
+ source is named by its inode number, as in st_ino. The caller must have
+ read permission on the source and write permission on the destination,
+ or fails with EACCES.
+ */
+struct ramfs_clone_range {
+    uint64_t src_ino;
+    uint64_t src_offset;
+    uint64_t src_length;    /* 0 clones up to the end of the source */
+    uint64_t dest_offset;
+};
+
+#define RAMFS_IOC_CLONE_RANGE _IOW('R', 1, struct ramfs_clone_range)
+
+#endif /* _RAMFS_IOCTL_H */
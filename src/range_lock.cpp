@@ -0,0 +1,60 @@
+/** @file range_lock.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include "range_lock.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+/* Whether a held range overlaps [first, end) and either side is exclusive */
+bool RangeLock::Conflicts(size_t first, size_t end, bool exclusive) {
+    for (const Range &r : m_held) {
+        if (r.first < end && first < r.end && (exclusive || r.exclusive)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ Waits until pages [first, end) can be held, and holds them.
+
+ @param first The first page.
+ @param end One past the last page.
+ @param exclusive Whether to keep all others out, rather than writers only.
+ */
+void RangeLock::Lock(size_t first, size_t end, bool exclusive) {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    if (Conflicts(first, end, exclusive)) {
+        uint64_t start = Metrics::Now();
+        ++m_waiters;
+        m_released.wait(lk, [&] { return !Conflicts(first, end, exclusive); });
+        --m_waiters;
+        Metrics::RecordLockWait(Metrics::FileRangeLock, Metrics::Now() - start);
+    }
+    m_held.push_back({first, end, exclusive});
+}
+
+/**
+ Releases a range taken with Lock(), with the same arguments.
+ */
+void RangeLock::Unlock(size_t first, size_t end, bool exclusive) {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    for (size_t i = 0; i < m_held.size(); ++i) {
+        const Range &r = m_held[i];
+        if (r.first == first && r.end == end && r.exclusive == exclusive) {
+            m_held[i] = m_held.back();
+            m_held.pop_back();
+            break;
+        }
+    }
+    bool wake = m_waiters > 0;
+    lk.unlock();
+    /* Waiters recheck their own ranges; this may have been any of them */
+    if (wake) {
+        m_released.notify_all();
+    }
+}
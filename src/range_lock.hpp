@@ -0,0 +1,61 @@
+/** @file range_lock.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef range_lock_hpp
+#define range_lock_hpp
+
+#include "common.h"
+
+#include <condition_variable>
+
+/**
+ Locks ranges of a file's pages, shared for reading or exclusively for
+ writing. Ranges which don't overlap never wait for each other, so
+ writers to different parts of a file proceed in parallel.
+
+ Held ranges are kept in a short list guarded by a mutex; a request
+ waits until no overlapping range conflicts with it. There is no
+ queueing, so a steady stream of readers may keep a writer waiting.
+ */
+class RangeLock {
+private:
+    struct Range {
+        size_t first;
+        size_t end;
+        bool exclusive;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+    std::vector<Range> m_held;
+    size_t m_waiters;
+
+    bool Conflicts(size_t first, size_t end, bool exclusive);
+
+public:
+    RangeLock() : m_waiters(0) {}
+
+    void Lock(size_t first, size_t end, bool exclusive);
+    void Unlock(size_t first, size_t end, bool exclusive);
+
+    /* Holds pages [first, end) from construction to destruction */
+    class Guard {
+    private:
+        RangeLock &m_lock;
+        size_t m_first;
+        size_t m_end;
+        bool m_exclusive;
+
+    public:
+        Guard(RangeLock &lock, size_t first, size_t end, bool exclusive) :
+        m_lock(lock), m_first(first), m_end(end), m_exclusive(exclusive) {
+            m_lock.Lock(first, end, exclusive);
+        }
+        ~Guard() { m_lock.Unlock(m_first, m_end, m_exclusive); }
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+};
+
+#endif /* range_lock_hpp */
@@ -0,0 +1,177 @@
+/** @file session_loop.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <thread>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+
+#include "inode_table.hpp"
+#include "session_loop.hpp"
+
+using namespace std;
+
+/* State shared by every worker of one session loop */
+struct ramfs_loop {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    size_t bufsize;
+    sem_t finish;
+    std::atomic<int> error;
+};
+
+/* Each worker owns its receive buffer, so requests read by different
+ * threads never share memory until they reach the filesystem code. */
+struct ramfs_worker {
+    pthread_t thread;
+    struct ramfs_loop *loop;
+    char *buf;
+};
+
+/* ramfs_process_requests: Receive and dispatch requests until the session exits
+ *
+ * @param[in] w:        The worker whose buffer receives the requests
+ * @param[in] cancel:   Whether the worker may be cancelled while waiting
+ */
+static void ramfs_process_requests(struct ramfs_worker *w, bool cancel) {
+    struct ramfs_loop *loop = w->loop;
+
+    while (!fuse_session_exited(loop->se)) {
+        struct fuse_chan *ch = loop->ch;
+        struct fuse_buf fbuf = {};
+        fbuf.mem = w->buf;
+        fbuf.size = loop->bufsize;
+
+        /* Only allow cancellation while blocked on /dev/fuse so that a
+         * request is never abandoned halfway through its handler. */
+        if (cancel) {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        }
+        int res = fuse_session_receive_buf(loop->se, &fbuf, &ch);
+        if (cancel) {
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        }
+
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(loop->se);
+                loop->error = -1;
+            }
+            break;
+        }
+
+        /* Inodes this request looks up stay alive until it's done */
+        InodeTable::Guard guard;
+        fuse_session_process_buf(loop->se, &fbuf, ch);
+    }
+}
+
+static void *ramfs_worker_main(void *arg) {
+    struct ramfs_worker *w = (struct ramfs_worker *) arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    ramfs_process_requests(w, true);
+    sem_post(&w->loop->finish);
+    return NULL;
+}
+
+/* ramfs_default_threads: Worker count used when threads= is not given
+ *
+ * @return: The number of online CPUs, capped at RAMFS_DEFAULT_MAX_THREADS.
+ */
+size_t ramfs_default_threads() {
+    size_t ncpus = std::thread::hardware_concurrency();
+    if (ncpus == 0) {
+        return 1;
+    }
+    return ncpus < RAMFS_DEFAULT_MAX_THREADS ? ncpus : RAMFS_DEFAULT_MAX_THREADS;
+}
+
+/* ramfs_session_loop: Serve a FUSE session on a fixed pool of workers
+ *
+ * @param[in] se:       The session, with its channel already attached
+ * @param[in] nthreads: Number of workers. With a single worker all the
+ *                      requests are served on the calling thread.
+ *
+ * Every worker blocks on the session channel with its own receive buffer;
+ * the kernel hands each pending request to exactly one reader. Workers
+ * run with all signals blocked so that the signal handlers installed by
+ * fuse_set_signal_handlers() always interrupt the calling thread, which
+ * then tears the pool down.
+ *
+ * @return: 0 on success, -1 if reading from the channel failed.
+ */
+int ramfs_session_loop(struct fuse_session *se, size_t nthreads) {
+    struct ramfs_loop loop;
+    loop.se = se;
+    loop.ch = fuse_session_next_chan(se, NULL);
+    loop.bufsize = fuse_chan_bufsize(loop.ch);
+    loop.error = 0;
+
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+
+    vector<struct ramfs_worker> workers(nthreads);
+    for (auto &w : workers) {
+        w.loop = &loop;
+        w.buf = (char *) malloc(loop.bufsize);
+        if (w.buf == NULL) {
+            fprintf(stderr, "fuse-cpp-ramfs: failed to allocate read buffer\n");
+            for (auto &allocated : workers) {
+                free(allocated.buf);
+            }
+            return -1;
+        }
+    }
+
+    if (nthreads == 1) {
+        ramfs_process_requests(&workers[0], false);
+        free(workers[0].buf);
+        fuse_session_reset(se);
+        return loop.error;
+    }
+
+    sem_init(&loop.finish, 0, 0);
+
+    sigset_t newset, oldset;
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    size_t started = 0;
+    for (auto &w : workers) {
+        int res = pthread_create(&w.thread, NULL, ramfs_worker_main, &w);
+        if (res != 0) {
+            fprintf(stderr, "fuse-cpp-ramfs: failed to start worker: %s\n", strerror(res));
+            fuse_session_exit(se);
+            loop.error = -1;
+            break;
+        }
+        ++started;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    /* Sleep until a worker quits or a signal ends the session */
+    while (!fuse_session_exited(se)) {
+        sem_wait(&loop.finish);
+    }
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_cancel(workers[i].thread);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (auto &w : workers) {
+        free(w.buf);
+    }
+    sem_destroy(&loop.finish);
+
+    fuse_session_reset(se);
+    return loop.error;
+}
@@ -0,0 +1,16 @@
+/** @file session_loop.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef session_loop_hpp
+#define session_loop_hpp
+
+#include "common.h"
+
+/* Upper bound on the worker count picked when threads= is not given */
+#define RAMFS_DEFAULT_MAX_THREADS   16
+
+size_t ramfs_default_threads();
+int ramfs_session_loop(struct fuse_session *se, size_t nthreads);
+
+#endif /* session_loop_hpp */
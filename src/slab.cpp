@@ -0,0 +1,110 @@
+/** @file slab.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include "slab.hpp"
+
+using namespace std;
+
+/* Constant-initialized, so slabs may register from any static constructor */
+Slab *Slab::m_all = nullptr;
+
+/**
+ Creates a slab. Slabs are meant to be static and live for the whole run.
+
+ @param name The name shown in Report().
+ @param objectSize The size of the objects.
+ */
+Slab::Slab(const char *name, size_t objectSize) :
+    m_name(name),
+    m_objectSize(round_up(std::max(objectSize, sizeof(void *)), alignof(std::max_align_t))),
+    m_free(nullptr),
+    m_inUse(0) {
+    m_perChunk = std::max<size_t>(ChunkBytes / m_objectSize, 1);
+    /* No locking: static constructors run on one thread */
+    m_nextSlab = m_all;
+    m_all = this;
+}
+
+Slab::~Slab() {
+    for (char *chunk : m_chunks) {
+        ::operator delete(chunk);
+    }
+}
+
+/* Adds a chunk of free objects. The caller holds m_mutex. */
+bool Slab::Grow() {
+    char *chunk;
+    try {
+        m_chunks.reserve(m_chunks.size() + 1);
+        chunk = (char *) ::operator new(m_perChunk * m_objectSize);
+    } catch (std::bad_alloc &e) {
+        return false;
+    }
+    m_chunks.push_back(chunk);
+    for (size_t i = m_perChunk; i-- > 0; ) {
+        void *obj = chunk + i * m_objectSize;
+        *(void **) obj = m_free;
+        m_free = obj;
+    }
+    return true;
+}
+
+/**
+ Allocates an object.
+
+ @param size The size asked of operator new; at most the slab's object size.
+ @return The object.
+ @throws std::bad_alloc if no memory is left.
+ */
+void *Slab::Alloc(size_t size) {
+    if (size > m_objectSize) {
+        throw std::bad_alloc();
+    }
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (m_free == nullptr && !Grow()) {
+        throw std::bad_alloc();
+    }
+    void *obj = m_free;
+    m_free = *(void **) obj;
+    ++m_inUse;
+    return obj;
+}
+
+void Slab::Free(void *obj) {
+    if (obj == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(m_mutex);
+    *(void **) obj = m_free;
+    m_free = obj;
+    --m_inUse;
+}
+
+/**
+ Describes the usage of every slab, one line each:
+ name, object size, objects in use, objects allocated, bytes allocated.
+
+ @return The report.
+ */
+std::string Slab::Report() {
+    std::string out = "# slab objsize inuse total bytes\n";
+    for (Slab *slab = m_all; slab != nullptr; slab = slab->m_nextSlab) {
+        size_t inUse, total;
+        {
+            std::lock_guard<std::mutex> lk(slab->m_mutex);
+            inUse = slab->m_inUse;
+            total = slab->m_chunks.size() * slab->m_perChunk;
+        }
+        char line[256];
+        snprintf(line, sizeof(line), "%s %zu %zu %zu %zu\n", slab->m_name,
+                 slab->m_objectSize, inUse, total, total * slab->m_objectSize);
+        out += line;
+    }
+    return out;
+}
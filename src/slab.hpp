@@ -0,0 +1,53 @@
+/** @file slab.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef slab_hpp
+#define slab_hpp
+
+#include "common.h"
+
+/**
+ Hands out objects of one size from large chunks.
+
+ Each inode type allocates from its own slab through a class-specific
+ operator new, so millions of small files take a few big allocations
+ instead of one heap block each, and freed objects are reused for the
+ same type rather than fragmenting the heap. Chunks are only returned
+ when the slab itself goes away.
+ */
+class Slab {
+public:
+    /* Bytes carved into objects per chunk */
+    static const size_t ChunkBytes = 64 * 1024;
+
+private:
+    const char *m_name;
+    size_t m_objectSize;
+    size_t m_perChunk;
+
+    std::mutex m_mutex;
+    /* Free objects, linked through their first word */
+    void *m_free;
+    std::vector<char *> m_chunks;
+    size_t m_inUse;
+
+    /* Every slab, for Report() */
+    static Slab *m_all;
+    Slab *m_nextSlab;
+
+    bool Grow();
+
+public:
+    Slab(const char *name, size_t objectSize);
+    ~Slab();
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    void *Alloc(size_t size);
+    void Free(void *obj);
+
+    static std::string Report();
+};
+
+#endif /* slab_hpp */
@@ -0,0 +1,362 @@
+/** @file snapshot.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include "inode.hpp"
+#include "file.hpp"
+#include "directory.hpp"
+#include "special_inode.hpp"
+#include "symlink.hpp"
+#include "fuse_cpp_ramfs.hpp"
+#include "data_pool.hpp"
+#include "snapshot.hpp"
+
+using namespace std;
+
+std::string Snapshot::SaveTo;
+std::string Snapshot::RestoreFrom;
+const char Snapshot::Magic[8] = {'R', 'A', 'M', 'F', 'S', 'I', 'M', 'G'};
+char *Snapshot::m_image = nullptr;
+size_t Snapshot::m_imageSize = 0;
+
+/**
+ Adds a page to the image.
+
+ @param page The page.
+ @param mayRecur false if the page is a copy no other file can refer to.
+ @return The number of the page in the image.
+ */
+uint64_t ImageWriter::PutPage(const char *page, bool mayRecur) {
+    /* Only pages with other owners can turn up twice */
+    bool shared = mayRecur && (!DataPool::Contains(page) || DataPool::IsShared(page));
+    if (shared) {
+        auto it = m_shared.find(page);
+        if (it != m_shared.end()) {
+            return it->second;
+        }
+    }
+    uint64_t n = m_pages++;
+    if (fwrite(page, DataPool::PageSize, 1, m_data) != 1) {
+        m_failed = true;
+    }
+    if (shared) {
+        try {
+            m_shared[page] = n;
+        } catch (std::bad_alloc &e) {
+            /* It is merely stored again next time */
+        }
+    }
+    return n;
+}
+
+bool ImageReader::Get(void *out, size_t size) {
+    if (!m_ok || (size_t) (m_end - m_pos) < size) {
+        m_ok = false;
+        return false;
+    }
+    memcpy(out, m_pos, size);
+    m_pos += size;
+    return true;
+}
+
+bool ImageReader::GetString(std::string &str) {
+    uint32_t size;
+    if (!GetU32(size) || (size_t) (m_end - m_pos) < size) {
+        m_ok = false;
+        return false;
+    }
+    try {
+        str.assign(m_pos, size);
+    } catch (std::bad_alloc &e) {
+        m_ok = false;
+        return false;
+    }
+    m_pos += size;
+    return true;
+}
+
+/**
+ Reads a page number and finds the page in the image.
+
+ @return The page, or nullptr if the number is out of range.
+ */
+const char *ImageReader::GetPage() {
+    uint64_t n;
+    if (!GetU64(n) || n >= m_npages) {
+        m_ok = false;
+        return nullptr;
+    }
+    return m_pages + n * DataPool::PageSize;
+}
+
+/**
+ Reads the length of a record and splits the record off.
+
+ @return A reader for the record.
+ */
+ImageReader ImageReader::GetRecord() {
+    uint64_t size;
+    if (!GetU64(size) || (uint64_t) (m_end - m_pos) < size) {
+        m_ok = false;
+        ImageReader bad(m_pos, 0, m_pages, m_npages);
+        bad.m_ok = false;
+        return bad;
+    }
+    ImageReader record(m_pos, size, m_pages, m_npages);
+    m_pos += size;
+    return record;
+}
+
+/* The size of a record, its inode number and its mode */
+static const uint64_t MinRecordSize = 8 + 8 + 4;
+
+bool Snapshot::CheckHeader(const Header &header, size_t fileSize, const char *path) {
+    const char *problem = nullptr;
+    if (fileSize < sizeof(Header) || memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+        problem = "not a fuse-cpp-ramfs image";
+    } else if (header.version != Version) {
+        problem = "unsupported image version";
+    } else if (header.pageSize != DataPool::PageSize) {
+        problem = "the image was written with another page size";
+    } else if (header.pages >= fileSize / DataPool::PageSize ||
+               header.recordsOffset != (1 + header.pages) * DataPool::PageSize ||
+               header.recordsOffset > fileSize ||
+               header.recordsSize > fileSize - header.recordsOffset) {
+        problem = "the image is truncated";
+    } else if (header.inodes > header.recordsSize / MinRecordSize) {
+        /* Restore() sizes its list of inodes by the count */
+        problem = "the image is damaged";
+    }
+    if (problem != nullptr) {
+        fprintf(stderr, "fuse-cpp-ramfs: %s: %s\n", path, problem);
+        return false;
+    }
+    return true;
+}
+
+/**
+ Tells whether a file looks like an image which can be restored, without
+ reading more than its header.
+
+ @param path The image.
+ @return true if it does. Otherwise the reason is printed.
+ */
+bool Snapshot::Check(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    Header header = {};
+    if (fd < 0 || fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) < 0) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot read image %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    return CheckHeader(header, st.st_size, path);
+}
+
+/**
+ Writes an image of the filesystem. The image is written next to the
+ path and renamed over it once complete, so an existing image, perhaps
+ one the filesystem is still reading from, stays intact until then.
+
+ @param path Where to write the image.
+ @return true on success. Otherwise the reason is printed.
+ */
+bool Snapshot::Save(const char *path) {
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *data = fd >= 0 ? fdopen(fd, "w+") : nullptr;
+    /* Records are collected apart and copied in after the pages */
+    FILE *records = tmpfile();
+    bool ok = data != nullptr && records != nullptr;
+
+    Header header = {};
+    ImageWriter out(data);
+    ok = ok && fseeko(data, DataPool::PageSize, SEEK_SET) == 0;
+    for (fuse_ino_t ino = FUSE_ROOT_ID; ok && ino < InodeTable::Limit(); ++ino) {
+        Inode *inode = InodeTable::Get(ino);
+        if (inode == nullptr || inode->HasNoLinks()) {
+            continue;
+        }
+        std::string &record = out.Record();
+        record.clear();
+        out.PutU64(ino);
+        out.PutU32(inode->GetMode());
+        inode->Save(out);
+
+        uint64_t size = record.size();
+        ok = fwrite(&size, sizeof(size), 1, records) == 1 &&
+             fwrite(record.data(), 1, size, records) == size;
+        ++header.inodes;
+    }
+    ok = ok && !out.Failed();
+
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.pageSize = DataPool::PageSize;
+    header.pages = out.Pages();
+    header.recordsOffset = (1 + header.pages) * DataPool::PageSize;
+    if (ok) {
+        header.recordsSize = ftello(records);
+        rewind(records);
+        char buf[64 * 1024];
+        size_t n;
+        while (ok && (n = fread(buf, 1, sizeof(buf), records)) > 0) {
+            ok = fwrite(buf, 1, n, data) == n;
+        }
+        ok = ok && !ferror(records);
+    }
+    ok = ok && fseeko(data, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, data) == 1 &&
+         fflush(data) == 0 && fsync(fileno(data)) == 0;
+
+    int err = errno;
+    if (records != nullptr) {
+        fclose(records);
+    }
+    if (data != nullptr) {
+        ok = fclose(data) == 0 && ok;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (ok && rename(tmp.c_str(), path) != 0) {
+        err = errno;
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot write image %s: %s\n", path, strerror(err));
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+/* Creates an empty inode of the type a mode stands for */
+static Inode *NewInode(mode_t mode) {
+    if (S_ISREG(mode)) {
+        return new File();
+    } else if (S_ISDIR(mode)) {
+        return new Directory();
+    } else if (S_ISLNK(mode)) {
+        return new SymLink(std::string());
+    } else if (S_ISCHR(mode)) {
+        return new SpecialInode(SPECIAL_INODE_CHAR_DEV);
+    } else if (S_ISBLK(mode)) {
+        return new SpecialInode(SPECIAL_INODE_BLOCK_DEV);
+    } else if (S_ISFIFO(mode)) {
+        return new SpecialInode(SPECIAL_INODE_FIFO);
+    } else if (S_ISSOCK(mode)) {
+        return new SpecialInode(SPECIAL_INODE_SOCK);
+    }
+    return nullptr;
+}
+
+/**
+ Fills the inode table from an image. Inodes keep their numbers. The
+ image stays mapped until Unmap(). The table must hold nothing but
+ inode 0.
+
+ @param path The image.
+ @return true on success. Otherwise the reason is printed and the table
+ is left as it was.
+ */
+bool Snapshot::Restore(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot read image %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    void *image = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot map image %s: %s\n", path,
+                st.st_size > 0 ? strerror(errno) : "empty file");
+        return false;
+    }
+    m_image = (char *) image;
+    m_imageSize = st.st_size;
+
+    Header header = {};
+    memcpy(&header, m_image, std::min(sizeof(header), m_imageSize));
+    if (!CheckHeader(header, m_imageSize, path)) {
+        Unmap();
+        return false;
+    }
+
+    ImageReader in(m_image + header.recordsOffset, header.recordsSize,
+                   m_image + DataPool::PageSize, header.pages);
+    std::vector<fuse_ino_t> restored;
+    size_t inodes = 0, blocks = 0;
+    const char *problem = nullptr;
+    try {
+        restored.reserve(header.inodes);
+        for (uint64_t n = 0; n < header.inodes; ++n) {
+            ImageReader record = in.GetRecord();
+            uint64_t ino;
+            uint32_t mode;
+            Inode *inode = nullptr;
+            if (!record.GetU64(ino) || !record.GetU32(mode) || ino == 0 ||
+                (inode = NewInode(mode)) == nullptr) {
+                problem = "the image is damaged";
+                break;
+            }
+            if (!InodeTable::Put(ino, inode)) {
+                delete inode;
+                problem = "the image is damaged";
+                break;
+            }
+            restored.push_back(ino);
+            if (!inode->Load(record, ino, mode) || !record.AtEnd()) {
+                problem = "the image is damaged";
+                break;
+            }
+            if (!FuseRamFs::ReserveInode()) {
+                problem = "the image holds more inodes than the filesystem";
+                break;
+            }
+            ++inodes;
+            if (!FuseRamFs::ReserveBlocks(inode->UsedBlocks())) {
+                problem = "the image does not fit into the filesystem";
+                break;
+            }
+            blocks += inode->UsedBlocks();
+        }
+    } catch (std::bad_alloc &e) {
+        problem = "out of memory";
+    }
+    if (problem == nullptr && inode_cast<Directory>(InodeTable::Get(FUSE_ROOT_ID)) == nullptr) {
+        problem = "the image has no root directory";
+    }
+
+    if (problem != nullptr) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot restore %s: %s\n", path, problem);
+        /* The inodes only point at the image's pages; deleting them later
+         * doesn't read the pages */
+        for (fuse_ino_t ino : restored) {
+            InodeTable::Retire(ino);
+        }
+        FuseRamFs::UpdateUsedInodes(-(ssize_t) inodes);
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) blocks);
+        Unmap();
+        return false;
+    }
+
+    InodeTable::ReleaseUnused();
+    return true;
+}
+
+/* Unmaps a restored image. No inode may refer to its pages any more. */
+void Snapshot::Unmap() {
+    if (m_image != nullptr) {
+        munmap(m_image, m_imageSize);
+        m_image = nullptr;
+        m_imageSize = 0;
+    }
+}
@@ -0,0 +1,119 @@
+/** @file snapshot.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef snapshot_hpp
+#define snapshot_hpp
+
+#include "common.h"
+
+/**
+ Collects the records and pages of an image as Snapshot::Save() walks the
+ inodes. Each inode type writes its own record through Inode::Save().
+ */
+class ImageWriter {
+private:
+    FILE *m_data;
+    std::string m_record;
+    uint64_t m_pages;
+    /* Pages which more than one file may refer to, stored only once */
+    std::unordered_map<const char *, uint64_t> m_shared;
+    bool m_failed;
+
+public:
+    explicit ImageWriter(FILE *data) : m_data(data), m_pages(0), m_failed(false) {}
+
+    void Put(const void *data, size_t size) { m_record.append((const char *) data, size); }
+    void PutU32(uint32_t value) { Put(&value, sizeof(value)); }
+    void PutU64(uint64_t value) { Put(&value, sizeof(value)); }
+    void PutString(const char *data, size_t size) {
+        PutU32(size);
+        Put(data, size);
+    }
+    void PutString(const std::string &str) { PutString(str.data(), str.size()); }
+    uint64_t PutPage(const char *page, bool mayRecur = true);
+
+    std::string &Record() { return m_record; }
+    uint64_t Pages() { return m_pages; }
+    bool Failed() { return m_failed; }
+};
+
+/**
+ Reads the records of a mapped image. Every read is checked against the
+ end of the record; once one fails, all later ones do too.
+ */
+class ImageReader {
+private:
+    const char *m_pos;
+    const char *m_end;
+    const char *m_pages;
+    uint64_t m_npages;
+    bool m_ok;
+
+public:
+    ImageReader(const char *data, size_t size, const char *pages, uint64_t npages) :
+    m_pos(data), m_end(data + size), m_pages(pages), m_npages(npages), m_ok(true) {}
+
+    bool Get(void *out, size_t size);
+    bool GetU32(uint32_t &value) { return Get(&value, sizeof(value)); }
+    bool GetU64(uint64_t &value) { return Get(&value, sizeof(value)); }
+    bool GetString(std::string &str);
+    const char *GetPage();
+    ImageReader GetRecord();
+
+    bool Ok() { return m_ok; }
+    bool AtEnd() { return m_pos == m_end; }
+};
+
+/**
+ Saves the whole filesystem to an image file and restores it from one.
+
+ An image starts with a header page, followed by the file pages and then
+ by one record per inode:
+   - Header: magic, version, page size, the number of records and pages,
+     and where the records start.
+   - Pages: whole pages at page-aligned offsets. A page several files
+     share is stored once.
+   - Records: length, inode number, mode, then what Inode::Save() and
+     the inode type add: attributes, xattrs, and the file pages, the
+     directory entries or the symlink target.
+ Numbers are in the byte order of the machine which wrote the image.
+
+ Restoring maps the image and lets files point straight at its pages, so
+ contents are read from disk only as they are first read. A write copies
+ the page into the data pool first, as for a shared page.
+ */
+class Snapshot {
+public:
+    /* Set these before the filesystem is initialized */
+    static std::string SaveTo;
+    static std::string RestoreFrom;
+
+private:
+    static const char Magic[8];
+    static const uint32_t Version = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t pageSize;
+        uint64_t inodes;
+        uint64_t pages;
+        uint64_t recordsOffset;
+        uint64_t recordsSize;
+    };
+
+    /* The restored image, mapped until Unmap() */
+    static char *m_image;
+    static size_t m_imageSize;
+
+    static bool CheckHeader(const Header &header, size_t fileSize, const char *path);
+
+public:
+    static bool Check(const char *path);
+    static bool Save(const char *path);
+    static bool Restore(const char *path);
+    static void Unmap();
+};
+
+#endif /* snapshot_hpp */
@@ -0,0 +1,148 @@
+/** @file space_counter.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+
+#include "space_counter.hpp"
+
+using namespace std;
+
+/* Threads are spread over the shards in the order they first show up */
+static std::atomic<size_t> nextShard(0);
+
+SpaceCounter::SpaceCounter(int64_t batch) : m_pool(0), m_batch(batch) {
+    for (size_t i = 0; i < Shards; ++i) {
+        m_shards[i].budget.store(0, std::memory_order_relaxed);
+    }
+}
+
+SpaceCounter::Shard &SpaceCounter::Local() {
+    static thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % Shards;
+    return m_shards[shard];
+}
+
+/**
+ Sets the number of free units. Only safe while no other thread uses the
+ counter.
+
+ @param total The number of free units.
+ */
+void SpaceCounter::Reset(int64_t total) {
+    for (size_t i = 0; i < Shards; ++i) {
+        m_shards[i].budget.store(0, std::memory_order_relaxed);
+    }
+    m_pool.store(total);
+}
+
+bool SpaceCounter::TakeFromShard(Shard &shard, int64_t n) {
+    int64_t budget = shard.budget.load(std::memory_order_relaxed);
+    while (budget >= n) {
+        if (shard.budget.compare_exchange_weak(budget, budget - n, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ Takes units from the pool, plus a batch for the shard while the pool has
+ plenty left.
+
+ @param shard The shard of the calling thread.
+ @param n The number of units wanted.
+ @return Whether the pool had n units.
+ */
+bool SpaceCounter::TakeFromPool(Shard &shard, int64_t n) {
+    int64_t pool = m_pool.load(std::memory_order_relaxed);
+    int64_t take;
+    do {
+        if (pool < n) {
+            return false;
+        }
+        take = (pool - n >= (int64_t) Shards * m_batch) ? n + m_batch : n;
+    } while (!m_pool.compare_exchange_weak(pool, pool - take, std::memory_order_relaxed));
+
+    if (take > n) {
+        shard.budget.fetch_add(take - n, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+/* Moves everything the shards hold back to the pool */
+void SpaceCounter::Drain() {
+    for (size_t i = 0; i < Shards; ++i) {
+        int64_t budget = m_shards[i].budget.exchange(0, std::memory_order_relaxed);
+        if (budget != 0) {
+            m_pool.fetch_add(budget, std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ Reserves units if enough of them are free.
+
+ @param n The number of units.
+ @return Whether they were reserved.
+ */
+bool SpaceCounter::Reserve(int64_t n) {
+    if (n <= 0) {
+        return true;
+    }
+    Shard &shard = Local();
+    if (TakeFromShard(shard, n) || TakeFromPool(shard, n)) {
+        return true;
+    }
+    /* The pool is short; the other shards may still hold enough */
+    Drain();
+    return TakeFromPool(shard, n);
+}
+
+/**
+ Gives units back.
+
+ @param n The number of units.
+ */
+void SpaceCounter::Release(int64_t n) {
+    if (n <= 0) {
+        return;
+    }
+    /* Near the limit, keep everything where any thread can get at it */
+    if (m_pool.load(std::memory_order_relaxed) < (int64_t) Shards * m_batch) {
+        m_pool.fetch_add(n, std::memory_order_relaxed);
+        return;
+    }
+    Shard &shard = Local();
+    int64_t budget = shard.budget.fetch_add(n, std::memory_order_relaxed) + n;
+    if (budget > 2 * m_batch && TakeFromShard(shard, budget - m_batch)) {
+        m_pool.fetch_add(budget - m_batch, std::memory_order_relaxed);
+    }
+}
+
+/**
+ Uses up units whether or not they are free, for space which has already
+ been committed to. The count may drop below zero.
+
+ @param n The number of units.
+ */
+void SpaceCounter::Charge(int64_t n) {
+    if (!Reserve(n)) {
+        m_pool.fetch_sub(n, std::memory_order_relaxed);
+    }
+}
+
+/**
+ Counts the free units. The answer is exact when the counter is not
+ being updated at the same time.
+
+ @return The number of free units, never less than zero.
+ */
+int64_t SpaceCounter::Free() {
+    int64_t free = m_pool.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < Shards; ++i) {
+        free += m_shards[i].budget.load(std::memory_order_relaxed);
+    }
+    return std::max<int64_t>(free, 0);
+}
@@ -0,0 +1,52 @@
+/** @file space_counter.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef space_counter_hpp
+#define space_counter_hpp
+
+#include "common.h"
+
+/**
+ Counts the free units of a resource, such as blocks or inodes.
+
+ Free units live either in a global pool or in one of several shards.
+ Each thread works on its own shard, taking a batch from the pool when
+ its shard runs dry, so most reservations and releases touch only a
+ cache line shared with few other threads and never take a lock.
+
+ Once the pool gets low, batching stops: reservations take exactly what
+ they need and releases go straight back to the pool. A reservation the
+ pool can't cover first pulls back whatever the shards hold, so a
+ request only fails when the resource really is used up.
+ */
+class SpaceCounter {
+public:
+    static const size_t Shards = 64;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<int64_t> budget;
+    };
+
+    Shard m_shards[Shards];
+    std::atomic<int64_t> m_pool;
+    /* How much a shard takes from the pool at a time */
+    const int64_t m_batch;
+
+    Shard &Local();
+    bool TakeFromPool(Shard &shard, int64_t n);
+    bool TakeFromShard(Shard &shard, int64_t n);
+    void Drain();
+
+public:
+    explicit SpaceCounter(int64_t batch);
+
+    void Reset(int64_t total);
+    bool Reserve(int64_t n);
+    void Release(int64_t n);
+    void Charge(int64_t n);
+    int64_t Free();
+};
+
+#endif /* space_counter_hpp */
@@ -7,9 +7,12 @@
 #include "inode.hpp"
 #include "special_inode.hpp"
 
+Slab SpecialInode::m_slab("special", sizeof(SpecialInode));
+
 SpecialInode::SpecialInode(enum SpecialInodeTypes type, dev_t dev) :
+Inode(Kind),
 m_type(type) {
-    m_fuseEntryParam.attr.st_dev = dev;
+    m_attr.rdev = dev;
 }
 
 //SpecialInode::~SpecialInode() {}
@@ -14,9 +14,17 @@ enum SpecialInodeTypes {
 };
 
 class SpecialInode : public Inode {
+public:
+    static const enum InodeKinds Kind = INODE_KIND_SPECIAL;
+
 private:
     enum SpecialInodeTypes m_type;
+    static Slab m_slab;
 public:
+    /* Each type of inode is allocated from its own slab */
+    static void *operator new(size_t size) { return m_slab.Alloc(size); }
+    static void operator delete(void *obj) { m_slab.Free(obj); }
+
     SpecialInode(enum SpecialInodeTypes type, dev_t dev = 0);
     ~SpecialInode() {};
     
@@ -0,0 +1,249 @@
+/** @file spill.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spill.hpp"
+#include "inode.hpp"
+#include "file.hpp"
+#include "inode_table.hpp"
+#include "fuse_cpp_ramfs.hpp"
+#include "metrics.hpp"
+#include "compressor.hpp"
+
+using namespace std;
+
+unsigned Spill::High = 90;
+unsigned Spill::Low = 75;
+
+int Spill::m_fd = -1;
+
+std::mutex Spill::m_slotMutex;
+std::vector<uint32_t> Spill::m_freeSlots;
+uint32_t Spill::m_nextSlot = 0;
+
+std::mutex Spill::m_mutex;
+std::condition_variable Spill::m_cv;
+std::condition_variable Spill::m_spilled;
+std::thread Spill::m_thread;
+bool Spill::m_running = false;
+bool Spill::m_wanted = false;
+bool Spill::m_busy = false;
+uint64_t Spill::m_rounds = 0;
+std::atomic<bool> Spill::m_stopping(false);
+
+/**
+ Creates the spill file, which has no name, in a directory.
+
+ @param dir The spill directory.
+ @return false if no file can be created there.
+ */
+bool Spill::Open(const char *dir) {
+#ifdef O_TMPFILE
+    m_fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (m_fd < 0) {
+        /* Filesystems without O_TMPFILE get a name, briefly */
+        std::string path = std::string(dir) + "/fuse-cpp-ramfs-spill.XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        m_fd = mkstemp(name.data());
+        if (m_fd >= 0) {
+            unlink(name.data());
+        }
+    }
+    if (m_fd < 0) {
+        fprintf(stderr, "fuse-cpp-ramfs: cannot create a spill file in %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ Writes a page to a free slot of the spill file.
+
+ @param page The PageSize bytes of the page.
+ @return The entry standing for the spilled page, to be released with
+   Free(), or nullptr if the page can't be written.
+ */
+char *Spill::Write(const char *page) {
+    uint32_t slot;
+    {
+        std::lock_guard<std::mutex> lk(m_slotMutex);
+        if (!m_freeSlots.empty()) {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        } else if (m_nextSlot < UINT32_MAX) {
+            slot = m_nextSlot++;
+        } else {
+            return nullptr;
+        }
+    }
+    char *spilled = (char *) ((uintptr_t) slot << 2 | 2);
+    if (pwrite(m_fd, page, File::PageSize, (off_t) slot * File::PageSize) != (ssize_t) File::PageSize) {
+        /* Most likely the spill directory is full */
+        Free(spilled);
+        return nullptr;
+    }
+    Metrics::Count(Metrics::PagesSpilled, 1);
+    return spilled;
+}
+
+/**
+ Reads a spilled page back.
+
+ @param page The entry made by Write().
+ @param out Where to put the PageSize bytes of the page.
+ @return false if the spill file can't be read.
+ */
+bool Spill::Read(const char *page, char *out) {
+    Metrics::Count(Metrics::PagesReadBack, 1);
+    return pread(m_fd, out, File::PageSize, (off_t) Slot(page) * File::PageSize) == (ssize_t) File::PageSize;
+}
+
+/* Gives the slot of a spilled page back, and its disk space */
+void Spill::Free(char *page) {
+    uint32_t slot = Slot(page);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) slot * File::PageSize, File::PageSize);
+#endif
+    std::lock_guard<std::mutex> lk(m_slotMutex);
+    try {
+        m_freeSlots.push_back(slot);
+    } catch (std::bad_alloc &e) {
+        /* The slot is merely never reused */
+    }
+}
+
+/* Gives back every slot at once, once no file holds a spilled page */
+void Spill::Reset() {
+    if (!Enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(m_slotMutex);
+    std::vector<uint32_t>().swap(m_freeSlots);
+    m_nextSlot = 0;
+    if (ftruncate(m_fd, 0) != 0) {
+        /* The disk space is merely reused */
+    }
+}
+
+unsigned Spill::UsedPercent() {
+    struct statvfs info;
+    FuseRamFs::FsStat(&info);
+    if (info.f_blocks == 0) {
+        return 0;
+    }
+    return (unsigned) ((info.f_blocks - info.f_bfree) * 100 / info.f_blocks);
+}
+
+/* Spills files, the one untouched for longest first, until no more than
+ * Low percent of the blocks are used. */
+void Spill::SpillColdest() {
+    std::vector<std::pair<uint32_t, fuse_ino_t>> files;
+    for (fuse_ino_t ino = FUSE_ROOT_ID; ino < InodeTable::Limit() && !m_stopping; ++ino) {
+        InodeTable::Guard guard;
+        File *file = inode_cast<File>(InodeTable::Get(ino));
+        if (file != nullptr) {
+            try {
+                files.emplace_back(file->Touched(), ino);
+            } catch (std::bad_alloc &e) {
+                break;
+            }
+        }
+    }
+    /* The touch times are a coarse clock which may wrap */
+    uint32_t now = Compressor::Now();
+    std::sort(files.begin(), files.end(), [now](const std::pair<uint32_t, fuse_ino_t> &a,
+                                                const std::pair<uint32_t, fuse_ino_t> &b) {
+        return now - a.first > now - b.first;
+    });
+
+    for (auto const &f : files) {
+        if (m_stopping || HasRoom()) {
+            break;
+        }
+        InodeTable::Guard guard;
+        File *file = inode_cast<File>(InodeTable::Get(f.second));
+        if (file != nullptr && file->SpillPages() < 0) {
+            /* The spill directory is full */
+            break;
+        }
+    }
+}
+
+/* The spill thread: every second, spills files if the filesystem is past
+ * High, or a writer found no room. */
+void Spill::Run() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (!m_stopping) {
+        m_cv.wait_for(lk, std::chrono::seconds(1), [] { return m_stopping.load() || m_wanted; });
+        if (m_stopping) {
+            break;
+        }
+        bool wanted = m_wanted;
+        m_wanted = false;
+        if (wanted || UsedPercent() >= High) {
+            m_busy = true;
+            lk.unlock();
+            SpillColdest();
+            lk.lock();
+            m_busy = false;
+        }
+        ++m_rounds;
+        m_spilled.notify_all();
+    }
+}
+
+/**
+ Has the spill thread make room, for a writer which found no free blocks,
+ and waits until it has done what it can.
+
+ @return false if there is no spill thread.
+ */
+bool Spill::MakeRoom() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    if (!m_running || m_stopping) {
+        return false;
+    }
+    /* A round under way may have passed the files it could spill already */
+    uint64_t until = m_rounds + (m_busy ? 2 : 1);
+    m_wanted = true;
+    m_cv.notify_one();
+    m_spilled.wait(lk, [until] { return m_rounds >= until || m_stopping.load(); });
+    return !m_stopping;
+}
+
+/**
+ Starts watching for the filesystem to fill on a thread of its own, if
+ there is a spill file.
+ */
+void Spill::Start() {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (m_running || !Enabled()) {
+        return;
+    }
+    m_stopping = false;
+    m_thread = std::thread(Run);
+    m_running = true;
+}
+
+void Spill::Stop() {
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (!m_running) {
+            return;
+        }
+        m_stopping = true;
+    }
+    m_cv.notify_one();
+    m_spilled.notify_all();
+    m_thread.join();
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_running = false;
+}
@@ -0,0 +1,85 @@
+/** @file spill.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef spill_hpp
+#define spill_hpp
+
+#include "common.h"
+
+#include <condition_variable>
+#include <thread>
+
+/**
+ Writes the pages of cold files out to a file in a spill directory when
+ the filesystem runs short of space, and reads them back when they are
+ used again. A full filesystem then slows writers down instead of
+ failing them.
+
+ A thread checks how full the filesystem is every second. Once more than
+ High percent of its blocks are used, it spills the files which went
+ untouched longest first, until no more than Low percent are. A writer
+ which finds no free blocks wakes the thread and waits for it to finish
+ a round rather than fail at once.
+
+ A spilled page takes the place of the page in the file's page table.
+ Its entry has the second lowest bit set, which neither a pool page nor
+ a compressed page has, and holds the slot of the page in the spill
+ file. A spilled page costs no blocks. Reads go to the spill file and
+ bring the pages back when there is room; a write always brings its
+ pages back first.
+
+ The spill file is unlinked as soon as it is created, so it goes away
+ with the process. Slots of pages which are brought back or dropped are
+ reused, and their disk space is given back.
+ */
+class Spill {
+public:
+    /* Percent of the blocks used at which to start and stop spilling */
+    static unsigned High;
+    static unsigned Low;
+
+private:
+    static int m_fd;
+
+    static std::mutex m_slotMutex;
+    /* Guarded by m_slotMutex */
+    static std::vector<uint32_t> m_freeSlots;
+    static uint32_t m_nextSlot;
+
+    static std::mutex m_mutex;
+    static std::condition_variable m_cv;
+    static std::condition_variable m_spilled;
+    static std::thread m_thread;
+    /* Guarded by m_mutex */
+    static bool m_running;
+    static bool m_wanted;
+    static bool m_busy;
+    static uint64_t m_rounds;
+    /* Also checked between files, without the mutex */
+    static std::atomic<bool> m_stopping;
+
+    static void Run();
+    static void SpillColdest();
+    static unsigned UsedPercent();
+    static uint32_t Slot(const char *page) { return (uint32_t) ((uintptr_t) page >> 2); }
+
+public:
+    static bool Open(const char *dir);
+    static bool Enabled() { return m_fd >= 0; }
+
+    static bool IsSpilled(const char *page) { return ((uintptr_t) page & 2) != 0; }
+    static char *Write(const char *page);
+    static bool Read(const char *page, char *out);
+    static void Free(char *page);
+    static void Reset();
+
+    /* Whether spilled pages may be brought back without spilling others */
+    static bool HasRoom() { return UsedPercent() < Low; }
+    static bool MakeRoom();
+
+    static void Start();
+    static void Stop();
+};
+
+#endif /* spill_hpp */
@@ -7,6 +7,9 @@
 #include "util.hpp"
 #include "inode.hpp"
 #include "symlink.hpp"
+#include "snapshot.hpp"
+
+Slab SymLink::m_slab("symlink", sizeof(SymLink));
 
 int SymLink::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) {
     return fuse_reply_err(req, EISDIR);
@@ -18,12 +21,27 @@ int SymLink::ReadAndReply(fuse_req_t req, size_t size, off_t off) {
 
 void SymLink::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid) {
     Inode::Initialize(ino, mode, nlink, gid, uid);
-    
-    m_fuseEntryParam.attr.st_size = m_link.size();
-    m_fuseEntryParam.attr.st_blocks = m_fuseEntryParam.attr.st_size / m_fuseEntryParam.attr.st_blksize;
-    
-    // Add another block if the size is larger than a whole number of blocks
-    if (m_fuseEntryParam.attr.st_blksize * m_fuseEntryParam.attr.st_blocks < m_fuseEntryParam.attr.st_size) {
-        m_fuseEntryParam.attr.st_blocks++;
+
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    Attr attr = m_attr;
+    attr.size = m_link.size();
+    attr.blocks = get_nblocks(attr.size, Inode::BufBlockSize);
+    StoreAttr(attr);
+}
+
+void SymLink::Save(ImageWriter &out) {
+    Inode::Save(out);
+    out.PutString(m_link);
+}
+
+bool SymLink::Load(ImageReader &in, fuse_ino_t ino, mode_t mode) {
+    if (!Inode::Load(in, ino, mode) || !in.GetString(m_link)) {
+        return false;
     }
-}
\ No newline at end of file
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    Attr attr = m_attr;
+    attr.size = m_link.size();
+    attr.blocks = get_nblocks(attr.size, Inode::BufBlockSize);
+    StoreAttr(attr);
+    return true;
+}
@@ -6,11 +6,20 @@
 #define symlink_hpp
 
 class SymLink : public Inode {
+public:
+    static const enum InodeKinds Kind = INODE_KIND_SYMLINK;
+
 private:
     std::string m_link;
+    static Slab m_slab;
     
 public:
+    /* Each type of inode is allocated from its own slab */
+    static void *operator new(size_t size) { return m_slab.Alloc(size); }
+    static void operator delete(void *obj) { m_slab.Free(obj); }
+
     SymLink(const std::string &link) :
+    Inode(Kind),
     m_link(link) {}
     
     ~SymLink() {};
@@ -19,6 +28,8 @@ public:
     int ReadAndReply(fuse_req_t req, size_t size, off_t off);
     
     void Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
+    void Save(ImageWriter &out);
+    bool Load(ImageReader &in, fuse_ino_t ino, mode_t mode);
     
     
     const std::string &Link() { return m_link; }
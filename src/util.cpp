@@ -68,6 +68,19 @@ size_t SizeStr2Number(const char *str)
         return size * unit;
 }
 
+/* TimeStr2Seconds: Convert a non-negative number of seconds, which may
+ * have a fraction, to a number. Returns -1 if the string isn't one. */
+double TimeStr2Seconds(const char *str)
+{
+        char *end;
+        errno = 0;
+        double seconds = strtod(str, &end);
+        if (errno != 0 || end == str || *end != '\0' || !(seconds >= 0)) {
+                return -1;
+        }
+        return seconds;
+}
+
 /* ramfs_parse_options: Parse option string provided by -o argument
  *
  * @param[in] optstr:   Option string 
@@ -80,6 +93,60 @@ size_t SizeStr2Number(const char *str)
  *              including k,m,g,t,p,e.
  *   - inodes   Inode slots of the file system. Also supports unit suffix.
  *   - subtype  Subtype name to be displayed in mount list.
+ *   - threads  Number of worker threads serving FUSE requests.
+ *   - single_thread
+ *              Serve all requests on the main thread.
+ *   - dir_hash_threshold
+ *              Number of entries at which a directory gets a hash index
+ *              for lookups. 1 indexes every directory.
+ *   - attr_timeout, entry_timeout
+ *              Seconds the kernel may cache attributes and names.
+ *   - negative_timeout
+ *              Seconds the kernel may cache a failed lookup; entry_timeout
+ *              by default. 0 has every lookup of a missing name come here.
+ *   - keep_cache
+ *              Keep the kernel's page cache of a file across opens.
+ *   - writeback_cache
+ *              Let the kernel cache writes and send them in batches,
+ *              where it supports this (libfuse 3).
+ *   - max_write, max_readahead
+ *              Largest write and readahead the kernel may send. Also
+ *              support unit suffix.
+ *   - relatime, strictatime, lazytime, noatime
+ *              When reads update the atime: if it is older than the last
+ *              change or a day old (the default), on every read, on
+ *              every read without locking the file, or never.
+ *   - hugepages[=thp|hugetlb|off]
+ *              Back file data with transparent huge pages (the default
+ *              with no value) or reserved hugetlbfs pages.
+ *   - numa=local|interleave
+ *              Place file data on the node first touching it, or spread
+ *              it over all nodes.
+ *   - compress[=SECONDS]
+ *              Compress the data of files nobody read or wrote for this
+ *              long (60 seconds with no value), to hold more in the same
+ *              capacity. Needs a build with LZ4.
+ *   - dedup
+ *              Share identical pages between files, so that copies of
+ *              the same data take the capacity of one.
+ *   - spill
+ *              Directory to write the pages of cold files out to when the
+ *              filesystem fills, so that writers slow down rather than
+ *              fail. Pages come back when they are used.
+ *   - spill_high, spill_low
+ *              Percent of the capacity in use at which spilling starts
+ *              (90 by default) and down to which it goes on (75).
+ *   - control
+ *              Path of a Unix socket answering queries such as slab
+ *              usage and request metrics. A relative path is taken from
+ *              the current directory.
+ *   - snapshot
+ *              Image file to save the whole filesystem to on unmount.
+ *   - restore
+ *              Image file to fill the filesystem from on mount. File
+ *              contents are read from it as they are first needed. A
+ *              missing file starts the filesystem empty, so snapshot and
+ *              restore may name the same file.
  * 
  * @return: The new string buffer containing the original option string
  *   with the parsed options excluded.
@@ -117,6 +184,136 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
                 opt.subtype = value;
                 printf("Custom subtype: %s\n", value);
             }
+        } else if (key && strncmp(key, "threads", OPTION_MAX) == 0) {
+            if (value) {
+                opt.threads = SizeStr2Number(value);
+                printf("Custom worker threads: %zu\n", opt.threads);
+            }
+        } else if (key && strncmp(key, "single_thread", OPTION_MAX) == 0) {
+            opt.single_thread = true;
+            printf("Elected to run single-threaded\n");
+        } else if (key && (strncmp(key, "attr_timeout", OPTION_MAX) == 0 ||
+                           strncmp(key, "entry_timeout", OPTION_MAX) == 0 ||
+                           strncmp(key, "negative_timeout", OPTION_MAX) == 0)) {
+            double seconds = value ? TimeStr2Seconds(value) : -1;
+            if (seconds < 0) {
+                printf("%s needs a number of seconds\n", key);
+                exit(1);
+            }
+            if (strncmp(key, "attr_timeout", OPTION_MAX) == 0) {
+                opt.attr_timeout = seconds;
+            } else if (strncmp(key, "entry_timeout", OPTION_MAX) == 0) {
+                opt.entry_timeout = seconds;
+            } else {
+                opt.negative_timeout = seconds;
+            }
+            printf("Custom %s: %g seconds\n", key, seconds);
+        } else if (key && strncmp(key, "relatime", OPTION_MAX) == 0) {
+            opt.atime_mode = ATIME_MODE_RELATIME;
+            printf("Elected relatime\n");
+        } else if (key && strncmp(key, "strictatime", OPTION_MAX) == 0) {
+            opt.atime_mode = ATIME_MODE_STRICT;
+            printf("Elected strictatime\n");
+        } else if (key && strncmp(key, "lazytime", OPTION_MAX) == 0) {
+            opt.atime_mode = ATIME_MODE_LAZY;
+            printf("Elected lazytime\n");
+        } else if (key && strncmp(key, "noatime", OPTION_MAX) == 0) {
+            opt.atime_mode = ATIME_MODE_NONE;
+            printf("Elected noatime\n");
+        } else if (key && strncmp(key, "keep_cache", OPTION_MAX) == 0) {
+            opt.keep_cache = true;
+            printf("Elected to keep the page cache across opens\n");
+        } else if (key && strncmp(key, "writeback_cache", OPTION_MAX) == 0) {
+            opt.writeback_cache = true;
+            printf("Elected writeback caching\n");
+        } else if (key && strncmp(key, "max_write", OPTION_MAX) == 0) {
+            if (value) {
+                opt.max_write = SizeStr2Number(value);
+                printf("Custom max_write: %zu bytes\n", opt.max_write);
+            }
+        } else if (key && strncmp(key, "max_readahead", OPTION_MAX) == 0) {
+            if (value) {
+                opt.max_readahead = SizeStr2Number(value);
+                printf("Custom max_readahead: %zu bytes\n", opt.max_readahead);
+            }
+        } else if (key && strncmp(key, "hugepages", OPTION_MAX) == 0) {
+            if (value == nullptr || strncmp(value, "thp", OPTION_MAX) == 0) {
+                opt.hugepages = HUGEPAGE_MODE_THP;
+            } else if (strncmp(value, "hugetlb", OPTION_MAX) == 0) {
+                opt.hugepages = HUGEPAGE_MODE_HUGETLB;
+            } else if (strncmp(value, "off", OPTION_MAX) == 0) {
+                opt.hugepages = HUGEPAGE_MODE_NONE;
+            } else {
+                printf("hugepages must be thp, hugetlb or off\n");
+                exit(1);
+            }
+            printf("Huge pages: %s\n", value ? value : "thp");
+        } else if (key && strncmp(key, "numa", OPTION_MAX) == 0) {
+            if (value && strncmp(value, "local", OPTION_MAX) == 0) {
+                opt.numa = NUMA_MODE_LOCAL;
+            } else if (value && strncmp(value, "interleave", OPTION_MAX) == 0) {
+                opt.numa = NUMA_MODE_INTERLEAVE;
+            } else {
+                printf("numa must be local or interleave\n");
+                exit(1);
+            }
+            printf("NUMA placement: %s\n", value);
+        } else if (key && strncmp(key, "compress", OPTION_MAX) == 0) {
+            double seconds = value ? TimeStr2Seconds(value) : 60;
+            if (seconds < 1 || seconds > UINT_MAX) {
+                printf("compress needs a number of seconds, at least 1\n");
+                exit(1);
+            }
+            opt.compress_seconds = (unsigned) seconds;
+            printf("Compressing files untouched for %u seconds\n", opt.compress_seconds);
+        } else if (key && strncmp(key, "dedup", OPTION_MAX) == 0) {
+            opt.dedup = true;
+            printf("Elected deduplication of identical pages\n");
+        } else if (key && (strncmp(key, "spill_high", OPTION_MAX) == 0 ||
+                           strncmp(key, "spill_low", OPTION_MAX) == 0)) {
+            unsigned long percent = value ? strtoul(value, NULL, 10) : 0;
+            if (percent < 1 || percent > 100) {
+                printf("%s needs a percentage from 1 to 100\n", key);
+                exit(1);
+            }
+            if (key[6] == 'h') {
+                opt.spill_high = (unsigned) percent;
+            } else {
+                opt.spill_low = (unsigned) percent;
+            }
+        } else if (key && strncmp(key, "spill", OPTION_MAX) == 0) {
+            if (value) {
+                size_t len = strnlen(value, OPTION_MAX) + 1;
+                opt.spill = new char[len];
+                strncpy(opt.spill, value, len);
+                printf("Spilling cold files to: %s\n", opt.spill);
+            }
+        } else if (key && strncmp(key, "control", OPTION_MAX) == 0) {
+            if (value) {
+                size_t len = strnlen(value, OPTION_MAX) + 1;
+                opt.control = new char[len];
+                strncpy(opt.control, value, len);
+                printf("Control socket: %s\n", opt.control);
+            }
+        } else if (key && (strncmp(key, "snapshot", OPTION_MAX) == 0 ||
+                           strncmp(key, "restore", OPTION_MAX) == 0)) {
+            if (value) {
+                size_t len = strnlen(value, OPTION_MAX) + 1;
+                char *path = new char[len];
+                strncpy(path, value, len);
+                if (key[0] == 's') {
+                    opt.snapshot = path;
+                    printf("Snapshot to: %s\n", path);
+                } else {
+                    opt.restore = path;
+                    printf("Restore from: %s\n", path);
+                }
+            }
+        } else if (key && strncmp(key, "dir_hash_threshold", OPTION_MAX) == 0) {
+            if (value) {
+                opt.dir_hash_threshold = SizeStr2Number(value);
+                printf("Custom directory hash threshold: %zu entries\n", opt.dir_hash_threshold);
+            }
         } else {
             if (key == nullptr) {
                 continue;
@@ -146,6 +343,10 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
         printf("fuse-cpp-ramfs requires at least 2 inode slots\n");
         exit(1);
     }
+    if (opt.single_thread && opt.threads > 1) {
+        printf("single_thread conflicts with threads=%zu\n", opt.threads);
+        exit(1);
+    }
 
     /* Erase '-o' if no option string is left */
     if (*(--ptr) == 'o') {
@@ -198,6 +399,9 @@ void ramfs_parse_cmdline(struct fuse_args &args, struct fuse_ramfs_options &opti
     size_t optlen; 
     char *optstr_buf;
     int o_idx1 = 0, argo_idx = 0;
+    options.attr_timeout = -1;
+    options.entry_timeout = -1;
+    options.negative_timeout = -1;
     while ((opt = getopt(args.argc, args.argv, "o:b")) != -1) {
         switch (opt) {
             case 'o':
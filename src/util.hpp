@@ -19,10 +19,60 @@
 #error strtok_r is not available on your system. Please check your glibc version
 #endif
 
+/* When reading a file updates its atime */
+enum AtimeModes {
+    ATIME_MODE_RELATIME,    /* If older than the last change, or a day old */
+    ATIME_MODE_STRICT,      /* On every read */
+    ATIME_MODE_LAZY,        /* On every read, without taking the inode lock */
+    ATIME_MODE_NONE         /* Never */
+};
+
+/* What backs the file data pool */
+enum HugePageModes {
+    HUGEPAGE_MODE_NONE,     /* Normal pages */
+    HUGEPAGE_MODE_THP,      /* Transparent huge pages where the kernel allows */
+    HUGEPAGE_MODE_HUGETLB   /* Reserved huge pages (hugetlbfs) */
+};
+
+/* Where the file data pool is placed on NUMA machines */
+enum NumaModes {
+    NUMA_MODE_DEFAULT,      /* The process policy */
+    NUMA_MODE_LOCAL,        /* The node of the thread touching a page first */
+    NUMA_MODE_INTERLEAVE    /* Round-robin over all nodes */
+};
+
 struct fuse_ramfs_options {
     size_t capacity;
     size_t inodes;
     bool deamonize;
+    size_t threads;
+    bool single_thread;
+    size_t dir_hash_threshold;
+    /* Cache timeouts in seconds; negative if not given */
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
+    bool keep_cache;
+    bool writeback_cache;
+    /* Largest write and readahead the kernel is offered; 0 if not given */
+    size_t max_write;
+    size_t max_readahead;
+    /* Seconds until untouched files are compressed; 0 for never */
+    unsigned compress_seconds;
+    bool dedup;
+    /* Directory to spill cold files to, or null for none; the watermarks
+     * in percent, 0 if not given */
+    char *spill;
+    unsigned spill_high;
+    unsigned spill_low;
+    enum AtimeModes atime_mode;
+    enum HugePageModes hugepages;
+    enum NumaModes numa;
+    /* Path of the control socket, or null for none */
+    char *control;
+    /* Image to save to on unmount and to restore from on mount, or null */
+    char *snapshot;
+    char *restore;
     char *subtype;
     char *mountpoint;
     char *_optstr;
@@ -44,6 +94,7 @@ static inline size_t get_nblocks(size_t size, size_t blocksize) {
 }
 
 size_t SizeStr2Number(const char *str);
+double TimeStr2Seconds(const char *str);
 char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt);
 void ramfs_parse_cmdline(struct fuse_args &args, struct fuse_ramfs_options &options);
 
@@ -0,0 +1,205 @@
+/** @file xattr.cpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#include "common.h"
+
+#include <algorithm>
+
+#include "xattr.hpp"
+
+using namespace std;
+
+XAttrs::Stripe XAttrs::m_stripes[XAttrs::Stripes];
+
+/**
+ Finds the blob holding the given bytes, or makes one.
+
+ @param bytes The name or value.
+ @return The blob, with a reference for the caller, or nullptr if there
+   is no memory for it.
+ */
+XAttrs::Blob *XAttrs::Intern(std::string_view bytes) {
+    if (bytes.size() > UINT32_MAX) {
+        return nullptr;
+    }
+    uint64_t hash = Hash(bytes);
+    Stripe &stripe = StripeOf(hash);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    auto range = stripe.blobs.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->View() == bytes) {
+            /* Under the lock, so Release() can't free it meanwhile */
+            it->second->m_refs++;
+            return it->second;
+        }
+    }
+
+    void *mem = malloc(sizeof(Blob) + bytes.size() + 1);
+    if (mem == nullptr) {
+        return nullptr;
+    }
+    Blob *blob = new (mem) Blob(hash, bytes.size());
+    char *data = (char *) (blob + 1);
+    memcpy(data, bytes.data(), bytes.size());
+    data[bytes.size()] = '\0';
+    try {
+        stripe.blobs.emplace(hash, blob);
+    } catch (std::bad_alloc &e) {
+        free(mem);
+        return nullptr;
+    }
+    return blob;
+}
+
+/* Drops a reference to a blob, and frees it if that was the last */
+void XAttrs::Release(Blob *blob) {
+    uint32_t refs = blob->m_refs.load();
+    while (refs > 1) {
+        if (blob->m_refs.compare_exchange_weak(refs, refs - 1)) {
+            return;
+        }
+    }
+
+    /* The last reference, unless Intern() hands out another first */
+    Stripe &stripe = StripeOf(blob->m_hash);
+    std::lock_guard<std::mutex> lk(stripe.mutex);
+    if (--blob->m_refs > 0) {
+        return;
+    }
+    auto range = stripe.blobs.equal_range(blob->m_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == blob) {
+            stripe.blobs.erase(it);
+            break;
+        }
+    }
+    blob->~Blob();
+    free(blob);
+}
+
+XAttrs::~XAttrs() {
+    for (auto const &e : m_entries) {
+        Release(e.name);
+        Release(e.value);
+    }
+}
+
+/* Where the entry for a name is, or would go */
+std::vector<XAttrs::Entry>::iterator XAttrs::Find(std::string_view name) {
+    return std::lower_bound(m_entries.begin(), m_entries.end(), name,
+                            [](const Entry &e, std::string_view n) { return e.name->View() < n; });
+}
+
+/* Where the name of an entry starts in the list */
+size_t XAttrs::ListOffset(std::vector<Entry>::iterator it) {
+    size_t offset = 0;
+    for (auto e = m_entries.begin(); e != it; ++e) {
+        offset += e->name->Size() + 1;
+    }
+    return offset;
+}
+
+/**
+ Sets an attribute.
+
+ @param name The name of the attribute.
+ @param value The value, or the part of it at position.
+ @param size The size of value.
+ @param flags XATTR_CREATE or XATTR_REPLACE, or 0.
+ @param position Where value goes in the attribute. Other than 0 only for
+   resource forks, whose bytes before and after value are kept.
+ @return 0 or a negative errno.
+ */
+int XAttrs::Set(std::string_view name, const void *value, size_t size, int flags, uint32_t position) {
+    auto it = Find(name);
+    bool exists = it != m_entries.end() && it->name->View() == name;
+    if (exists && (flags & XATTR_CREATE)) {
+        return -EEXIST;
+    }
+    if (!exists && (flags & XATTR_REPLACE)) {
+        return -NoAttr;
+    }
+    if (size > UINT32_MAX - position) {
+        return -E2BIG;
+    }
+
+    Blob *blob;
+    if (position == 0) {
+        blob = Intern(std::string_view((const char *) value, size));
+    } else {
+        std::string bytes;
+        try {
+            if (exists) {
+                bytes = it->value->View();
+            }
+            if (bytes.size() < position + size) {
+                bytes.resize(position + size);
+            }
+        } catch (std::bad_alloc &e) {
+            return -ENOSPC;
+        }
+        memcpy(&bytes[position], value, size);
+        blob = Intern(bytes);
+    }
+    if (blob == nullptr) {
+        return -ENOSPC;
+    }
+    if (exists) {
+        Release(it->value);
+        it->value = blob;
+        return 0;
+    }
+
+    Blob *key = Intern(name);
+    if (key == nullptr) {
+        Release(blob);
+        return -ENOSPC;
+    }
+    size_t index = it - m_entries.begin();
+    size_t offset = ListOffset(it);
+    try {
+        m_entries.reserve(m_entries.size() + 1);
+        m_list.insert(offset, key->Data(), key->Size() + 1);
+    } catch (std::bad_alloc &e) {
+        Release(key);
+        Release(blob);
+        return -ENOSPC;
+    }
+    /* Room was made for it, so this doesn't throw */
+    m_entries.insert(m_entries.begin() + index, Entry{key, blob});
+    return 0;
+}
+
+/**
+ Looks up an attribute.
+
+ @param name The name of the attribute.
+ @return Its value, which stays valid as long as the attribute is neither
+   set nor removed, or nullptr if there is no such attribute.
+ */
+const XAttrs::Blob *XAttrs::Get(std::string_view name) {
+    auto it = Find(name);
+    if (it == m_entries.end() || it->name->View() != name) {
+        return nullptr;
+    }
+    return it->value;
+}
+
+/**
+ Removes an attribute.
+
+ @param name The name of the attribute.
+ @return 0 or -NoAttr.
+ */
+int XAttrs::Remove(std::string_view name) {
+    auto it = Find(name);
+    if (it == m_entries.end() || it->name->View() != name) {
+        return -NoAttr;
+    }
+    m_list.erase(ListOffset(it), it->name->Size() + 1);
+    Release(it->name);
+    Release(it->value);
+    m_entries.erase(it);
+    return 0;
+}
@@ -0,0 +1,94 @@
+/** @file xattr.hpp
+ *  @copyright 2016 Peter Watkins. All rights reserved.
+ */
+
+#ifndef xattr_hpp
+#define xattr_hpp
+
+#include "common.h"
+
+/**
+ The extended attributes of an inode.
+
+ Names and values are interned: every inode with a security.selinux
+ label of the same context points at one copy of the name and one of
+ the value. A name or value is an immutable, refcounted Blob; setting an
+ attribute interns its new value and lets go of the old one, and the
+ last inode to let go of a blob frees it. The table of blobs is split
+ in stripes by hash, each with its own lock.
+
+ An inode keeps its attributes in a vector sorted by name, and the list
+ listxattr replies with ready made, so listing allocates nothing.
+
+ XAttrs does no locking of its own; the inode guards it.
+ */
+class XAttrs {
+public:
+    class Blob {
+        friend class XAttrs;
+        uint64_t m_hash;
+        std::atomic<uint32_t> m_refs;
+        uint32_t m_size;
+
+        Blob(uint64_t hash, uint32_t size) : m_hash(hash), m_refs(1), m_size(size) {}
+
+    public:
+        /* The bytes follow the header, with a NUL after them */
+        const char *Data() const { return (const char *) (this + 1); }
+        size_t Size() const { return m_size; }
+        std::string_view View() const { return std::string_view(Data(), m_size); }
+    };
+
+private:
+    static const size_t Stripes = 16;
+
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::unordered_multimap<uint64_t, Blob *> blobs;
+    };
+
+    static Stripe m_stripes[Stripes];
+
+    static Stripe &StripeOf(uint64_t hash) { return m_stripes[hash >> 60]; }
+    static uint64_t Hash(std::string_view bytes) { return std::hash<std::string_view>()(bytes); }
+    static Blob *Intern(std::string_view bytes);
+    static void Release(Blob *blob);
+
+    struct Entry {
+        Blob *name;
+        Blob *value;
+    };
+    /* Sorted by name */
+    std::vector<Entry> m_entries;
+    /* The names, each followed by a NUL */
+    std::string m_list;
+
+    std::vector<Entry>::iterator Find(std::string_view name);
+    size_t ListOffset(std::vector<Entry>::iterator it);
+
+public:
+#ifdef __APPLE__
+    static const int NoAttr = ENOATTR;
+#else
+    static const int NoAttr = ENODATA;
+#endif
+
+    XAttrs() {}
+    XAttrs(const XAttrs &) = delete;
+    XAttrs &operator=(const XAttrs &) = delete;
+    ~XAttrs();
+
+    int Set(std::string_view name, const void *value, size_t size, int flags, uint32_t position);
+    const Blob *Get(std::string_view name);
+    int Remove(std::string_view name);
+    const std::string &List() const { return m_list; }
+
+    size_t Count() const { return m_entries.size(); }
+    template <class F> void ForEach(F f) const {
+        for (auto const &e : m_entries) {
+            f(e.name->View(), e.value->View());
+        }
+    }
+};
+
+#endif /* xattr_hpp */
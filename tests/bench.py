@@ -0,0 +1,145 @@
+#!/usr/bin/env python
+# Runs workloads against a mounted filesystem, through the kernel, and
+# prints the results as JSON in the same shape as src/fuse-cpp-ramfs-bench,
+# which calls the request handlers in-process.
+#
+# Run from the build directory: python3 ../tests/bench.py [--scale S] [--processes N]
+import argparse
+import errno
+import json
+import multiprocessing
+import os
+import random
+import subprocess
+import sys
+import time
+
+MOUNTPOINT = 'mnt/fuse-cpp-ramfs-bench'
+
+
+def make_sure_path_exists(path):
+    try:
+        os.makedirs(path)
+    except OSError as exception:
+        if exception.errno != errno.EEXIST:
+            raise
+
+
+def measure(name, ops, op, processes=1, bytes_per_op=0):
+    """Times ops calls of op(i), or op(i, worker) on each of several processes."""
+    latencies = []
+    if processes == 1:
+        start = time.perf_counter()
+        last = start
+        for i in range(ops):
+            op(i)
+            now = time.perf_counter()
+            latencies.append(now - last)
+            last = now
+        seconds = last - start
+    else:
+        with multiprocessing.Pool(processes) as pool:
+            start = time.perf_counter()
+            for worker_latencies in pool.starmap(run_worker, [(op, ops, w) for w in range(processes)]):
+                latencies.extend(worker_latencies)
+            seconds = time.perf_counter() - start
+    latencies.sort()
+
+    def percentile(p):
+        return latencies[min(len(latencies) - 1, int(p * len(latencies)))] * 1e6
+
+    total = ops * processes
+    return {'name': name, 'threads': processes, 'ops': total, 'seconds': seconds,
+            'ops_per_second': total / seconds, 'bytes_per_second': total * bytes_per_op / seconds,
+            'latency_us': {'p50': percentile(0.5), 'p90': percentile(0.9),
+                           'p99': percentile(0.99), 'max': percentile(1.0)}}
+
+
+def run_worker(op, ops, worker):
+    latencies = []
+    last = time.perf_counter()
+    for i in range(ops):
+        op(i, worker)
+        now = time.perf_counter()
+        latencies.append(now - last)
+        last = now
+    return latencies
+
+
+def life_of_file(i, worker):
+    path = os.path.join(MOUNTPOINT, 'shared', 'w{}-{}'.format(worker, i))
+    os.close(os.open(path, os.O_CREAT | os.O_WRONLY, 0o644))
+    os.stat(path)
+    os.unlink(path)
+
+
+def random_read(i, worker):
+    fd = os.open(os.path.join(MOUNTPOINT, 'data'), os.O_RDONLY)
+    try:
+        size = os.fstat(fd).st_size
+        os.pread(fd, 4096, random.Random(worker * 1000003 + i).randrange(size // 4096) * 4096)
+    finally:
+        os.close(fd)
+
+
+def run(scale, processes):
+    results = []
+    n = max(1, int(10000 * scale))
+
+    flat = os.path.join(MOUNTPOINT, 'flat')
+    os.mkdir(flat)
+    names = [os.path.join(flat, 'file{}'.format(i)) for i in range(n)]
+    results.append(measure('create_flat', n, lambda i: os.close(os.open(names[i], os.O_CREAT | os.O_WRONLY, 0o644))))
+    results.append(measure('stat_flat', n, lambda i: os.stat(names[i])))
+    results.append(measure('readdir_flat', 10, lambda i: os.listdir(flat)))
+    results.append(measure('rename_flat', n, lambda i: os.rename(names[i], names[i] + '.renamed')))
+    results.append(measure('unlink_flat', n, lambda i: os.unlink(names[i] + '.renamed')))
+
+    chunk = 128 * 1024
+    size = max(1, int(64 * scale)) * 1024 * 1024
+    data = os.path.join(MOUNTPOINT, 'data')
+    fd = os.open(data, os.O_CREAT | os.O_RDWR, 0o644)
+    buf = b'x' * chunk
+    results.append(measure('write_seq', size // chunk, lambda i: os.pwrite(fd, buf, i * chunk), bytes_per_op=chunk))
+    results.append(measure('read_seq', size // chunk, lambda i: os.pread(fd, chunk, i * chunk), bytes_per_op=chunk))
+    offsets = [random.Random(i).randrange(size // 4096) * 4096 for i in range(n)]
+    results.append(measure('write_random_4k', n, lambda i: os.pwrite(fd, buf[:4096], offsets[i]), bytes_per_op=4096))
+    results.append(measure('read_random_4k', n, lambda i: os.pread(fd, 4096, offsets[i]), bytes_per_op=4096))
+    os.close(fd)
+
+    os.mkdir(os.path.join(MOUNTPOINT, 'shared'))
+    results.append(measure('create_stat_unlink_shared_dir', n // processes or 1, life_of_file, processes))
+    results.append(measure('open_read_random_4k_one_file', n // processes or 1, random_read, processes, 4096))
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark a mounted fuse-cpp-ramfs')
+    parser.add_argument('--scale', type=float, default=1.0, help='Multiplies the size of every workload')
+    parser.add_argument('--processes', type=int, default=min(8, os.cpu_count() or 1),
+                        help='Processes for the contention workloads')
+    args = parser.parse_args()
+
+    make_sure_path_exists(MOUNTPOINT)
+    child = subprocess.Popen(['src/fuse-cpp-ramfs', MOUNTPOINT], stdout=subprocess.DEVNULL)
+
+    # If you unmount too soon, the mountpoint won't be available.
+    time.sleep(1)
+
+    try:
+        results = run(args.scale, args.processes)
+    finally:
+        if sys.platform == 'darwin':
+            subprocess.run(['umount', MOUNTPOINT])
+        else:
+            subprocess.run(['fusermount', '-u', MOUNTPOINT])
+        child.wait()
+
+    json.dump({'threads': args.processes, 'scale': args.scale, 'mounted': True, 'results': results},
+              sys.stdout, indent=1)
+    sys.stdout.write('\n')
+    return child.returncode
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,131 @@
+#!/usr/bin/env python
+# Saves a filesystem with snapshot=, restores it with restore= and checks
+# that everything came back; then checks that a cut-off image is refused
+# before anything is mounted.
+import subprocess
+import os
+import sys
+import time
+import errno
+import shutil
+import stat
+
+MNT = 'mnt/fuse-cpp-ramfs'
+IMAGE = 'mnt/snapshot.img'
+TRUNCATED = 'mnt/truncated.img'
+PAGE = 4096
+
+def make_sure_path_exists(path):
+    try:
+        os.makedirs(path)
+    except OSError as exception:
+        if exception.errno != errno.EEXIST:
+            raise
+
+def fail(message):
+    sys.stderr.write(message + '\n')
+    sys.exit(-1)
+
+def mount(option):
+    child = subprocess.Popen(['src/fuse-cpp-ramfs', MNT, '-o', option])
+    # If you use it too soon, the mountpoint won't be available.
+    time.sleep(1)
+    return child
+
+def unmount(child, check=True):
+    if sys.platform == 'darwin':
+        subprocess.run(['umount', MNT])
+    else:
+        subprocess.run(['fusermount', '-u', MNT])
+    # The image is written as the filesystem goes away
+    child.wait()
+    if check and child.returncode != 0:
+        fail('fuse-cpp-ramfs exited with {}'.format(child.returncode))
+
+def populate():
+    os.makedirs(os.path.join(MNT, 'dir/sub/deeper'))
+    os.mkdir(os.path.join(MNT, 'empty'), 0o700)
+    with open(os.path.join(MNT, 'small'), 'w') as f:
+        f.write('hello world\n')
+    with open(os.path.join(MNT, 'dir/sub/pages'), 'wb') as f:
+        for i in range(64):
+            f.write(bytes([i]) * PAGE)
+    shutil.copyfile(os.path.join(MNT, 'dir/sub/pages'), os.path.join(MNT, 'dir/copy'))
+    # A hole in the middle and one at the end
+    with open(os.path.join(MNT, 'holes'), 'wb') as f:
+        f.write(b'start')
+        f.seek(256 * PAGE)
+        f.write(b'middle')
+        f.truncate(1024 * PAGE)
+    os.symlink('dir/sub/pages', os.path.join(MNT, 'link'))
+    os.symlink('x' * 3000, os.path.join(MNT, 'dir/longlink'))
+    os.link(os.path.join(MNT, 'small'), os.path.join(MNT, 'dir/hardlink'))
+    os.chmod(os.path.join(MNT, 'small'), 0o640)
+    os.utime(os.path.join(MNT, 'dir/copy'), ns=(1000000000, 1234567890123456789))
+    if hasattr(os, 'setxattr'):
+        os.setxattr(os.path.join(MNT, 'small'), 'user.note', b'kept')
+        os.setxattr(os.path.join(MNT, 'dir'), 'user.empty', b'')
+
+def collect():
+    """Everything which should survive, by path. The atime is left out:
+    reading the contents moves it."""
+    found = {}
+    for root, dirs, files in os.walk(MNT):
+        for name in dirs + files:
+            path = os.path.join(root, name)
+            st = os.lstat(path)
+            entry = [st.st_mode, st.st_nlink, st.st_uid, st.st_gid,
+                     st.st_size, st.st_blocks, st.st_mtime_ns, st.st_ctime_ns]
+            if stat.S_ISLNK(st.st_mode):
+                entry.append(os.readlink(path))
+            elif stat.S_ISREG(st.st_mode):
+                with open(path, 'rb') as f:
+                    entry.append(f.read())
+            if hasattr(os, 'listxattr'):
+                entry.append(sorted((x, os.getxattr(path, x, follow_symlinks=False))
+                                    for x in os.listxattr(path, follow_symlinks=False)))
+            found[os.path.relpath(path, MNT)] = entry
+    return found
+
+make_sure_path_exists(MNT)
+for image in (IMAGE, TRUNCATED):
+    if os.path.exists(image):
+        os.remove(image)
+
+child = mount('snapshot=' + IMAGE)
+populate()
+before = collect()
+unmount(child)
+
+if not os.path.exists(IMAGE):
+    fail('No image was written')
+if before['holes'][5] * 512 >= before['holes'][4]:
+    fail('The file with holes takes all its blocks')
+
+child = mount('restore=' + IMAGE)
+after = collect()
+unmount(child)
+
+if before != after:
+    for path in sorted(set(before) | set(after)):
+        if before.get(path) != after.get(path):
+            sys.stderr.write('{} differs after the restore\n'.format(path))
+    fail('The restored filesystem is not what was saved')
+
+# A cut-off image must stop the mount, not come up empty or half restored
+with open(IMAGE, 'rb') as f:
+    data = f.read()
+with open(TRUNCATED, 'wb') as f:
+    f.write(data[:len(data) // 2])
+child = subprocess.Popen(['src/fuse-cpp-ramfs', MNT, '-o', 'restore=' + TRUNCATED])
+try:
+    child.wait(timeout=10)
+except subprocess.TimeoutExpired:
+    unmount(child, check=False)
+    fail('A truncated image was mounted')
+if child.returncode == 0:
+    fail('A truncated image was not refused')
+if os.path.ismount(MNT):
+    fail('A truncated image left the filesystem mounted')
+
+sys.exit(0)